@@ -0,0 +1,355 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#ifndef _HEAD_SGFTDI_ftdicapture
+#define _HEAD_SGFTDI_ftdicapture
+
+#ifndef SGFTDI
+	#error You must include sgftdi*.h
+#endif // SGFTDI
+
+/*
+	*** Capture files ***
+	Capture is a sequence of segment files named <prefix>.000000.sgcap, <prefix>.000001.sgcap, ...
+	Every segment starts with FtdiCaptureSegmentHeader followed by records. Each record is
+	FtdiCaptureRecordHeader followed by payload, padded to 8 bytes. Record with zero size marks
+	the end of data in segments that were not closed properly. All numbers are in host byte order.
+
+	Compressed segment (flag_compressed) holds FtdiCaptureBlockHeader frames instead of records,
+	each frame is a block of records in the same layout, packed by run-length and LZ codec.
+
+	Closed segment has a sparse index <prefix>.NNNNNN.sgidx, FtdiCaptureIndexHeader followed by
+	FtdiCaptureIndexEntry for every 'index_interval' bytes of records. Reader builds the index
+	in memory for segments without one.
+*/
+
+class FtdiCaptureCodec;
+
+struct FtdiCaptureSegmentHeader
+{
+	static const constexpr char magic_value[8] {'S', 'G', 'F', 'T', 'C', 'A', 'P', '\0'};
+	static const constexpr uint32_t version_value {1};
+	static const constexpr uint32_t flag_compressed {1};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t segment_index;
+
+	/* CLOCK_MONOTONIC in nanoseconds when segment was created */
+	uint64_t created_ns;
+
+	/* Bytes of records after this header and number of records, zero if segment wasn't closed properly */
+	uint64_t data_size;
+	uint64_t record_count;
+
+	uint8_t reserved[16];
+};
+
+static_assert (sizeof (FtdiCaptureSegmentHeader) == 64);
+
+struct FtdiCaptureRecordHeader
+{
+	/* Size of the whole record including this header and padding, zero marks end of data */
+	uint32_t size;
+	uint32_t payload_len;
+
+	/* CLOCK_MONOTONIC in nanoseconds when the transfer was completed */
+	uint64_t timestamp_ns;
+
+	uint32_t stream_id;
+
+	/* Modem status of the last packet of the transfer */
+	uint16_t modem_status;
+
+	uint16_t flags;
+};
+
+static_assert (sizeof (FtdiCaptureRecordHeader) == 24);
+
+struct FtdiCaptureBlockHeader
+{
+	static const constexpr uint32_t codec_stored {0};
+	static const constexpr uint32_t codec_lz {1};
+
+	/* Size of the whole frame including this header and padding, zero marks end of data */
+	uint32_t size;
+	uint32_t codec;
+
+	/* Length of data after this header and length of records after unpacking */
+	uint32_t packed_size;
+	uint32_t raw_size;
+};
+
+static_assert (sizeof (FtdiCaptureBlockHeader) == 16);
+
+struct FtdiCaptureIndexHeader
+{
+	static const constexpr char magic_value[8] {'S', 'G', 'F', 'T', 'I', 'D', 'X', '\0'};
+	static const constexpr uint32_t version_value {1};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t interval;
+	uint64_t segment_index;
+	uint64_t entry_count;
+
+	/* Lowest and highest record timestamp in the segment */
+	uint64_t min_ts;
+	uint64_t max_ts;
+
+	uint8_t reserved[16];
+};
+
+static_assert (sizeof (FtdiCaptureIndexHeader) == 64);
+
+struct FtdiCaptureIndexEntry
+{
+	/* Offset of the first record of the interval from the start of the segment file, */
+	/* offset of the block frame in compressed segment, where every block is one interval */
+	uint64_t offset;
+
+	/* Records from different streams don't have to be ordered by timestamp */
+	uint64_t min_ts;
+	uint64_t max_ts;
+
+	uint32_t record_count;
+
+	/* Bit (stream_id % 32) is set if the interval has a record of that stream */
+	uint32_t stream_mask;
+};
+
+static_assert (sizeof (FtdiCaptureIndexEntry) == 32);
+
+/* Records read transfers into memory-mapped segment files, preallocated to 'segment_size' bytes */
+/* Record is only copied to the mapping, there is no syscall except when segment is rotated */
+/* With compression, records are collected into blocks which are packed and written by a background */
+/* thread (in the same thread in ST version). Only 'compression_blocks' blocks exist at once, */
+/* recording waits for a free one when the writer falls behind. */
+/* Thread safe, one capture may be used as a sink of more streams */
+class FtdiCapture
+{
+	public:
+		static const constexpr size_t default_segment_size {256 * 1024 * 1024};
+		static const constexpr size_t record_alignment {8};
+		static const constexpr size_t default_index_interval {64 * 1024};
+		static const constexpr size_t compression_block_size {256 * 1024};
+		static const constexpr size_t compression_blocks {4};
+
+	private:
+		struct Block
+		{
+			std::vector<unsigned char> raw;
+			FtdiCaptureIndexEntry entry;
+		};
+
+		const std::string _path_prefix;
+		const size_t _segment_size;
+		const size_t _index_interval;
+
+		#ifdef SHAGA_THREADING
+		std::mutex _mutex;
+		#endif // SHAGA_THREADING
+
+		int _fd {-1};
+		unsigned char *_map {nullptr};
+		size_t _pos {0};
+		uint64_t _segment_index {0};
+		uint64_t _segment_records {0};
+		uint_fast64_t _total_records {0};
+		uint_fast64_t _total_bytes {0};
+		std::vector<FtdiCaptureIndexEntry> _index;
+
+		bool _compressed {false};
+		Block _block;
+		std::vector<std::vector<unsigned char>> _spare;
+		size_t _num_buffers {0};
+		std::vector<unsigned char> _packed;
+		std::unique_ptr<FtdiCaptureCodec> _codec;
+		std::string _writer_error;
+
+		#ifdef SHAGA_THREADING
+		std::deque<Block> _queue;
+		std::condition_variable _queue_cond;
+		std::condition_variable _spare_cond;
+		std::thread _writer;
+		bool _writer_busy {false};
+		bool _writer_stop {false};
+
+		void writer (void);
+		#endif // SHAGA_THREADING
+
+		void open_segment (void);
+		void close_segment (void) noexcept;
+		void write_index (void) noexcept;
+
+		/* Blocks are filled under the lock, packed and written to segments without it */
+		void take_buffer (void);
+		void flush_block (void);
+		void write_block (Block &block);
+
+	public:
+		/* Zero 'index_interval' disables writing of the index, with compression every block is one interval */
+		explicit FtdiCapture (const std::string_view path_prefix, const size_t segment_size = default_segment_size, const size_t index_interval = default_index_interval);
+		~FtdiCapture ();
+
+		/* Non-copyable */
+		FtdiCapture (FtdiCapture const&) = delete;
+		FtdiCapture& operator= (FtdiCapture const&) = delete;
+
+		static std::string get_segment_path (const std::string_view path_prefix, const uint64_t segment_index);
+		static std::string get_index_path (const std::string_view path_prefix, const uint64_t segment_index);
+
+		/* Pack records of new segments, must be called before the first record */
+		void set_compression (const bool enabled);
+
+		/* Sink for FtdiStreamEntry::add_read_sink. Use it with a queue, so disk never delays reading. */
+		FtdiStreamEntry::BufferCallback get_sink (void);
+
+		void record (const FtdiBuffer &buffer);
+		void record (const uint_fast32_t stream_id, const uint64_t timestamp_ns, const uint16_t modem_status, const char * const data, const size_t len);
+
+		/* Finish current segment, next record opens a new one. With compression, waits until all */
+		/* blocks are written and throws if writing of any of them failed. */
+		void close (void);
+
+		uint_fast64_t get_records (void);
+		uint_fast64_t get_bytes (void);
+};
+
+/* Reads records of capture segments in order, through read-only mapping of one segment at a time */
+class FtdiCaptureReader
+{
+	public:
+		static const constexpr uint_fast32_t all_streams {UINT_FAST32_MAX};
+
+		struct Record
+		{
+			uint_fast32_t stream_id {0};
+			uint64_t timestamp_ns {0};
+			uint16_t modem_status {0};
+
+			/* Valid until the reader moves to another segment, or another block of compressed segment */
+			const char *data {nullptr};
+			size_t len {0};
+		};
+
+		typedef std::function<void(const Record &record)> RecordCallback;
+
+	private:
+		const std::string _path_prefix;
+
+		int _fd {-1};
+		const unsigned char *_map {nullptr};
+		size_t _map_size {0};
+		size_t _end {0};
+		uint64_t _segment_index {0};
+		bool _compressed {false};
+
+		/* Offset of the next block frame in compressed segment */
+		size_t _pos {0};
+
+		/* Records currently being read, the mapping itself or unpacked block */
+		const unsigned char *_view {nullptr};
+		size_t _view_pos {0};
+		size_t _view_end {0};
+		std::vector<unsigned char> _block;
+
+		bool open_segment (const uint64_t segment_index);
+		void close_segment (void) noexcept;
+		bool open_block (const size_t pos);
+		void position (const size_t offset);
+		const FtdiCaptureRecordHeader * record_at (const size_t pos) const;
+		const FtdiCaptureRecordHeader * current (void);
+		bool load_index (const uint64_t segment_index, FtdiCaptureIndexHeader &header, std::vector<FtdiCaptureIndexEntry> *entries) const;
+		void build_index (std::vector<FtdiCaptureIndexEntry> &entries);
+		bool find_segment (const uint64_t from_ns, const uint64_t to_ns, uint64_t &segment_index, std::vector<FtdiCaptureIndexEntry> &entries);
+
+	public:
+		explicit FtdiCaptureReader (const std::string_view path_prefix);
+		~FtdiCaptureReader ();
+
+		/* Non-copyable */
+		FtdiCaptureReader (FtdiCaptureReader const&) = delete;
+		FtdiCaptureReader& operator= (FtdiCaptureReader const&) = delete;
+
+		/* Returns false after the last record of the last segment */
+		bool next (Record &record);
+
+		/* Start again from the first segment */
+		void rewind (void);
+
+		/* Move to the first record with timestamp at or after 'from_ns', using segment indexes instead */
+		/* of reading the records. Returns false and moves to the end if there is no such record. */
+		bool seek (const uint64_t from_ns);
+
+		/* Call 'callback' for every record of 'stream_id' (or all_streams) with timestamp within */
+		/* [from_ns, to_ns], in capture order. Only index intervals overlapping the window are read, */
+		/* record data points into the mapping. Reader position is moved, use seek or rewind afterwards. */
+		uint_fast64_t find (const uint_fast32_t stream_id, const uint64_t from_ns, const uint64_t to_ns, RecordCallback callback);
+};
+
+/* Feeds capture records back through FtdiStreamEntry as if they came from the device. */
+/* Records of stream N go to streams[N], records of other streams are skipped. Each record is delivered */
+/* as one read transfer with its modem status in every packet, through the same path as FtdiStream: */
+/* read callback, read buffer callback, read sinks and read dispatch. Records longer than a read */
+/* transfer of the stream are split, status-only records are delivered as status-only transfers. */
+class FtdiReplay
+{
+	public:
+		enum class Speed {
+			/* Keep original gaps between records */
+			REALTIME,
+			/* Original gaps divided by 'factor' */
+			SCALED,
+			/* Don't wait at all */
+			ASAP
+		};
+
+	private:
+		std::unique_ptr<FtdiStreamState> _state;
+		FtdiStreamState *_naked_state {nullptr};
+
+		Speed _speed {Speed::REALTIME};
+		double _factor {1.0};
+
+		#ifdef SHAGA_THREADING
+		std::atomic<bool> _should_stop {false};
+		#else
+		bool _should_stop {false};
+		#endif // SHAGA_THREADING
+
+		void init (void);
+		void cleanup (void) noexcept;
+		void deliver (FtdiStreamEntryState &entrystate, const FtdiCaptureReader::Record &record);
+		void wait_for_notice (void);
+
+	public:
+		explicit FtdiReplay (FtdiStreams &streams);
+		~FtdiReplay ();
+
+		/* Non-copyable */
+		FtdiReplay (FtdiReplay const&) = delete;
+		FtdiReplay& operator= (FtdiReplay const&) = delete;
+
+		void set_speed (const Speed speed, const double factor = 1.0);
+
+		/* Same as FtdiStream::set_dispatch_threads */
+		void set_dispatch_threads (const uint_fast32_t num_threads);
+
+		/* Replay all remaining records of the reader, returns number of delivered records */
+		/* Callbacks are called from this thread, or from dispatch threads if configured */
+		uint_fast64_t run (FtdiCaptureReader &reader);
+
+		/* Thread safe, run returns after the current record */
+		void stop (void);
+};
+
+#endif // _HEAD_SGFTDI_ftdicapture
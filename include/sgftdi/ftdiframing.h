@@ -0,0 +1,208 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#ifndef _HEAD_SGFTDI_ftdiframing
+#define _HEAD_SGFTDI_ftdiframing
+
+#ifndef SGFTDI
+	#error You must include sgftdi*.h
+#endif // SGFTDI
+
+/* Finds frames in read payload for FtdiStreamEntry::set_read_framer. Payload is collected across packets */
+/* and transfers by the stream, framer only tells where the frame starting at the beginning of data ends. */
+/* Framer must not keep state between calls, one framer may be shared by more streams and threads. */
+class FtdiFramer
+{
+	public:
+		static const constexpr size_t default_max_frame {64 * 1024};
+
+		struct Frame
+		{
+			/* Part of the data delivered as READ_FRAME */
+			size_t offset {0};
+			size_t len {0};
+
+			/* Invalid frame is skipped and counted in Statistics::frame_errors */
+			bool valid {true};
+
+			/* Valid, but there is nothing to deliver */
+			bool skip {false};
+		};
+
+	protected:
+		const size_t _max_frame;
+
+	public:
+		explicit FtdiFramer (const size_t max_frame = default_max_frame);
+		virtual ~FtdiFramer () = default;
+
+		/* Data without frame end longer than this is dropped and counted as frame error */
+		size_t get_max_frame (void) const noexcept;
+
+		/* Returns number of bytes the frame at the start of 'data' takes, zero if more data is needed. */
+		/* First 'scanned' bytes were passed to the previous call with the same frame start, which returned zero. */
+		virtual size_t find (const char * const data, const size_t len, const size_t scanned, Frame &frame) const = 0;
+
+		/* Frames found by 'find' have to be decoded before delivery */
+		virtual bool has_decoder (void) const noexcept;
+
+		/* Decode frame in place, it can only shrink. Returns false if frame is not valid. */
+		virtual bool decode (char * const frame, size_t &len) const;
+};
+
+/* Frames end with 'delimiter', which is not part of delivered frame unless 'keep_delimiter' is set */
+class FtdiDelimiterFramer : public FtdiFramer
+{
+	private:
+		const char _delimiter;
+		const bool _keep_delimiter;
+		const bool _skip_empty;
+
+	public:
+		explicit FtdiDelimiterFramer (const char delimiter, const bool keep_delimiter = false, const bool skip_empty = true, const size_t max_frame = default_max_frame);
+
+		size_t find (const char * const data, const size_t len, const size_t scanned, Frame &frame) const override;
+};
+
+/* SLIP (RFC 1055) frames, delivered decoded. Empty frames between END bytes are skipped. */
+class FtdiSlipFramer : public FtdiDelimiterFramer
+{
+	public:
+		static const constexpr char end_byte {static_cast<char> (0xc0)};
+		static const constexpr char esc_byte {static_cast<char> (0xdb)};
+		static const constexpr char esc_end_byte {static_cast<char> (0xdc)};
+		static const constexpr char esc_esc_byte {static_cast<char> (0xdd)};
+
+		explicit FtdiSlipFramer (const size_t max_frame = default_max_frame);
+
+		bool has_decoder (void) const noexcept override;
+		bool decode (char * const frame, size_t &len) const override;
+};
+
+/* COBS frames terminated by zero byte, delivered decoded */
+class FtdiCobsFramer : public FtdiDelimiterFramer
+{
+	public:
+		explicit FtdiCobsFramer (const size_t max_frame = default_max_frame);
+
+		bool has_decoder (void) const noexcept override;
+		bool decode (char * const frame, size_t &len) const override;
+};
+
+/* Frames start with a header of 'length_offset' bytes followed by 'length_bytes' (1, 2 or 4) long length */
+/* of the rest of the frame. 'adjust' is added to the length, e.g. negative size of the header if length */
+/* counts the whole frame. Whole frame is delivered, or just the part after length if 'strip_header' is set. */
+class FtdiLengthFramer : public FtdiFramer
+{
+	private:
+		const size_t _length_offset;
+		const uint_fast32_t _length_bytes;
+		const bool _big_endian;
+		const int_fast32_t _adjust;
+		const bool _strip_header;
+
+	public:
+		explicit FtdiLengthFramer (const uint_fast32_t length_bytes, const bool big_endian = false, const size_t length_offset = 0, const int_fast32_t adjust = 0, const bool strip_header = true, const size_t max_frame = default_max_frame);
+
+		size_t find (const char * const data, const size_t len, const size_t scanned, Frame &frame) const override;
+};
+
+/* Checks CRC of every frame before delivery, see FtdiStreamEntry::set_read_crc */
+/* CRC follows the frame and covers everything the framer delivers before it. */
+class FtdiCrcCheck
+{
+	public:
+		enum class Algorithm {
+			/* CRC-16/CCITT-FALSE: polynomial 0x1021, init 0xffff, not reflected */
+			CRC16_CCITT,
+			/* CRC-32 as used by Ethernet and zlib */
+			CRC32,
+			/* CRC-32C (Castagnoli) as used by iSCSI and SCTP */
+			CRC32C,
+		};
+
+		enum class Action {
+			/* Frame with bad CRC is dropped */
+			DROP,
+			/* Frame with bad CRC is delivered as READ_FRAME_BAD_CRC */
+			FLAG,
+		};
+
+	private:
+		const Algorithm _algorithm;
+		const bool _big_endian;
+		const bool _strip;
+		const Action _action;
+
+	public:
+		/* 'big_endian' is byte order of CRC in the frame, 'strip' removes CRC from delivered frames */
+		explicit FtdiCrcCheck (const Algorithm algorithm, const bool big_endian = false, const bool strip = true, const Action action = Action::DROP);
+
+		Algorithm get_algorithm (void) const noexcept;
+		Action get_action (void) const noexcept;
+
+		/* Number of CRC bytes */
+		size_t get_size (void) const noexcept;
+
+		/* Returns true if CRC at the end of 'frame' matches. With 'strip', 'len' is shortened even if it doesn't. */
+		bool check (const char * const frame, size_t &len) const noexcept;
+
+		/* Store CRC of 'len' bytes after them, there must be room for get_size () bytes. Returns new length. */
+		size_t append (char * const frame, const size_t len) const noexcept;
+
+		/* CRC of 'len' bytes including the final xor */
+		static uint32_t compute (const Algorithm algorithm, const char * const data, const size_t len) noexcept;
+};
+
+/* Encodes frames for FtdiStreamEntry::set_write_encoder */
+/* Encoder must not keep state between calls, one encoder may be shared by more streams. */
+class FtdiEncoder
+{
+	protected:
+		const size_t _max_frame;
+
+	public:
+		explicit FtdiEncoder (const size_t max_frame = FtdiFramer::default_max_frame);
+		virtual ~FtdiEncoder () = default;
+
+		/* Longest frame before encoding */
+		size_t get_max_frame (void) const noexcept;
+
+		/* Upper bound of encoded length of a frame of 'len' bytes */
+		virtual size_t max_encoded (const size_t len) const noexcept = 0;
+
+		/* Encode frame into 'dst' with room for max_encoded (len) bytes, returns encoded length */
+		virtual size_t encode (const char * const src, const size_t len, char * const dst) const noexcept = 0;
+};
+
+/* SLIP (RFC 1055), frame ends with END. With 'leading_end' it also starts with one, to flush line noise. */
+class FtdiSlipEncoder : public FtdiEncoder
+{
+	private:
+		const bool _leading_end;
+
+	public:
+		explicit FtdiSlipEncoder (const bool leading_end = true, const size_t max_frame = FtdiFramer::default_max_frame);
+
+		size_t max_encoded (const size_t len) const noexcept override;
+		size_t encode (const char * const src, const size_t len, char * const dst) const noexcept override;
+};
+
+/* COBS, frame ends with zero byte */
+class FtdiCobsEncoder : public FtdiEncoder
+{
+	public:
+		explicit FtdiCobsEncoder (const size_t max_frame = FtdiFramer::default_max_frame);
+
+		size_t max_encoded (const size_t len) const noexcept override;
+		size_t encode (const char * const src, const size_t len, char * const dst) const noexcept override;
+};
+
+#endif // _HEAD_SGFTDI_ftdiframing
@@ -0,0 +1,184 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#ifndef _HEAD_SGFTDI_ftdiloopback
+#define _HEAD_SGFTDI_ftdiloopback
+
+#ifndef SGFTDI
+	#error You must include sgftdi*.h
+#endif // SGFTDI
+
+class FtdiLoopbackState;
+class FtdiLatencyProbeState;
+
+/*
+	*** Loopback test ***
+	Stream attached to the test sends endless PRBS and checks that the same sequence comes back,
+	so TX has to be wired to RX. Bit N of the sequence is bit (N % 8) of byte (N / 8), which matches
+	the order of bits on serial line. Sequences are not inverted, the generator starts with all ones.
+
+	Checker compares received bytes with its own copy of the sequence. Window of 64 bytes with more
+	than a quarter of bits wrong means loss of sync, the next 64 bytes are then searched for in the
+	following 'max_slip' bytes of the sequence to count lost bytes, and the checker continues from there.
+	Bytes that were not found are counted only as resync, latency measurement then stops.
+
+	Test runs with FtdiReplay too: replay of a capture recorded during a test gives the same results
+	on the read side, nothing is sent.
+*/
+class FtdiLoopbackTest
+{
+	public:
+		enum class Pattern {
+			/* x^7 + x^6 + 1 */
+			PRBS7,
+			/* x^15 + x^14 + 1 */
+			PRBS15,
+			/* x^23 + x^18 + 1 */
+			PRBS23,
+			/* x^31 + x^28 + 1 */
+			PRBS31,
+		};
+
+		static const constexpr size_t default_max_slip {65536};
+
+		struct Results
+		{
+			/* Confirmed by WRITE_CONFIRM_TRANSFER */
+			uint_fast64_t bytes_sent {0};
+
+			uint_fast64_t bytes_received {0};
+
+			/* Received bytes compared with the sequence while in sync */
+			uint_fast64_t bytes_checked {0};
+
+			uint_fast64_t error_bits {0};
+
+			/* Bytes missing in received sequence, found by resync */
+			uint_fast64_t lost_bytes {0};
+
+			uint_fast32_t resyncs {0};
+
+			bool in_sync {false};
+
+			/* CLOCK_MONOTONIC of the first and the last received byte */
+			uint64_t first_ns {0};
+			uint64_t last_ns {0};
+
+			/* Time from filling write transfer to arrival of its first byte */
+			uint_fast64_t latency_samples {0};
+			uint64_t latency_min_ns {0};
+			uint64_t latency_max_ns {0};
+			uint64_t latency_sum_ns {0};
+
+			/* Received bytes per second */
+			double get_throughput (void) const noexcept;
+
+			/* Error bits per checked bit */
+			double get_bit_error_rate (void) const noexcept;
+
+			uint64_t get_latency_avg_ns (void) const noexcept;
+		};
+
+	private:
+		std::shared_ptr<FtdiLoopbackState> _state;
+
+	public:
+		explicit FtdiLoopbackTest (const Pattern pattern, const size_t max_slip = default_max_slip);
+		~FtdiLoopbackTest ();
+
+		/* Non-copyable */
+		FtdiLoopbackTest (FtdiLoopbackTest const&) = delete;
+		FtdiLoopbackTest& operator= (FtdiLoopbackTest const&) = delete;
+
+		/* Set read and write callbacks of the stream and enable read timing events */
+		/* Callbacks share the state with the test, results stay available after the stream ends */
+		void attach (FtdiStreamEntry &entry);
+
+		/* Safe to call from any thread while the test runs */
+		Results get_results (void) const;
+
+		/* Start counting again, checker keeps its sync */
+		void reset_results (void);
+};
+
+/*
+	*** Latency probe ***
+	Stream attached to the probe sends a marker every 'interval_ms', TX has to be wired to RX.
+	Write transfers are paced by timerfd returned as WRITE_GET_FD, so markers go through the same
+	stream loop, transfers and callbacks as any other data and latency includes all of it.
+
+	Marker is 13 bytes: 0xa5, 16-bit sequence number, 64-bit CLOCK_MONOTONIC in nanoseconds taken
+	when the write transfer was filled, and CRC-16/CCITT-FALSE of the previous bytes. Numbers are little endian.
+	Latency is measured to estimated arrival of the first marker byte, see FtdiReadTiming.
+*/
+class FtdiLatencyProbe
+{
+	public:
+		static const constexpr uint_fast32_t default_interval_ms {10};
+		static const constexpr uint64_t default_bucket_ns {50'000};
+		static const constexpr size_t default_buckets {400};
+
+		static const constexpr size_t marker_size {13};
+		static const constexpr char marker_sync {static_cast<char> (0xa5)};
+
+		struct Results
+		{
+			uint_fast64_t sent {0};
+			uint_fast64_t received {0};
+
+			/* Markers missing in received sequence numbers, damaged ones included */
+			uint_fast64_t lost {0};
+
+			/* Markers with wrong check byte */
+			uint_fast64_t damaged {0};
+
+			/* counts[i] is number of samples in [i * bucket_ns, (i + 1) * bucket_ns) */
+			uint64_t bucket_ns {0};
+			std::vector<uint_fast64_t> counts;
+
+			/* Samples beyond the last bucket */
+			uint_fast64_t overflow {0};
+
+			uint_fast64_t samples {0};
+			uint64_t min_ns {0};
+			uint64_t max_ns {0};
+			uint64_t sum_ns {0};
+
+			uint64_t get_avg_ns (void) const noexcept;
+
+			/* Upper edge of the bucket that reaches 'fraction' of samples, e.g. 0.99, max_ns within overflow */
+			uint64_t get_percentile_ns (const double fraction) const noexcept;
+
+			/* Summary and one line per non-empty bucket */
+			void print (const std::string_view prefix = ""sv) const;
+		};
+
+	private:
+		std::shared_ptr<FtdiLatencyProbeState> _state;
+
+	public:
+		explicit FtdiLatencyProbe (const uint_fast32_t interval_ms = default_interval_ms, const uint64_t bucket_ns = default_bucket_ns, const size_t buckets = default_buckets);
+		~FtdiLatencyProbe ();
+
+		/* Non-copyable */
+		FtdiLatencyProbe (FtdiLatencyProbe const&) = delete;
+		FtdiLatencyProbe& operator= (FtdiLatencyProbe const&) = delete;
+
+		/* Set read and write callbacks of the stream and enable read timing events */
+		void attach (FtdiStreamEntry &entry);
+
+		/* Safe to call from any thread while the probe runs */
+		Results get_results (void) const;
+
+		/* Clear histogram and counters, e.g. after changing latency timer */
+		void reset_results (void);
+};
+
+#endif // _HEAD_SGFTDI_ftdiloopback
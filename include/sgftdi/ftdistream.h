@@ -22,11 +22,21 @@ extern "C"
 	void ftdi_deinit_ex (struct ftdi_context *ftdi);
 	void ftdi_free_ex (struct ftdi_context *ftdi);
 	int ftdi_usb_get_strings_ex (struct ftdi_context *ftdi, struct libusb_device *dev, char *manufacturer, int mnf_len, char *description, int desc_len, char *serial, int serial_len);
+	int ftdi_get_baudrate_request_ex (struct ftdi_context *ftdi, int baudrate, unsigned short *value, unsigned short *index);
 }
 
 class FtdiStreamStatic;
 class FtdiStreamStaticState;
 class FtdiStreamState;
+class FtdiStreamEntryState;
+class FtdiStreamDispatch;
+class FtdiReplay;
+class FtdiFramer;
+class FtdiFramingState;
+class FtdiCrcCheck;
+class FtdiEncoder;
+class FtdiEncodingState;
+struct FtdiBufferBlock;
 
 class FtdiContext
 {
@@ -62,6 +72,22 @@ class FtdiContext
 				DTR_DSR = SIO_DTR_DSR_HS,
 				XON_XOFF = SIO_XON_XOFF_HS
 			} flow {FlowControl::DISABLE_FLOW_CTRL};
+
+			struct LatencyTimer
+			{
+				enum class Mode {
+					/* Use 'value' all the time */
+					FIXED,
+					/* Start with 'value' and let FtdiStream move it between 'min' and 'max' according to observed traffic */
+					AUTO
+				} mode {Mode::FIXED};
+
+				/* 1 - 255 ms, zero keeps the device default (16 ms) */
+				uint8_t value {0};
+
+				uint8_t min {1};
+				uint8_t max {16};
+			} latency_timer;
 		};
 
 	private:
@@ -123,6 +149,71 @@ class FtdiContext
 		}
 };
 
+/* Host time of one read transfer and estimated arrival of its payload bytes on the line. Device sends */
+/* a packet when it is full or when the latency timer expires, so the last byte of a full last packet */
+/* arrived right before completion, while the last byte of a short one arrived within the last latency */
+/* period (middle of it is assumed). Earlier bytes are spaced by the time of one character at the current */
+/* baudrate and never estimated before the last byte of the previous transfer. */
+struct FtdiReadTiming
+{
+	/* CLOCK_MONOTONIC in nanoseconds when the transfer was completed */
+	uint64_t timestamp_ns {0};
+
+	/* Estimated arrival of the last payload byte, CLOCK_MONOTONIC in nanoseconds */
+	uint64_t last_byte_ns {0};
+
+	/* Estimated arrival of the last payload byte of the previous transfer of the stream */
+	uint64_t previous_ns {0};
+
+	/* Time of one character on the line, zero if baudrate is not known */
+	uint64_t byte_ns {0};
+
+	/* Payload bytes of the transfer, without modem status */
+	uint32_t length {0};
+
+	/* Estimated arrival of payload byte 'index' of the transfer */
+	uint64_t estimate (const size_t index) const noexcept;
+};
+
+/* Payload of one read transfer lent to the user by read buffer callback, modem status bytes are removed */
+/* Handle may be kept after the callback returns, copies share the same buffer without copying the data */
+/* Buffer returns to the spare pool of its stream when the last handle is released, from any thread */
+class FtdiBuffer
+{
+	private:
+		FtdiBufferBlock *_block {nullptr};
+
+		explicit FtdiBuffer (FtdiBufferBlock * const block) noexcept;
+
+	public:
+		FtdiBuffer () noexcept = default;
+		~FtdiBuffer ();
+
+		FtdiBuffer (const FtdiBuffer &other) noexcept;
+		FtdiBuffer (FtdiBuffer &&other) noexcept;
+		FtdiBuffer& operator= (const FtdiBuffer &other) noexcept;
+		FtdiBuffer& operator= (FtdiBuffer &&other) noexcept;
+
+		const char * data (void) const noexcept;
+		size_t size (void) const noexcept;
+		bool empty (void) const noexcept;
+		uint_fast32_t get_stream_id (void) const noexcept;
+
+		/* CLOCK_MONOTONIC in nanoseconds when the transfer was completed */
+		uint64_t get_timestamp (void) const noexcept;
+
+		/* Modem status of the last packet of the transfer */
+		uint16_t get_modem_status (void) const noexcept;
+
+		FtdiReadTiming get_timing (void) const noexcept;
+
+		/* Release the buffer before the handle is destroyed */
+		void reset (void) noexcept;
+
+		friend class FtdiStreamEntryState;
+		friend class FtdiStreamDispatch;
+};
+
 class FtdiStreamEntry
 {
 	public:
@@ -141,10 +232,40 @@ class FtdiStreamEntry
 			/* Ignore 'buffer' parameter */
 			WRITE_CONFIRM_TRANSFER,
 
-			/* Got' buffer' filled with 'len' bytes. */
-			/* If modem status is included, it is stored in the first two bytes of 'buffer' and 'len' is at least 2. */
+			/* Got 'buffer' filled with 'len' bytes of payload. Modem status bytes are never included. */
+			/* Not called if read buffer callback is set. With read dispatch, called from dispatch thread instead of FtdiStream thread */
 			/* Return value is ignored */
 			READ_BUFFER,
+
+			/* Return number of received bytes not yet consumed by the user, used only with read watermarks */
+			/* Called from FtdiStream thread after every read transfer and periodically while reading is stopped */
+			/* Ignore 'buffer' and 'len', return negative number in case of error */
+			READ_GET_PENDING,
+
+			/* Modem status changed, 'buffer' contains two modem status bytes and 'len' is 2 */
+			/* Raised only on change of CTS, DSR, RI, RLSD or line error bits (OE, PE, FE, BI, FIFO error), */
+			/* before the payload of the packet with the new status. The first status is always reported. */
+			/* With read dispatch, called from dispatch thread instead of FtdiStream thread */
+			/* Return value is ignored */
+			MODEM_STATUS_CHANGED,
+
+			/* Called before READ_BUFFER of every transfer with payload, if enabled by set_read_timing_events */
+			/* 'buffer' points to FtdiReadTiming of the transfer and 'len' is its size. Payload of the transfer */
+			/* is then delivered in one or more READ_BUFFER calls, indexes of FtdiReadTiming::estimate continue */
+			/* across them. Called from the same thread as READ_BUFFER. Return value is ignored. */
+			READ_TIMING,
+
+			/* Got whole frame in 'buffer' of 'len' bytes, called instead of READ_BUFFER if read framer is set */
+			/* Buffer is valid only during the call. Called from the same thread as READ_BUFFER. Return value is ignored. */
+			READ_FRAME,
+
+			/* Called instead of WRITE_FILL_BUFFER if write encoder is set. Fill 'buffer' with one whole frame */
+			/* of up to 'len' bytes and return its length, the frame is taken at that moment. Return zero if */
+			/* no frame is ready, negative number in case of error. WRITE_CONFIRM_TRANSFER still reports encoded bytes. */
+			WRITE_FILL_FRAME,
+
+			/* Same as READ_FRAME for frame that failed read CRC check with FtdiCrcCheck::Action::FLAG */
+			READ_FRAME_BAD_CRC,
 		};
 
 		/*
@@ -175,27 +296,90 @@ class FtdiStreamEntry
 			- B7       Error in RCVR FIFO
 		*/
 
+		/* Per stream statistics, counted since the previous statistics callback (once per second) */
+		struct Statistics
+		{
+			/* Line errors from the second modem status byte, counted per packet */
+			uint_fast32_t overrun_errors {0};
+			uint_fast32_t parity_errors {0};
+			uint_fast32_t framing_errors {0};
+			uint_fast32_t break_interrupts {0};
+			uint_fast32_t fifo_errors {0};
+
+			/* Number of times reading was stopped by high watermark */
+			uint_fast32_t throttled {0};
+
+			/* Stream is in idle mode */
+			bool idle {false};
+
+			/* Latency timer set by auto-tune, zero if not known */
+			uint8_t latency_timer {0};
+
+			/* Buffers skipped by read sinks with SinkOverflow::DROP */
+			uint_fast32_t sink_drops {0};
+
+			/* Invalid frames and data dropped by read framer for exceeding maximal frame size */
+			uint_fast32_t frame_errors {0};
+
+			/* Frames that failed read CRC check */
+			uint_fast32_t bad_crc {0};
+		};
+
+		/* What a read sink with its own queue does when the queue is full */
+		enum class SinkOverflow {
+			/* Keep waiting buffers, reading stops when the stream runs out of spare buffers */
+			BLOCK,
+			/* Skip the buffer for this sink only, other sinks still get it */
+			DROP
+		};
+
 		/* Important! Callbacks will be called from FtdiStream thread. Don't forget about synchronization! */
 		typedef std::function<int(const CallbackType type, char * const buffer, const int len)> Callback;
 		typedef std::function<void(const bool is_reading, const uint_fast32_t tranfer_id, const uint_fast32_t cnt_callbacks, const uint_fast32_t cnt_bytes)> CounterCallback;
 		typedef std::function<void(struct ftdi_context * const ftdi)> ResetCallback;
+		typedef std::function<void(const uint_fast32_t stream_id, const Statistics &stats)> StatisticsCallback;
+
+		/* Copy the handle to keep the payload after the callback returns. Called from the same thread as READ_BUFFER. */
+		typedef std::function<void(const uint_fast32_t stream_id, const FtdiBuffer &buffer)> BufferCallback;
 
 	private:
+		struct ReadSink
+		{
+			BufferCallback callback {nullptr};
+			uint_fast32_t queue_depth {0};
+			SinkOverflow overflow {SinkOverflow::BLOCK};
+		};
+
 		struct ftdi_context * const ftdi {nullptr};
 
 		bool read_start_enabled {true};
-		bool read_include_modem_status {false};
+		bool read_modem_status_events {false};
+		bool read_timing_events {false};
+		uint_fast32_t read_char_bits {10};
+		uint_fast32_t read_idle_threshold {0};
+		uint_fast32_t read_watermark_high {0};
+		uint_fast32_t read_watermark_low {0};
+		uint_fast32_t read_dispatch_depth {0};
+		uint_fast32_t read_spare_buffers {0};
 
 		Callback read_callback {nullptr};
+		BufferCallback read_buffer_callback {nullptr};
+		std::vector<ReadSink> read_sinks;
+		std::shared_ptr<FtdiFramer> read_framer;
+		std::shared_ptr<FtdiCrcCheck> read_crc;
 		uint_fast32_t read_transfers {0};
 		uint_fast32_t read_packets_per_transfer {0};
 
 		Callback write_callback {nullptr};
+		std::shared_ptr<FtdiEncoder> write_encoder;
 		uint_fast32_t write_transfers {0};
 		uint_fast32_t write_packets_per_transfer {0};
 
 		CounterCallback counter_callback {nullptr};
 		ResetCallback reset_callback {nullptr};
+		StatisticsCallback statistics_callback {nullptr};
+
+		FtdiContext::Config::LatencyTimer latency_timer;
 
 	public:
 		explicit FtdiStreamEntry (struct ftdi_context *_ftdi);
@@ -203,9 +387,36 @@ class FtdiStreamEntry
 		/* Start reading immediately, default = yes */
 		void set_read_start_enabled (const bool enabled);
 
-		/* Include modem status bytes, default = no */
+		/* Raise MODEM_STATUS_CHANGED events, default = no */
+		void set_read_modem_status_events (const bool enabled);
+
+		/* Deprecated, modem status is no longer included in READ_BUFFER. Same as set_read_modem_status_events. */
 		void set_read_include_modem_status (const bool enabled);
 
+		/* Raise READ_TIMING events, default = no. FtdiBuffer carries the timing regardless. */
+		void set_read_timing_events (const bool enabled);
+
+		/* Bits on the line per received byte for FtdiReadTiming, including start, parity and stop bits. */
+		/* Default = 10 (8N1). In bitbang modes set it so that baudrate / bits is the sample rate. */
+		void set_read_char_bits (const uint_fast32_t bits);
+
+		/* Enter idle mode after this many consecutive status-only read completions, zero = never (default) */
+		/* While idle, only one read transfer stays in flight. Full depth is restored with the first payload byte. */
+		void set_read_idle_threshold (const uint_fast32_t completions);
+
+		/* When READ_GET_PENDING reports at least 'high' bytes, read transfers are not resubmitted */
+		/* until it drops to 'low' bytes or less. Device flow control takes over meanwhile. high = 0 disables (default). */
+		void set_read_watermarks (const uint_fast32_t high, const uint_fast32_t low);
+
+		/* Deliver READ_BUFFER and MODEM_STATUS_CHANGED from dispatch threads, zero = from FtdiStream thread (default) */
+		/* Read transfer is resubmitted with a spare buffer right away, up to 'queue_depth' filled transfers wait for */
+		/* delivery. When all of them are waiting, reading stops until one is delivered. Needs FtdiStream::set_dispatch_threads. */
+		void set_read_dispatch (const uint_fast32_t queue_depth);
+
+		/* Spare buffers for handles kept by the user of read buffer callback, on top of read dispatch queue depth */
+		/* When all spare buffers are held, read transfers wait until one is released. Default = 0. */
+		void set_read_spare_buffers (const uint_fast32_t buffers);
+
 		void set_read_transfers (const uint_fast32_t packets_per_transfer = 1, const uint_fast32_t transfers = 1);
 		void set_write_transfers (const uint_fast32_t packets_per_transfer = 1, const uint_fast32_t transfers = 1);
 
@@ -213,19 +424,75 @@ class FtdiStreamEntry
 		void set_read_callback (Callback callback);
 		void set_write_callback (Callback callback);
 
+		/* Lend payload of every read transfer instead of calling READ_BUFFER. Read callback is still needed for other types. */
+		void set_read_buffer_callback (BufferCallback callback);
+
+		/* Add another consumer of read payload, all sinks share the same buffers with read buffer callback. */
+		/* With queue_depth = 0 the sink is called right after read buffer callback, from the same thread. */
+		/* Otherwise it has its own queue drained by dispatch threads, so a slow sink doesn't delay the others. */
+		/* 'queue_depth' buffers are added to the spare pool for it. Needs FtdiStream::set_dispatch_threads. */
+		void add_read_sink (BufferCallback callback, const uint_fast32_t queue_depth = 0, const SinkOverflow overflow = SinkOverflow::BLOCK);
+
+		/* Deliver READ_FRAME with whole frames instead of READ_BUFFER, nullptr disables (default) */
+		/* Incomplete frame is kept by the stream between packets and transfers. Read buffer callback */
+		/* and read sinks still get unframed payload. */
+		void set_read_framer (std::shared_ptr<FtdiFramer> framer);
+
+		/* Check CRC of frames found by read framer, which is required. nullptr disables (default) */
+		void set_read_crc (std::shared_ptr<FtdiCrcCheck> crc);
+
+		/* Take whole frames by WRITE_FILL_FRAME and send them encoded, nullptr disables (default) */
+		/* Encoded frame that doesn't fit into a write transfer continues in the next one. */
+		void set_write_encoder (std::shared_ptr<FtdiEncoder> encoder);
+
 		void set_counter_callback (CounterCallback callback);
 		void set_reset_callback (ResetCallback callback);
+		void set_statistics_callback (StatisticsCallback callback);
+
+		/* Usually the same policy as in FtdiContext::Config. In AUTO mode the timer is lowered for interactive */
+		/* traffic (small, partially filled transfers) and raised for bulk traffic (full transfers). */
+		void set_latency_timer_policy (const FtdiContext::Config::LatencyTimer &policy);
 
 		friend class FtdiStream;
 		friend class FtdiStreamState;
 		friend class FtdiStreamStatic;
 		friend class FtdiStreamStaticState;
+		friend class FtdiStreamEntryState;
+		friend class FtdiReplay;
+		friend class FtdiFramingState;
+		friend class FtdiEncodingState;
 };
 
 typedef std::vector<FtdiStreamEntry> FtdiStreams;
 
 class FtdiStream
 {
+	public:
+		/* Line parameters changed by set_line. Only parameters that are set are changed. */
+		struct LineParams
+		{
+			enum class Pin {
+				UNCHANGED,
+				LOW,
+				HIGH
+			};
+
+			/* Zero means unchanged */
+			int baudrate {0};
+
+			Pin dtr {Pin::UNCHANGED};
+			Pin rts {Pin::UNCHANGED};
+
+			/* Zero means unchanged, otherwise 1 - 255 ms */
+			uint8_t latency_timer {0};
+
+			bool change_flow {false};
+			FtdiContext::Config::FlowControl flow {FtdiContext::Config::FlowControl::DISABLE_FLOW_CTRL};
+		};
+
+		/* Called from FtdiStream thread after all requested changes are done or after the first one fails */
+		typedef std::function<void(const uint_fast32_t stream_id, const bool success)> LineCallback;
+
 	private:
 		std::unique_ptr<FtdiStreamState> _state;
 		FtdiStreamState *_naked_state {nullptr};
@@ -247,6 +514,10 @@ class FtdiStream
 		void set_timeout (const uint_fast64_t timeout);
 		uint_fast64_t get_timeout (void) const;
 
+		/* Number of threads delivering read transfers of streams with read dispatch, shared by all streams */
+		/* Transfers of one stream are always delivered in order, by one thread at a time */
+		void set_dispatch_threads (const uint_fast32_t num_threads);
+
 		/* Thread safe methods */
 		size_t get_errors (shaga::COMMON_LIST &append_to_lst);
 		shaga::COMMON_LIST get_errors (void);
@@ -265,8 +536,15 @@ class FtdiStream
 
 		void enable_reading (const uint_fast32_t stream_id);
 		void disable_reading (const uint_fast32_t stream_id);
+
+		/* Reset is done by asynchronous control transfers from the stream thread, other streams are not blocked */
+		/* If reset callback is set for the stream, it is called synchronously instead */
 		void reset_stream (const uint_fast32_t stream_id);
 
+		/* Change line parameters by asynchronous control transfers from the stream thread */
+		/* Transfers in flight are not interrupted. Requests for one stream are processed in order. */
+		void set_line (const uint_fast32_t stream_id, const LineParams &params, LineCallback callback = nullptr);
+
 		bool is_started_thread (void) const;
 		bool is_active_thread (void) const;
 };
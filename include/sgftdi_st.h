@@ -28,5 +28,8 @@
 
 #include "sgftdi/ftdi.h"
 #include "sgftdi/ftdistream.h"
+#include "sgftdi/ftdiframing.h"
+#include "sgftdi/ftdicapture.h"
+#include "sgftdi/ftdiloopback.h"
 
 #endif // _HEAD_SGFTDI_full_st
@@ -0,0 +1,244 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+using namespace shaga;
+
+/* FtdiBufferBlock */
+
+void FtdiBufferBlock::ref (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	refs.fetch_add (1, std::memory_order_relaxed);
+	#else
+	++refs;
+	#endif // SHAGA_THREADING
+}
+
+void FtdiBufferBlock::unref (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	if (refs.fetch_sub (1, std::memory_order_acq_rel) == 1) {
+		pool->release (this);
+	}
+	#else
+	if ((--refs) == 0) {
+		pool->release (this);
+	}
+	#endif // SHAGA_THREADING
+}
+
+/* FtdiReadTiming */
+
+uint64_t FtdiReadTiming::estimate (const size_t index) const noexcept
+{
+	if (index >= length) {
+		return last_byte_ns;
+	}
+
+	const uint64_t back = static_cast<uint64_t> (length - 1 - index) * byte_ns;
+	if (back >= last_byte_ns || (last_byte_ns - back) < previous_ns) {
+		return previous_ns;
+	}
+	return last_byte_ns - back;
+}
+
+/* FtdiBuffer */
+
+FtdiBuffer::FtdiBuffer (FtdiBufferBlock * const block) noexcept :
+	_block (block)
+{
+	if (nullptr != _block) {
+		_block->ref ();
+	}
+}
+
+FtdiBuffer::~FtdiBuffer ()
+{
+	reset ();
+}
+
+FtdiBuffer::FtdiBuffer (const FtdiBuffer &other) noexcept :
+	FtdiBuffer (other._block)
+{ }
+
+FtdiBuffer::FtdiBuffer (FtdiBuffer &&other) noexcept :
+	_block (std::exchange (other._block, nullptr))
+{ }
+
+FtdiBuffer& FtdiBuffer::operator= (const FtdiBuffer &other) noexcept
+{
+	if (this != &other) {
+		if (nullptr != other._block) {
+			other._block->ref ();
+		}
+		reset ();
+		_block = other._block;
+	}
+	return *this;
+}
+
+FtdiBuffer& FtdiBuffer::operator= (FtdiBuffer &&other) noexcept
+{
+	if (this != &other) {
+		reset ();
+		_block = std::exchange (other._block, nullptr);
+	}
+	return *this;
+}
+
+const char * FtdiBuffer::data (void) const noexcept
+{
+	return (nullptr != _block) ? _block->payload : nullptr;
+}
+
+size_t FtdiBuffer::size (void) const noexcept
+{
+	return (nullptr != _block) ? _block->payload_len : 0;
+}
+
+bool FtdiBuffer::empty (void) const noexcept
+{
+	return 0 == size ();
+}
+
+uint_fast32_t FtdiBuffer::get_stream_id (void) const noexcept
+{
+	return (nullptr != _block) ? _block->stream_id : UINT_FAST32_MAX;
+}
+
+uint64_t FtdiBuffer::get_timestamp (void) const noexcept
+{
+	return (nullptr != _block) ? _block->timing.timestamp_ns : 0;
+}
+
+FtdiReadTiming FtdiBuffer::get_timing (void) const noexcept
+{
+	return (nullptr != _block) ? _block->timing : FtdiReadTiming ();
+}
+
+uint16_t FtdiBuffer::get_modem_status (void) const noexcept
+{
+	return (nullptr != _block) ? _block->modem_status : 0;
+}
+
+void FtdiBuffer::reset (void) noexcept
+{
+	if (nullptr != _block) {
+		std::exchange (_block, nullptr)->unref ();
+	}
+}
+
+/* FtdiBufferPool */
+
+FtdiBufferPool::FtdiBufferPool (FtdiStreamState * const _state) :
+	state (_state)
+{ }
+
+FtdiBufferPool::~FtdiBufferPool ()
+{
+	for (std::unique_ptr<FtdiBufferBlock> &block : blocks) {
+		::free (block->buffer);
+	}
+}
+
+FtdiBufferPool * FtdiBufferPool::create (FtdiStreamState * const state, const uint_fast32_t stream_id, const uint_fast32_t num_blocks, const size_t buffer_size)
+{
+	FtdiBufferPool * const pool = new FtdiBufferPool (state);
+
+	try {
+		pool->blocks.reserve (num_blocks);
+		pool->spare.reserve (num_blocks);
+
+		for (uint_fast32_t i = 0; i < num_blocks; ++i) {
+			unsigned char * const buffer = reinterpret_cast<unsigned char *> (::malloc (buffer_size));
+			if (nullptr == buffer) {
+				cThrow ("@{}: Unable to allocate read buffer of {} bytes"sv, stream_id, buffer_size);
+			}
+
+			try {
+				pool->blocks.push_back (std::make_unique<FtdiBufferBlock> (pool, buffer, stream_id));
+			}
+			catch (...) {
+				::free (buffer);
+				throw;
+			}
+			pool->spare.push_back (pool->blocks.back ().get ());
+		}
+	}
+	catch (...) {
+		delete pool;
+		throw;
+	}
+
+	return pool;
+}
+
+FtdiBufferBlock * FtdiBufferPool::take (void)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (mutex);
+	#endif // SHAGA_THREADING
+
+	if (true == spare.empty ()) {
+		starved = true;
+		return nullptr;
+	}
+
+	FtdiBufferBlock * const block = spare.back ();
+	spare.pop_back ();
+	return block;
+}
+
+void FtdiBufferPool::release (FtdiBufferBlock * const block) noexcept
+{
+	bool last = false;
+
+	{
+		#ifdef SHAGA_THREADING
+		std::lock_guard<std::mutex> lock (mutex);
+		#endif // SHAGA_THREADING
+
+		block->payload = nullptr;
+		block->payload_len = 0;
+		spare.push_back (block);
+
+		if (nullptr == state) {
+			last = (spare.size () == blocks.size ());
+		}
+		else if (true == std::exchange (starved, false)) {
+			/* FtdiStream thread resubmits starved transfers */
+			state->issue_notice ();
+		}
+	}
+
+	if (true == last) {
+		delete this;
+	}
+}
+
+void FtdiBufferPool::close (void) noexcept
+{
+	bool last = false;
+
+	{
+		#ifdef SHAGA_THREADING
+		std::lock_guard<std::mutex> lock (mutex);
+		#endif // SHAGA_THREADING
+
+		state = nullptr;
+		last = (spare.size () == blocks.size ());
+	}
+
+	if (true == last) {
+		delete this;
+	}
+}
@@ -0,0 +1,498 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+using namespace shaga;
+
+FtdiCapture::FtdiCapture (const std::string_view path_prefix, const size_t segment_size, const size_t index_interval) :
+	_path_prefix (path_prefix),
+	_segment_size (segment_size),
+	_index_interval (index_interval)
+{
+	if (true == _path_prefix.empty ()) {
+		cThrow ("Capture path prefix is empty"sv);
+	}
+
+	if (_segment_size < (sizeof (FtdiCaptureSegmentHeader) + 4096) || (_segment_size % record_alignment) != 0) {
+		cThrow ("Capture segment size {} is not valid"sv, _segment_size);
+	}
+}
+
+FtdiCapture::~FtdiCapture ()
+{
+	try {
+		close ();
+	}
+	catch (const std::exception &e) {
+		P::print ("Capture '{}' was not closed properly: {}"sv, _path_prefix, e.what ());
+	}
+
+	#ifdef SHAGA_THREADING
+	if (true == _writer.joinable ()) {
+		{
+			std::lock_guard<std::mutex> lock (_mutex);
+			_writer_stop = true;
+		}
+		_queue_cond.notify_all ();
+		_writer.join ();
+	}
+	#endif // SHAGA_THREADING
+}
+
+std::string FtdiCapture::get_segment_path (const std::string_view path_prefix, const uint64_t segment_index)
+{
+	return fmt::format ("{}.{:06d}.sgcap"sv, path_prefix, segment_index);
+}
+
+std::string FtdiCapture::get_index_path (const std::string_view path_prefix, const uint64_t segment_index)
+{
+	return fmt::format ("{}.{:06d}.sgidx"sv, path_prefix, segment_index);
+}
+
+void FtdiCapture::open_segment (void)
+{
+	const std::string path = get_segment_path (_path_prefix, _segment_index);
+
+	/* Index of previous capture with the same prefix would describe different records */
+	if (::unlink (get_index_path (_path_prefix, _segment_index).c_str ()) != 0 && ENOENT != errno) {
+		cThrow ("Unable to remove old capture index of segment {}: {}"sv, _segment_index, strerror (errno));
+	}
+
+	_fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (_fd < 0) {
+		cThrow ("Unable to create capture segment '{}': {}"sv, path, strerror (errno));
+	}
+
+	/* Allocate the whole segment now, so writing to the mapping never extends the file */
+	if (const int err = ::posix_fallocate (_fd, 0, _segment_size); err != 0) {
+		::close (_fd);
+		_fd = -1;
+		cThrow ("Unable to allocate capture segment '{}': {}"sv, path, strerror (err));
+	}
+
+	void * const map = ::mmap (nullptr, _segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (MAP_FAILED == map) {
+		::close (_fd);
+		_fd = -1;
+		cThrow ("Unable to map capture segment '{}': {}"sv, path, strerror (errno));
+	}
+
+	_map = reinterpret_cast<unsigned char *> (map);
+	::madvise (_map, _segment_size, MADV_SEQUENTIAL);
+
+	FtdiCaptureSegmentHeader * const header = reinterpret_cast<FtdiCaptureSegmentHeader *> (_map);
+	::memcpy (header->magic, FtdiCaptureSegmentHeader::magic_value, sizeof (header->magic));
+	header->version = FtdiCaptureSegmentHeader::version_value;
+	header->flags = (true == _compressed) ? FtdiCaptureSegmentHeader::flag_compressed : 0;
+	header->segment_index = _segment_index;
+	header->created_ns = get_monotime_nsec_ftdi ();
+	header->data_size = 0;
+	header->record_count = 0;
+
+	_pos = sizeof (FtdiCaptureSegmentHeader);
+	_segment_records = 0;
+
+	_index.clear ();
+	if (true == _compressed) {
+		_index.reserve (_segment_size / compression_block_size + 1);
+	}
+	else if (_index_interval > 0) {
+		_index.reserve (_segment_size / _index_interval + 1);
+	}
+}
+
+void FtdiCapture::close_segment (void) noexcept
+{
+	if (nullptr == _map) {
+		return;
+	}
+
+	FtdiCaptureSegmentHeader * const header = reinterpret_cast<FtdiCaptureSegmentHeader *> (_map);
+	header->data_size = _pos - sizeof (FtdiCaptureSegmentHeader);
+	header->record_count = _segment_records;
+
+	write_index ();
+
+	::munmap (_map, _segment_size);
+	_map = nullptr;
+
+	/* Give back preallocated space that wasn't used */
+	if (::ftruncate (_fd, _pos) != 0) {
+		P::print ("Unable to truncate capture segment {}: {}"sv, _segment_index, strerror (errno));
+	}
+
+	::close (_fd);
+	_fd = -1;
+
+	++_segment_index;
+}
+
+void FtdiCapture::write_index (void) noexcept
+{
+	if (true == _index.empty ()) {
+		return;
+	}
+
+	FtdiCaptureIndexHeader header;
+	::memset (&header, 0, sizeof (header));
+	::memcpy (header.magic, FtdiCaptureIndexHeader::magic_value, sizeof (header.magic));
+	header.version = FtdiCaptureIndexHeader::version_value;
+	header.interval = static_cast<uint32_t> ((true == _compressed) ? compression_block_size : _index_interval);
+	header.segment_index = _segment_index;
+	header.entry_count = _index.size ();
+	header.min_ts = UINT64_MAX;
+	header.max_ts = 0;
+
+	for (const FtdiCaptureIndexEntry &entry : _index) {
+		header.min_ts = std::min (header.min_ts, entry.min_ts);
+		header.max_ts = std::max (header.max_ts, entry.max_ts);
+	}
+
+	const std::string path = get_index_path (_path_prefix, _segment_index);
+
+	const int fd = ::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		P::print ("Unable to create capture index '{}': {}"sv, path, strerror (errno));
+		return;
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof (header);
+	iov[1].iov_base = _index.data ();
+	iov[1].iov_len = _index.size () * sizeof (FtdiCaptureIndexEntry);
+
+	const ssize_t total = static_cast<ssize_t> (iov[0].iov_len + iov[1].iov_len);
+	const ssize_t ret = ::writev (fd, iov, 2);
+	::close (fd);
+
+	if (ret != total) {
+		/* Reader would build the index itself, partial file would only confuse it */
+		P::print ("Unable to write capture index '{}': {}"sv, path, (ret < 0) ? strerror (errno) : "short write");
+		::unlink (path.c_str ());
+	}
+}
+
+FtdiStreamEntry::BufferCallback FtdiCapture::get_sink (void)
+{
+	return [this](const uint_fast32_t stream_id, const FtdiBuffer &buffer) -> void {
+		record (stream_id, buffer.get_timestamp (), buffer.get_modem_status (), buffer.data (), buffer.size ());
+	};
+}
+
+void FtdiCapture::record (const FtdiBuffer &buffer)
+{
+	record (buffer.get_stream_id (), buffer.get_timestamp (), buffer.get_modem_status (), buffer.data (), buffer.size ());
+}
+
+void FtdiCapture::set_compression (const bool enabled)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (_mutex);
+	#endif // SHAGA_THREADING
+
+	if (_total_records > 0 || nullptr != _map) {
+		cThrow ("Capture compression must be set before the first record"sv);
+	}
+
+	if (true == enabled && _segment_size < (sizeof (FtdiCaptureSegmentHeader) + sizeof (FtdiCaptureBlockHeader) + compression_block_size + record_alignment)) {
+		cThrow ("Capture segment size {} is too small for compression"sv, _segment_size);
+	}
+
+	_compressed = enabled;
+
+	#ifdef SHAGA_THREADING
+	if (true == _compressed && false == _writer.joinable ()) {
+		_writer = std::thread (&FtdiCapture::writer, this);
+	}
+	#endif // SHAGA_THREADING
+}
+
+void FtdiCapture::record (const uint_fast32_t stream_id, const uint64_t timestamp_ns, const uint16_t modem_status, const char * const data, const size_t len)
+{
+	const size_t size = (sizeof (FtdiCaptureRecordHeader) + len + record_alignment - 1) & ~(record_alignment - 1);
+
+	/* Leave room for block header and the end marker */
+	if ((sizeof (FtdiCaptureSegmentHeader) + sizeof (FtdiCaptureBlockHeader) + size + sizeof (uint32_t)) > _segment_size) {
+		cThrow ("Capture record of {} bytes doesn't fit into segment"sv, len);
+	}
+
+	#ifdef SHAGA_THREADING
+	std::unique_lock<std::mutex> lock (_mutex);
+	#endif // SHAGA_THREADING
+
+	unsigned char *ptr;
+
+	if (true == _compressed) {
+		if (false == _writer_error.empty ()) {
+			cThrow ("{}"sv, _writer_error);
+		}
+
+		/* Record bigger than a block gets a block of its own */
+		if (false == _block.raw.empty () && (_block.raw.size () + size) > compression_block_size) {
+			flush_block ();
+		}
+
+		if (0 == _block.raw.capacity ()) {
+			#ifdef SHAGA_THREADING
+			_spare_cond.wait (lock, [this]() -> bool {
+				return false == _spare.empty () || _num_buffers < compression_blocks || false == _writer_error.empty ();
+			});
+
+			if (false == _writer_error.empty ()) {
+				cThrow ("{}"sv, _writer_error);
+			}
+			#endif // SHAGA_THREADING
+
+			take_buffer ();
+		}
+
+		if (true == _block.raw.empty ()) {
+			_block.entry = {0, timestamp_ns, timestamp_ns, 0, 0};
+		}
+
+		FtdiCaptureIndexEntry &entry = _block.entry;
+		entry.min_ts = std::min (entry.min_ts, timestamp_ns);
+		entry.max_ts = std::max (entry.max_ts, timestamp_ns);
+		++entry.record_count;
+		entry.stream_mask |= (UINT32_C (1) << (stream_id % 32));
+
+		const size_t pos = _block.raw.size ();
+		_block.raw.resize (pos + size);
+		ptr = _block.raw.data () + pos;
+
+		/* Padding is packed too, keep it deterministic */
+		::memset (ptr + size - record_alignment, 0, record_alignment);
+	}
+	else {
+		if (nullptr != _map && (_pos + size + sizeof (uint32_t)) > _segment_size) {
+			close_segment ();
+		}
+
+		if (nullptr == _map) {
+			open_segment ();
+		}
+
+		if (_index_interval > 0) {
+			if (true == _index.empty () || (_pos - _index.back ().offset) >= _index_interval) {
+				_index.push_back ({_pos, timestamp_ns, timestamp_ns, 0, 0});
+			}
+
+			FtdiCaptureIndexEntry &entry = _index.back ();
+			entry.min_ts = std::min (entry.min_ts, timestamp_ns);
+			entry.max_ts = std::max (entry.max_ts, timestamp_ns);
+			++entry.record_count;
+			entry.stream_mask |= (UINT32_C (1) << (stream_id % 32));
+		}
+
+		ptr = _map + _pos;
+		_pos += size;
+		++_segment_records;
+	}
+
+	FtdiCaptureRecordHeader * const header = reinterpret_cast<FtdiCaptureRecordHeader *> (ptr);
+	header->payload_len = static_cast<uint32_t> (len);
+	header->timestamp_ns = timestamp_ns;
+	header->stream_id = static_cast<uint32_t> (stream_id);
+	header->modem_status = modem_status;
+	header->flags = 0;
+
+	if (len > 0) {
+		::memcpy (ptr + sizeof (FtdiCaptureRecordHeader), data, len);
+	}
+
+	/* Size is written last, a reader of unfinished segment stops at zero size */
+	__atomic_store_n (&header->size, static_cast<uint32_t> (size), __ATOMIC_RELEASE);
+
+	++_total_records;
+	_total_bytes += len;
+}
+
+void FtdiCapture::take_buffer (void)
+{
+	if (false == _spare.empty ()) {
+		_block.raw = std::move (_spare.back ());
+		_spare.pop_back ();
+	}
+	else {
+		++_num_buffers;
+	}
+
+	_block.raw.clear ();
+	_block.raw.reserve (compression_block_size);
+}
+
+void FtdiCapture::flush_block (void)
+{
+	if (true == _block.raw.empty ()) {
+		return;
+	}
+
+	#ifdef SHAGA_THREADING
+	_queue.push_back (std::move (_block));
+	_block.raw = std::vector<unsigned char> ();
+	_queue_cond.notify_one ();
+	#else
+	/* There is no writer thread, pack in the recording thread */
+	try {
+		write_block (_block);
+	}
+	catch (...) {
+		_block.raw.clear ();
+		throw;
+	}
+	_block.raw.clear ();
+	#endif // SHAGA_THREADING
+}
+
+void FtdiCapture::write_block (Block &block)
+{
+	const size_t raw_size = block.raw.size ();
+
+	if (_packed.size () < raw_size) {
+		_packed.resize (raw_size);
+	}
+
+	if (nullptr == _codec) {
+		_codec = std::make_unique<FtdiCaptureCodec> ();
+	}
+
+	const size_t packed = _codec->compress (block.raw.data (), raw_size, _packed.data ());
+	const unsigned char * const src = (packed > 0) ? _packed.data () : block.raw.data ();
+	const size_t src_size = (packed > 0) ? packed : raw_size;
+
+	const size_t size = (sizeof (FtdiCaptureBlockHeader) + src_size + record_alignment - 1) & ~(record_alignment - 1);
+
+	if (nullptr != _map && (_pos + size + sizeof (uint32_t)) > _segment_size) {
+		close_segment ();
+	}
+
+	if (nullptr == _map) {
+		open_segment ();
+	}
+
+	unsigned char * const ptr = _map + _pos;
+
+	FtdiCaptureBlockHeader * const header = reinterpret_cast<FtdiCaptureBlockHeader *> (ptr);
+	header->codec = (packed > 0) ? FtdiCaptureBlockHeader::codec_lz : FtdiCaptureBlockHeader::codec_stored;
+	header->packed_size = static_cast<uint32_t> (src_size);
+	header->raw_size = static_cast<uint32_t> (raw_size);
+
+	::memcpy (ptr + sizeof (FtdiCaptureBlockHeader), src, src_size);
+
+	/* Size is written last, a reader of unfinished segment stops at zero size */
+	__atomic_store_n (&header->size, static_cast<uint32_t> (size), __ATOMIC_RELEASE);
+
+	if (_index_interval > 0) {
+		block.entry.offset = _pos;
+		_index.push_back (block.entry);
+	}
+
+	_pos += size;
+	_segment_records += block.entry.record_count;
+}
+
+#ifdef SHAGA_THREADING
+void FtdiCapture::writer (void)
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+
+	while (true) {
+		_queue_cond.wait (lock, [this]() -> bool {
+			return true == _writer_stop || false == _queue.empty ();
+		});
+
+		if (true == _queue.empty ()) {
+			break;
+		}
+
+		Block block = std::move (_queue.front ());
+		_queue.pop_front ();
+		_writer_busy = true;
+
+		if (true == _writer_error.empty ()) {
+			/* Segment and index are only touched by this thread while it is busy */
+			lock.unlock ();
+
+			std::string err;
+			try {
+				write_block (block);
+			}
+			catch (const std::exception &e) {
+				err = e.what ();
+			}
+
+			lock.lock ();
+
+			if (false == err.empty ()) {
+				_writer_error = std::move (err);
+			}
+		}
+
+		block.raw.clear ();
+		_spare.push_back (std::move (block.raw));
+		_writer_busy = false;
+		_spare_cond.notify_all ();
+	}
+}
+#endif // SHAGA_THREADING
+
+void FtdiCapture::close (void)
+{
+	#ifdef SHAGA_THREADING
+	std::unique_lock<std::mutex> lock (_mutex);
+	#endif // SHAGA_THREADING
+
+	if (true == _compressed) {
+		#ifdef SHAGA_THREADING
+		flush_block ();
+		_spare_cond.wait (lock, [this]() -> bool {
+			return true == _queue.empty () && false == _writer_busy;
+		});
+		#else
+		try {
+			flush_block ();
+		}
+		catch (...) {
+			close_segment ();
+			throw;
+		}
+		#endif // SHAGA_THREADING
+	}
+
+	close_segment ();
+
+	if (false == _writer_error.empty ()) {
+		cThrow ("{}"sv, std::exchange (_writer_error, std::string ()));
+	}
+}
+
+uint_fast64_t FtdiCapture::get_records (void)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (_mutex);
+	#endif // SHAGA_THREADING
+
+	return _total_records;
+}
+
+uint_fast64_t FtdiCapture::get_bytes (void)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (_mutex);
+	#endif // SHAGA_THREADING
+
+	return _total_bytes;
+}
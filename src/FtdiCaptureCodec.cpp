@@ -0,0 +1,220 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+using namespace shaga;
+
+static const constexpr unsigned char token_run {0x80};
+static const constexpr unsigned char token_match {0xc0};
+static const constexpr size_t max_literals {128};
+static const constexpr size_t min_run {3};
+static const constexpr size_t min_match {4};
+static const constexpr size_t short_len {0x3f};
+
+static inline uint32_t load32 (const unsigned char * const ptr) noexcept
+{
+	uint32_t val;
+	::memcpy (&val, ptr, sizeof (val));
+	return val;
+}
+
+/* Writer that fails once 'end' would be crossed */
+struct FtdiCaptureCodecOutput
+{
+	unsigned char *ptr;
+	unsigned char * const end;
+
+	bool put (const unsigned char val) noexcept
+	{
+		if (ptr >= end) {
+			return false;
+		}
+		*(ptr++) = val;
+		return true;
+	}
+
+	bool put_varint (size_t val) noexcept
+	{
+		while (val >= 0x80) {
+			if (false == put (static_cast<unsigned char> (val | 0x80))) {
+				return false;
+			}
+			val >>= 7;
+		}
+		return put (static_cast<unsigned char> (val));
+	}
+
+	bool put_token (const unsigned char token, const size_t len) noexcept
+	{
+		if (len < short_len) {
+			return put (token | static_cast<unsigned char> (len));
+		}
+		return put (static_cast<unsigned char> (token | short_len)) && put_varint (len - short_len);
+	}
+
+	bool put_literals (const unsigned char *src, size_t len) noexcept
+	{
+		while (len > 0) {
+			const size_t n = std::min (len, max_literals);
+			if (static_cast<size_t> (end - ptr) < (n + 1)) {
+				return false;
+			}
+			*(ptr++) = static_cast<unsigned char> (n - 1);
+			::memcpy (ptr, src, n);
+			ptr += n;
+			src += n;
+			len -= n;
+		}
+		return true;
+	}
+};
+
+static inline bool get_varint (const unsigned char *&src, const unsigned char * const end, size_t &val) noexcept
+{
+	val = 0;
+	for (uint_fast32_t shift = 0; shift < 64; shift += 7) {
+		if (src >= end) {
+			return false;
+		}
+		const unsigned char c = *(src++);
+		val |= static_cast<size_t> (c & 0x7f) << shift;
+		if (0 == (c & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+FtdiCaptureCodec::FtdiCaptureCodec () :
+	_table (std::make_unique<uint32_t[]> (1 << hash_bits))
+{ }
+
+size_t FtdiCaptureCodec::compress (const unsigned char * const src, const size_t len, unsigned char * const dst) noexcept
+{
+	/* Positions are stored plus one, zero means empty */
+	::memset (_table.get (), 0, sizeof (uint32_t) << hash_bits);
+
+	FtdiCaptureCodecOutput out {dst, dst + len};
+	size_t literal = 0;
+	size_t i = 0;
+
+	while (i < len) {
+		/* Runs of the same byte, typical for bitbang samples */
+		if ((i + min_run) <= len && src[i] == src[i + 1] && src[i] == src[i + 2]) {
+			size_t run = min_run;
+			while ((i + run) < len && src[i + run] == src[i]) {
+				++run;
+			}
+
+			if (false == out.put_literals (src + literal, i - literal) || false == out.put_token (token_run, run - min_run) || false == out.put (src[i])) {
+				return 0;
+			}
+
+			i += run;
+			literal = i;
+			continue;
+		}
+
+		if ((i + min_match) <= len) {
+			const uint32_t val = load32 (src + i);
+			uint32_t &slot = _table[(val * UINT32_C (2654435761)) >> (32 - hash_bits)];
+			const size_t candidate = slot;
+			slot = static_cast<uint32_t> (i + 1);
+
+			if (candidate > 0 && load32 (src + candidate - 1) == val) {
+				const size_t from = candidate - 1;
+				size_t match = min_match;
+				while ((i + match) < len && src[from + match] == src[i + match]) {
+					++match;
+				}
+
+				if (false == out.put_literals (src + literal, i - literal) || false == out.put_token (token_match, match - min_match) || false == out.put_varint (i - from)) {
+					return 0;
+				}
+
+				i += match;
+				literal = i;
+				continue;
+			}
+		}
+
+		++i;
+	}
+
+	if (false == out.put_literals (src + literal, len - literal)) {
+		return 0;
+	}
+
+	const size_t packed = static_cast<size_t> (out.ptr - dst);
+	return (packed < len) ? packed : 0;
+}
+
+bool FtdiCaptureCodec::decompress (const unsigned char * const src, const size_t len, unsigned char * const dst, const size_t raw_len) noexcept
+{
+	const unsigned char *sp = src;
+	const unsigned char * const se = src + len;
+	unsigned char *dp = dst;
+	unsigned char * const de = dst + raw_len;
+
+	while (sp < se) {
+		const unsigned char token = *(sp++);
+
+		if (token < token_run) {
+			const size_t n = static_cast<size_t> (token) + 1;
+			if (static_cast<size_t> (se - sp) < n || static_cast<size_t> (de - dp) < n) {
+				return false;
+			}
+			::memcpy (dp, sp, n);
+			sp += n;
+			dp += n;
+			continue;
+		}
+
+		size_t n = token & short_len;
+		if (short_len == n) {
+			size_t ext;
+			if (false == get_varint (sp, se, ext) || ext > raw_len) {
+				return false;
+			}
+			n += ext;
+		}
+
+		if ((token & token_match) == token_run) {
+			n += min_run;
+			if (sp >= se || static_cast<size_t> (de - dp) < n) {
+				return false;
+			}
+			::memset (dp, *(sp++), n);
+			dp += n;
+			continue;
+		}
+
+		n += min_match;
+		size_t distance;
+		if (false == get_varint (sp, se, distance) || 0 == distance || distance > static_cast<size_t> (dp - dst) || static_cast<size_t> (de - dp) < n) {
+			return false;
+		}
+
+		const unsigned char *from = dp - distance;
+		if (distance >= n) {
+			::memcpy (dp, from, n);
+			dp += n;
+		}
+		else {
+			/* Overlapping match repeats the last 'distance' bytes */
+			for (size_t k = 0; k < n; ++k) {
+				*(dp++) = *(from++);
+			}
+		}
+	}
+
+	return dp == de;
+}
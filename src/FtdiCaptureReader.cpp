@@ -0,0 +1,448 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace shaga;
+
+FtdiCaptureReader::FtdiCaptureReader (const std::string_view path_prefix) :
+	_path_prefix (path_prefix)
+{
+	if (false == open_segment (0)) {
+		cThrow ("Capture '{}' not found"sv, _path_prefix);
+	}
+}
+
+FtdiCaptureReader::~FtdiCaptureReader ()
+{
+	close_segment ();
+}
+
+bool FtdiCaptureReader::open_segment (const uint64_t segment_index)
+{
+	close_segment ();
+
+	const std::string path = FtdiCapture::get_segment_path (_path_prefix, segment_index);
+
+	_fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+	if (_fd < 0) {
+		if (ENOENT == errno) {
+			return false;
+		}
+		cThrow ("Unable to open capture segment '{}': {}"sv, path, strerror (errno));
+	}
+
+	try {
+		struct stat st;
+		if (::fstat (_fd, &st) != 0) {
+			cThrow ("Unable to stat capture segment '{}': {}"sv, path, strerror (errno));
+		}
+
+		_map_size = static_cast<size_t> (st.st_size);
+		if (_map_size < sizeof (FtdiCaptureSegmentHeader)) {
+			cThrow ("Capture segment '{}' is too short"sv, path);
+		}
+
+		void * const map = ::mmap (nullptr, _map_size, PROT_READ, MAP_SHARED, _fd, 0);
+		if (MAP_FAILED == map) {
+			cThrow ("Unable to map capture segment '{}': {}"sv, path, strerror (errno));
+		}
+		_map = reinterpret_cast<const unsigned char *> (map);
+		::madvise (const_cast<unsigned char *> (_map), _map_size, MADV_SEQUENTIAL);
+
+		const FtdiCaptureSegmentHeader * const header = reinterpret_cast<const FtdiCaptureSegmentHeader *> (_map);
+		if (::memcmp (header->magic, FtdiCaptureSegmentHeader::magic_value, sizeof (header->magic)) != 0) {
+			cThrow ("File '{}' is not a capture segment"sv, path);
+		}
+
+		if (header->version != FtdiCaptureSegmentHeader::version_value) {
+			cThrow ("Capture segment '{}' has unsupported version {}"sv, path, header->version);
+		}
+
+		_pos = sizeof (FtdiCaptureSegmentHeader);
+		_end = _map_size;
+
+		if (header->data_size > 0) {
+			_end = std::min (_map_size, static_cast<size_t> (sizeof (FtdiCaptureSegmentHeader) + header->data_size));
+		}
+
+		_compressed = (0 != (header->flags & FtdiCaptureSegmentHeader::flag_compressed));
+		if (false == _compressed) {
+			_view = _map;
+			_view_pos = _pos;
+			_view_end = _end;
+		}
+	}
+	catch (...) {
+		close_segment ();
+		throw;
+	}
+
+	_segment_index = segment_index;
+	return true;
+}
+
+void FtdiCaptureReader::close_segment (void) noexcept
+{
+	if (nullptr != _map) {
+		::munmap (const_cast<unsigned char *> (_map), _map_size);
+		_map = nullptr;
+	}
+
+	if (_fd >= 0) {
+		::close (_fd);
+		_fd = -1;
+	}
+
+	_map_size = 0;
+	_pos = 0;
+	_end = 0;
+	_compressed = false;
+
+	_view = nullptr;
+	_view_pos = 0;
+	_view_end = 0;
+}
+
+bool FtdiCaptureReader::open_block (const size_t pos)
+{
+	_view = nullptr;
+	_view_pos = 0;
+	_view_end = 0;
+
+	if ((pos + sizeof (FtdiCaptureBlockHeader)) > _end) {
+		return false;
+	}
+
+	const FtdiCaptureBlockHeader * const header = reinterpret_cast<const FtdiCaptureBlockHeader *> (_map + pos);
+	if (0 == header->size) {
+		return false;
+	}
+
+	if (header->size < (sizeof (FtdiCaptureBlockHeader) + header->packed_size) || (pos + header->size) > _end) {
+		cThrow ("Capture segment {} is corrupted at offset {}"sv, _segment_index, pos);
+	}
+
+	const unsigned char * const src = _map + pos + sizeof (FtdiCaptureBlockHeader);
+
+	if (FtdiCaptureBlockHeader::codec_stored == header->codec) {
+		if (header->packed_size != header->raw_size) {
+			cThrow ("Capture segment {} is corrupted at offset {}"sv, _segment_index, pos);
+		}
+		_view = src;
+	}
+	else if (FtdiCaptureBlockHeader::codec_lz == header->codec) {
+		_block.resize (header->raw_size);
+		if (false == FtdiCaptureCodec::decompress (src, header->packed_size, _block.data (), header->raw_size)) {
+			cThrow ("Capture segment {} has corrupted block at offset {}"sv, _segment_index, pos);
+		}
+		_view = _block.data ();
+	}
+	else {
+		cThrow ("Capture segment {} has block with unknown codec {}"sv, _segment_index, header->codec);
+	}
+
+	_view_end = header->raw_size;
+	_pos = pos + header->size;
+	return true;
+}
+
+void FtdiCaptureReader::position (const size_t offset)
+{
+	if (true == _compressed) {
+		if (false == open_block (offset)) {
+			cThrow ("Capture segment {} has no block at offset {}"sv, _segment_index, offset);
+		}
+	}
+	else {
+		_view_pos = offset;
+	}
+}
+
+const FtdiCaptureRecordHeader * FtdiCaptureReader::record_at (const size_t pos) const
+{
+	if (nullptr == _view || (pos + sizeof (FtdiCaptureRecordHeader)) > _view_end) {
+		return nullptr;
+	}
+
+	const FtdiCaptureRecordHeader * const header = reinterpret_cast<const FtdiCaptureRecordHeader *> (_view + pos);
+	if (0 == header->size) {
+		return nullptr;
+	}
+
+	if (header->size < (sizeof (FtdiCaptureRecordHeader) + header->payload_len) || (pos + header->size) > _view_end) {
+		cThrow ("Capture segment {} is corrupted at offset {}"sv, _segment_index, pos);
+	}
+
+	return header;
+}
+
+static void fill_record (FtdiCaptureReader::Record &record, const FtdiCaptureRecordHeader * const header)
+{
+	record.stream_id = header->stream_id;
+	record.timestamp_ns = header->timestamp_ns;
+	record.modem_status = header->modem_status;
+	record.data = reinterpret_cast<const char *> (header) + sizeof (FtdiCaptureRecordHeader);
+	record.len = header->payload_len;
+}
+
+const FtdiCaptureRecordHeader * FtdiCaptureReader::current (void)
+{
+	while (true) {
+		if (nullptr == _map) {
+			return nullptr;
+		}
+
+		if (const FtdiCaptureRecordHeader * const header = record_at (_view_pos); nullptr != header) {
+			return header;
+		}
+
+		if (true == _compressed && true == open_block (_pos)) {
+			continue;
+		}
+
+		/* End of this segment, continue with the next one */
+		if (false == open_segment (_segment_index + 1)) {
+			return nullptr;
+		}
+	}
+}
+
+bool FtdiCaptureReader::next (Record &record)
+{
+	const FtdiCaptureRecordHeader * const header = current ();
+	if (nullptr == header) {
+		return false;
+	}
+
+	fill_record (record, header);
+	_view_pos += header->size;
+	return true;
+}
+
+bool FtdiCaptureReader::load_index (const uint64_t segment_index, FtdiCaptureIndexHeader &header, std::vector<FtdiCaptureIndexEntry> *entries) const
+{
+	const std::string path = FtdiCapture::get_index_path (_path_prefix, segment_index);
+
+	const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (ENOENT == errno) {
+			return false;
+		}
+		cThrow ("Unable to open capture index '{}': {}"sv, path, strerror (errno));
+	}
+
+	try {
+		if (::pread (fd, &header, sizeof (header), 0) != static_cast<ssize_t> (sizeof (header))) {
+			cThrow ("Unable to read capture index '{}'"sv, path);
+		}
+
+		if (::memcmp (header.magic, FtdiCaptureIndexHeader::magic_value, sizeof (header.magic)) != 0 || header.version != FtdiCaptureIndexHeader::version_value || header.segment_index != segment_index) {
+			cThrow ("File '{}' is not an index of capture segment {}"sv, path, segment_index);
+		}
+
+		if (nullptr != entries) {
+			entries->resize (header.entry_count);
+			const ssize_t len = static_cast<ssize_t> (header.entry_count * sizeof (FtdiCaptureIndexEntry));
+			if (::pread (fd, entries->data (), len, sizeof (header)) != len) {
+				cThrow ("Unable to read capture index '{}'"sv, path);
+			}
+		}
+	}
+	catch (...) {
+		::close (fd);
+		throw;
+	}
+
+	::close (fd);
+	return true;
+}
+
+void FtdiCaptureReader::build_index (std::vector<FtdiCaptureIndexEntry> &entries)
+{
+	entries.clear ();
+
+	if (true == _compressed) {
+		/* Every block is one interval */
+		for (size_t block_pos = sizeof (FtdiCaptureSegmentHeader); true == open_block (block_pos); block_pos = _pos) {
+			for (size_t pos = 0; const FtdiCaptureRecordHeader * const header = record_at (pos); pos += header->size) {
+				if (0 == pos) {
+					entries.push_back ({block_pos, header->timestamp_ns, header->timestamp_ns, 0, 0});
+				}
+
+				FtdiCaptureIndexEntry &entry = entries.back ();
+				entry.min_ts = std::min (entry.min_ts, header->timestamp_ns);
+				entry.max_ts = std::max (entry.max_ts, header->timestamp_ns);
+				++entry.record_count;
+				entry.stream_mask |= (UINT32_C (1) << (header->stream_id % 32));
+			}
+		}
+		return;
+	}
+
+	size_t pos = sizeof (FtdiCaptureSegmentHeader);
+	while (const FtdiCaptureRecordHeader * const header = record_at (pos)) {
+		if (true == entries.empty () || (pos - entries.back ().offset) >= FtdiCapture::default_index_interval) {
+			entries.push_back ({pos, header->timestamp_ns, header->timestamp_ns, 0, 0});
+		}
+
+		FtdiCaptureIndexEntry &entry = entries.back ();
+		entry.min_ts = std::min (entry.min_ts, header->timestamp_ns);
+		entry.max_ts = std::max (entry.max_ts, header->timestamp_ns);
+		++entry.record_count;
+		entry.stream_mask |= (UINT32_C (1) << (header->stream_id % 32));
+
+		pos += header->size;
+	}
+}
+
+bool FtdiCaptureReader::find_segment (const uint64_t from_ns, const uint64_t to_ns, uint64_t &segment_index, std::vector<FtdiCaptureIndexEntry> &entries)
+{
+	/* Segments are written in order, so the first one reaching 'from_ns' is the start */
+	/* and the first one starting after 'to_ns' is past the end */
+	for (;; ++segment_index) {
+		FtdiCaptureIndexHeader header;
+		const bool has_index = load_index (segment_index, header, nullptr);
+
+		if (true == has_index) {
+			if (header.max_ts < from_ns) {
+				continue;
+			}
+			if (header.min_ts > to_ns) {
+				return false;
+			}
+		}
+
+		if (false == open_segment (segment_index)) {
+			return false;
+		}
+
+		if (true == has_index) {
+			load_index (segment_index, header, &entries);
+		}
+		else {
+			build_index (entries);
+		}
+
+		if (false == entries.empty ()) {
+			return true;
+		}
+	}
+}
+
+bool FtdiCaptureReader::seek (const uint64_t from_ns)
+{
+	std::vector<FtdiCaptureIndexEntry> entries;
+	uint64_t segment_index = 0;
+
+	while (true == find_segment (from_ns, UINT64_MAX, segment_index, entries)) {
+		/* Skip intervals that end before 'from_ns' */
+		size_t i = 0;
+		uint64_t max_ts = 0;
+		for (; i < entries.size (); ++i) {
+			max_ts = std::max (max_ts, entries[i].max_ts);
+			if (max_ts >= from_ns) {
+				break;
+			}
+		}
+
+		if (i < entries.size ()) {
+			position (entries[i].offset);
+
+			/* Continues to following blocks and segments if needed */
+			while (const FtdiCaptureRecordHeader * const header = current ()) {
+				if (header->timestamp_ns >= from_ns) {
+					return true;
+				}
+				_view_pos += header->size;
+			}
+			return false;
+		}
+
+		++segment_index;
+	}
+
+	close_segment ();
+	return false;
+}
+
+uint_fast64_t FtdiCaptureReader::find (const uint_fast32_t stream_id, const uint64_t from_ns, const uint64_t to_ns, RecordCallback callback)
+{
+	if (nullptr == callback) {
+		cThrow ("Record callback is not set"sv);
+	}
+
+	const uint32_t mask = (all_streams == stream_id) ? UINT32_MAX : (UINT32_C (1) << (stream_id % 32));
+
+	std::vector<FtdiCaptureIndexEntry> entries;
+	std::vector<uint64_t> later_min;
+	uint64_t segment_index = 0;
+	uint_fast64_t cnt = 0;
+	Record record;
+
+	while (true == find_segment (from_ns, to_ns, segment_index, entries)) {
+		/* Lowest timestamp of this and all following intervals, to know where to stop */
+		later_min.resize (entries.size ());
+		uint64_t min_ts = UINT64_MAX;
+		for (size_t i = entries.size (); i > 0; --i) {
+			min_ts = std::min (min_ts, entries[i - 1].min_ts);
+			later_min[i - 1] = min_ts;
+		}
+
+		for (size_t i = 0; i < entries.size (); ++i) {
+			const FtdiCaptureIndexEntry &entry = entries[i];
+
+			if (later_min[i] > to_ns) {
+				return cnt;
+			}
+			if (entry.max_ts < from_ns || entry.min_ts > to_ns || 0 == (entry.stream_mask & mask)) {
+				continue;
+			}
+
+			position (entry.offset);
+
+			/* Block of compressed segment is the whole interval */
+			const size_t end = (true == _compressed || (i + 1) >= entries.size ()) ? _view_end : entries[i + 1].offset;
+			for (size_t pos = _view_pos; pos < end;) {
+				const FtdiCaptureRecordHeader * const header = record_at (pos);
+				if (nullptr == header) {
+					break;
+				}
+				pos += header->size;
+
+				if (header->timestamp_ns < from_ns || header->timestamp_ns > to_ns) {
+					continue;
+				}
+				if (all_streams != stream_id && header->stream_id != stream_id) {
+					continue;
+				}
+
+				fill_record (record, header);
+				callback (record);
+				++cnt;
+			}
+		}
+
+		++segment_index;
+	}
+
+	return cnt;
+}
+
+void FtdiCaptureReader::rewind (void)
+{
+	if (false == open_segment (0)) {
+		cThrow ("Capture '{}' not found"sv, _path_prefix);
+	}
+}
@@ -117,6 +117,13 @@ void FtdiContext::set_ftdi_params (void)
 	if (0 != ret) {
 		cThrow ("Unable to set flow control"sv);
 	}
+
+	if (_config.latency_timer.value > 0) {
+		ret = ::ftdi_set_latency_timer (_ctx, _config.latency_timer.value);
+		if (0 != ret) {
+			cThrow ("Unable to set latency timer"sv);
+		}
+	}
 }
 
 FtdiContext::FtdiContext (const bool create_libusb_context) :
@@ -208,6 +215,38 @@ void FtdiContext::populate_config (const shaga::INI *const ini, const std::strin
 		}
 	}
 
+	const uint8_t latency_timer = ini->get_uint8 (section, "latency_timer"sv, 0);
+	if (latency_timer > 0) {
+		_config.latency_timer.value = latency_timer;
+	}
+
+	const uint8_t latency_timer_min = ini->get_uint8 (section, "latency_timer_min"sv, 0);
+	if (latency_timer_min > 0) {
+		_config.latency_timer.min = latency_timer_min;
+	}
+
+	const uint8_t latency_timer_max = ini->get_uint8 (section, "latency_timer_max"sv, 0);
+	if (latency_timer_max > 0) {
+		_config.latency_timer.max = latency_timer_max;
+	}
+
+	if (_config.latency_timer.min > _config.latency_timer.max) {
+		cThrow ("Latency timer min {} is larger than max {}"sv, _config.latency_timer.min, _config.latency_timer.max);
+	}
+
+	const std::string_view latency_mode = ini->get_string (section, "latency_mode"sv);
+	if (latency_mode.empty () == false) {
+		if (STR::icompare (latency_mode, "fixed"sv)) {
+			_config.latency_timer.mode = Config::LatencyTimer::Mode::FIXED;
+		}
+		else if (STR::icompare (latency_mode, "auto"sv)) {
+			_config.latency_timer.mode = Config::LatencyTimer::Mode::AUTO;
+		}
+		else {
+			cThrow ("Undefined latency mode '{}'. Possible values are 'fixed' and 'auto'."sv, latency_mode);
+		}
+	}
+
 	for (const auto &str : ini->get_list (section, "usb_devices")) {
 		USBdev usb_device;
 		usb_device.parse (str);
@@ -0,0 +1,283 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+#if defined (__PCLMUL__) && defined (__SSE4_1__)
+	#include <immintrin.h>
+	#define SGFTDI_CRC32_PCLMUL
+#endif // __PCLMUL__ && __SSE4_1__
+
+#ifdef __SSE4_2__
+	#include <nmmintrin.h>
+#endif // __SSE4_2__
+
+using namespace shaga;
+
+/* Slicing-by-8 tables, table[k][n] is CRC of byte n followed by k zero bytes */
+template<typename T, bool reflected>
+struct FtdiCrcTables
+{
+	T table[8][256] {};
+
+	constexpr FtdiCrcTables (const T poly) noexcept
+	{
+		constexpr const uint_fast32_t bits = sizeof (T) * 8;
+		constexpr const T top = static_cast<T> (T (1) << (bits - 1));
+
+		for (uint_fast32_t n = 0; n < 256; ++n) {
+			T crc = (true == reflected) ? static_cast<T> (n) : static_cast<T> (n << (bits - 8));
+			for (uint_fast32_t i = 0; i < 8; ++i) {
+				if constexpr (true == reflected) {
+					crc = (crc & 1) ? static_cast<T> ((crc >> 1) ^ poly) : static_cast<T> (crc >> 1);
+				}
+				else {
+					crc = (crc & top) ? static_cast<T> ((crc << 1) ^ poly) : static_cast<T> (crc << 1);
+				}
+			}
+			table[0][n] = crc;
+		}
+
+		for (uint_fast32_t k = 1; k < 8; ++k) {
+			for (uint_fast32_t n = 0; n < 256; ++n) {
+				const T prev = table[k - 1][n];
+				if constexpr (true == reflected) {
+					table[k][n] = static_cast<T> ((prev >> 8) ^ table[0][prev & 0xff]);
+				}
+				else {
+					table[k][n] = static_cast<T> ((prev << 8) ^ table[0][(prev >> (bits - 8)) & 0xff]);
+				}
+			}
+		}
+	}
+};
+
+static const constexpr FtdiCrcTables<uint16_t, false> crc16_ccitt_tables {0x1021};
+static const constexpr FtdiCrcTables<uint32_t, true> crc32_tables {0xedb88320};
+static const constexpr FtdiCrcTables<uint32_t, true> crc32c_tables {0x82f63b78};
+
+static uint_fast16_t crc16_update (uint_fast16_t crc, const unsigned char *ptr, size_t len) noexcept
+{
+	const auto &t = crc16_ccitt_tables.table;
+
+	for (; len >= 8; len -= 8, ptr += 8) {
+		crc = t[7][ptr[0] ^ (crc >> 8)] ^ t[6][ptr[1] ^ (crc & 0xff)] ^ t[5][ptr[2]] ^ t[4][ptr[3]] ^
+			t[3][ptr[4]] ^ t[2][ptr[5]] ^ t[1][ptr[6]] ^ t[0][ptr[7]];
+	}
+
+	for (; len > 0; --len, ++ptr) {
+		crc = static_cast<uint16_t> ((crc << 8) ^ t[0][((crc >> 8) ^ *ptr) & 0xff]);
+	}
+
+	return crc;
+}
+
+static uint32_t crc32_reflected_update (const FtdiCrcTables<uint32_t, true> &tables, uint32_t crc, const unsigned char *ptr, size_t len) noexcept
+{
+	const auto &t = tables.table;
+
+	for (; len >= 8; len -= 8, ptr += 8) {
+		crc ^= static_cast<uint32_t> (ptr[0]) | (static_cast<uint32_t> (ptr[1]) << 8) | (static_cast<uint32_t> (ptr[2]) << 16) | (static_cast<uint32_t> (ptr[3]) << 24);
+		crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+			t[3][ptr[4]] ^ t[2][ptr[5]] ^ t[1][ptr[6]] ^ t[0][ptr[7]];
+	}
+
+	for (; len > 0; --len, ++ptr) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *ptr) & 0xff];
+	}
+
+	return crc;
+}
+
+#ifdef SGFTDI_CRC32_PCLMUL
+/* Folds 64 bytes per round with carry-less multiply, 'len' is at least 64 and multiple of 16 */
+/* Constants are for the reflected polynomial 0x04c11db7, see Intel's "Fast CRC Computation Using PCLMULQDQ" */
+static uint32_t crc32_pclmul_update (uint32_t crc, const unsigned char *ptr, size_t len) noexcept
+{
+	alignas (16) static const constexpr uint64_t k1k2[2] {0x0154442bd4, 0x01c6e41596};
+	alignas (16) static const constexpr uint64_t k3k4[2] {0x01751997d0, 0x00ccaa009e};
+	alignas (16) static const constexpr uint64_t k5k0[2] {0x0163cd6124, 0x0000000000};
+	alignas (16) static const constexpr uint64_t poly[2] {0x01db710641, 0x01f7011641};
+
+	__m128i x1 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x00));
+	__m128i x2 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x10));
+	__m128i x3 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x20));
+	__m128i x4 = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x30));
+	x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (static_cast<int> (crc)));
+
+	__m128i k = _mm_load_si128 (reinterpret_cast<const __m128i *> (k1k2));
+	ptr += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, ptr += 64) {
+		const __m128i x5 = _mm_clmulepi64_si128 (x1, k, 0x00);
+		const __m128i x6 = _mm_clmulepi64_si128 (x2, k, 0x00);
+		const __m128i x7 = _mm_clmulepi64_si128 (x3, k, 0x00);
+		const __m128i x8 = _mm_clmulepi64_si128 (x4, k, 0x00);
+
+		x1 = _mm_clmulepi64_si128 (x1, k, 0x11);
+		x2 = _mm_clmulepi64_si128 (x2, k, 0x11);
+		x3 = _mm_clmulepi64_si128 (x3, k, 0x11);
+		x4 = _mm_clmulepi64_si128 (x4, k, 0x11);
+
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x00)));
+		x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x10)));
+		x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x20)));
+		x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + 0x30)));
+	}
+
+	/* Fold four lanes into one */
+	k = _mm_load_si128 (reinterpret_cast<const __m128i *> (k3k4));
+
+	auto fold = [&k](const __m128i acc, const __m128i next) -> __m128i {
+		return _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (acc, k, 0x11), next), _mm_clmulepi64_si128 (acc, k, 0x00));
+	};
+
+	x1 = fold (x1, x2);
+	x1 = fold (x1, x3);
+	x1 = fold (x1, x4);
+
+	for (; len >= 16; len -= 16, ptr += 16) {
+		x1 = fold (x1, _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr)));
+	}
+
+	/* Fold 128 bits to 64 bits */
+	const __m128i mask = _mm_setr_epi32 (~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128 (x1, k, 0x10);
+	x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+
+	k = _mm_loadl_epi64 (reinterpret_cast<const __m128i *> (k5k0));
+	x2 = _mm_srli_si128 (x1, 4);
+	x1 = _mm_and_si128 (x1, mask);
+	x1 = _mm_xor_si128 (_mm_clmulepi64_si128 (x1, k, 0x00), x2);
+
+	/* Barrett reduction to 32 bits */
+	k = _mm_load_si128 (reinterpret_cast<const __m128i *> (poly));
+	x2 = _mm_and_si128 (x1, mask);
+	x2 = _mm_clmulepi64_si128 (x2, k, 0x10);
+	x2 = _mm_and_si128 (x2, mask);
+	x2 = _mm_clmulepi64_si128 (x2, k, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+
+	return static_cast<uint32_t> (_mm_extract_epi32 (x1, 1));
+}
+#endif // SGFTDI_CRC32_PCLMUL
+
+static uint32_t crc32_update (uint32_t crc, const unsigned char *ptr, size_t len) noexcept
+{
+	#ifdef SGFTDI_CRC32_PCLMUL
+	if (len >= 64) {
+		const size_t folded = len & ~static_cast<size_t> (15);
+		crc = crc32_pclmul_update (crc, ptr, folded);
+		ptr += folded;
+		len -= folded;
+	}
+	#endif // SGFTDI_CRC32_PCLMUL
+
+	return crc32_reflected_update (crc32_tables, crc, ptr, len);
+}
+
+static uint32_t crc32c_update (uint32_t crc, const unsigned char *ptr, size_t len) noexcept
+{
+	#ifdef __SSE4_2__
+	uint64_t crc64 = crc;
+	for (; len >= 8; len -= 8, ptr += 8) {
+		uint64_t val;
+		::memcpy (&val, ptr, sizeof (val));
+		crc64 = _mm_crc32_u64 (crc64, val);
+	}
+	crc = static_cast<uint32_t> (crc64);
+
+	for (; len > 0; --len, ++ptr) {
+		crc = _mm_crc32_u8 (crc, *ptr);
+	}
+	return crc;
+	#else
+	return crc32_reflected_update (crc32c_tables, crc, ptr, len);
+	#endif // __SSE4_2__
+}
+
+/* FtdiCrcCheck */
+
+FtdiCrcCheck::FtdiCrcCheck (const Algorithm algorithm, const bool big_endian, const bool strip, const Action action) :
+	_algorithm (algorithm),
+	_big_endian (big_endian),
+	_strip (strip),
+	_action (action)
+{ }
+
+FtdiCrcCheck::Algorithm FtdiCrcCheck::get_algorithm (void) const noexcept
+{
+	return _algorithm;
+}
+
+FtdiCrcCheck::Action FtdiCrcCheck::get_action (void) const noexcept
+{
+	return _action;
+}
+
+size_t FtdiCrcCheck::get_size (void) const noexcept
+{
+	return (Algorithm::CRC16_CCITT == _algorithm) ? 2 : 4;
+}
+
+bool FtdiCrcCheck::check (const char * const frame, size_t &len) const noexcept
+{
+	const size_t size = get_size ();
+	if (len < size) {
+		return false;
+	}
+
+	const size_t data_len = len - size;
+	const unsigned char * const ptr = reinterpret_cast<const unsigned char *> (frame + data_len);
+
+	uint32_t stored = 0;
+	for (size_t i = 0; i < size; ++i) {
+		const uint32_t byte = (true == _big_endian) ? ptr[i] : ptr[size - 1 - i];
+		stored = (stored << 8) | byte;
+	}
+
+	if (true == _strip) {
+		len = data_len;
+	}
+
+	return stored == compute (_algorithm, frame, data_len);
+}
+
+size_t FtdiCrcCheck::append (char * const frame, const size_t len) const noexcept
+{
+	const size_t size = get_size ();
+	const uint32_t crc = compute (_algorithm, frame, len);
+
+	for (size_t i = 0; i < size; ++i) {
+		const size_t shift = (true == _big_endian) ? (size - 1 - i) * 8 : i * 8;
+		frame[len + i] = static_cast<char> ((crc >> shift) & 0xff);
+	}
+
+	return len + size;
+}
+
+uint32_t FtdiCrcCheck::compute (const Algorithm algorithm, const char * const data, const size_t len) noexcept
+{
+	const unsigned char * const ptr = reinterpret_cast<const unsigned char *> (data);
+
+	switch (algorithm) {
+		case Algorithm::CRC16_CCITT:
+			return static_cast<uint32_t> (crc16_update (0xffff, ptr, len));
+
+		case Algorithm::CRC32:
+			return ~crc32_update (UINT32_MAX, ptr, len);
+
+		case Algorithm::CRC32C:
+			return ~crc32c_update (UINT32_MAX, ptr, len);
+	}
+
+	return 0;
+}
@@ -0,0 +1,508 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+#include "scan.h"
+
+using namespace shaga;
+
+/* FtdiFramer */
+
+FtdiFramer::FtdiFramer (const size_t max_frame) :
+	_max_frame (max_frame)
+{
+	if (0 == _max_frame || _max_frame > static_cast<size_t> (INT32_MAX)) {
+		cThrow ("Maximal frame size {} is not valid"sv, _max_frame);
+	}
+}
+
+size_t FtdiFramer::get_max_frame (void) const noexcept
+{
+	return _max_frame;
+}
+
+bool FtdiFramer::has_decoder (void) const noexcept
+{
+	return false;
+}
+
+bool FtdiFramer::decode (char * const frame, size_t &len) const
+{
+	(void) frame;
+	(void) len;
+	return true;
+}
+
+/* FtdiDelimiterFramer */
+
+FtdiDelimiterFramer::FtdiDelimiterFramer (const char delimiter, const bool keep_delimiter, const bool skip_empty, const size_t max_frame) :
+	FtdiFramer (max_frame),
+	_delimiter (delimiter),
+	_keep_delimiter (keep_delimiter),
+	_skip_empty (skip_empty)
+{ }
+
+size_t FtdiDelimiterFramer::find (const char * const data, const size_t len, const size_t scanned, Frame &frame) const
+{
+	const char * const ptr = ftdi_find_byte (data + scanned, len - scanned, _delimiter);
+	if (nullptr == ptr) {
+		return 0;
+	}
+
+	const size_t pos = static_cast<size_t> (ptr - data);
+
+	frame.offset = 0;
+	frame.len = (true == _keep_delimiter) ? (pos + 1) : pos;
+
+	if (0 == pos && true == _skip_empty) {
+		frame.skip = true;
+	}
+
+	return pos + 1;
+}
+
+/* FtdiSlipFramer */
+
+FtdiSlipFramer::FtdiSlipFramer (const size_t max_frame) :
+	FtdiDelimiterFramer (end_byte, false, true, max_frame)
+{ }
+
+bool FtdiSlipFramer::has_decoder (void) const noexcept
+{
+	return true;
+}
+
+bool FtdiSlipFramer::decode (char * const frame, size_t &len) const
+{
+	const char *src = frame;
+	const char * const src_end = frame + len;
+	char *dst = frame;
+
+	while (src < src_end) {
+		const char * const esc = ftdi_find_byte (src, static_cast<size_t> (src_end - src), esc_byte);
+		const size_t run = static_cast<size_t> (((nullptr != esc) ? esc : src_end) - src);
+
+		/* Output only falls behind after the first escape */
+		if (dst != src) {
+			::memmove (dst, src, run);
+		}
+		dst += run;
+		src += run;
+
+		if (nullptr == esc) {
+			break;
+		}
+
+		if ((src + 1) >= src_end) {
+			return false;
+		}
+
+		if (esc_end_byte == src[1]) {
+			*dst++ = end_byte;
+		}
+		else if (esc_esc_byte == src[1]) {
+			*dst++ = esc_byte;
+		}
+		else {
+			return false;
+		}
+		src += 2;
+	}
+
+	len = static_cast<size_t> (dst - frame);
+	return true;
+}
+
+/* FtdiCobsFramer */
+
+FtdiCobsFramer::FtdiCobsFramer (const size_t max_frame) :
+	FtdiDelimiterFramer (0, false, true, max_frame)
+{ }
+
+bool FtdiCobsFramer::has_decoder (void) const noexcept
+{
+	return true;
+}
+
+bool FtdiCobsFramer::decode (char * const frame, size_t &len) const
+{
+	const char *src = frame;
+	const char * const src_end = frame + len;
+	char *dst = frame;
+
+	while (src < src_end) {
+		/* Code byte is never zero, delimiter framer splits there */
+		const size_t code = static_cast<unsigned char> (*src++);
+		const size_t run = code - 1;
+
+		if (run > static_cast<size_t> (src_end - src)) {
+			return false;
+		}
+
+		::memmove (dst, src, run);
+		dst += run;
+		src += run;
+
+		/* Zero follows every block shorter than 254 bytes, except the last one */
+		if (code != 0xff && src < src_end) {
+			*dst++ = 0;
+		}
+	}
+
+	len = static_cast<size_t> (dst - frame);
+	return true;
+}
+
+/* FtdiLengthFramer */
+
+FtdiLengthFramer::FtdiLengthFramer (const uint_fast32_t length_bytes, const bool big_endian, const size_t length_offset, const int_fast32_t adjust, const bool strip_header, const size_t max_frame) :
+	FtdiFramer (max_frame),
+	_length_offset (length_offset),
+	_length_bytes (length_bytes),
+	_big_endian (big_endian),
+	_adjust (adjust),
+	_strip_header (strip_header)
+{
+	if (_length_bytes != 1 && _length_bytes != 2 && _length_bytes != 4) {
+		cThrow ("Length of frame length {} is not valid"sv, _length_bytes);
+	}
+
+	if ((_length_offset + _length_bytes) >= _max_frame) {
+		cThrow ("Frame header is longer than maximal frame size"sv);
+	}
+}
+
+size_t FtdiLengthFramer::find (const char * const data, const size_t len, const size_t scanned, Frame &frame) const
+{
+	(void) scanned;
+
+	const size_t header = _length_offset + _length_bytes;
+	if (len < header) {
+		return 0;
+	}
+
+	const unsigned char * const ptr = reinterpret_cast<const unsigned char *> (data + _length_offset);
+	int_fast64_t value = 0;
+
+	for (uint_fast32_t i = 0; i < _length_bytes; ++i) {
+		const uint_fast32_t byte = (true == _big_endian) ? ptr[i] : ptr[_length_bytes - 1 - i];
+		value = (value << 8) | byte;
+	}
+	value += _adjust;
+
+	if (value < 0 || (static_cast<uint_fast64_t> (value) + header) > _max_frame) {
+		/* Not a frame start, look for the next one from the following byte */
+		frame.valid = false;
+		return 1;
+	}
+
+	const size_t total = header + static_cast<size_t> (value);
+	if (len < total) {
+		return 0;
+	}
+
+	frame.offset = (true == _strip_header) ? header : 0;
+	frame.len = total - frame.offset;
+	return total;
+}
+
+/* FtdiFramingState */
+
+FtdiFramingState::FtdiFramingState (std::shared_ptr<FtdiFramer> _framer, std::shared_ptr<FtdiCrcCheck> _crc) :
+	framer (_framer),
+	crc (_crc),
+	max_frame (_framer->get_max_frame ())
+{ }
+
+void FtdiFramingState::append (const char * const data, const size_t len)
+{
+	if ((end + len) > buffer.size ()) {
+		if (start > 0) {
+			::memmove (buffer.data (), buffer.data () + start, end - start);
+			end -= start;
+			start = 0;
+		}
+
+		if ((end + len) > buffer.size ()) {
+			buffer.resize (std::max (end + len, buffer.size () * 2));
+		}
+	}
+
+	::memcpy (buffer.data () + end, data, len);
+	end += len;
+}
+
+void FtdiFramingState::deliver (FtdiStreamEntry &entry, char *frame, size_t len, const bool may_modify)
+{
+	if (true == framer->has_decoder ()) {
+		if (false == may_modify) {
+			scratch.assign (frame, frame + len);
+			frame = scratch.data ();
+		}
+
+		if (false == framer->decode (frame, len)) {
+			count_error ();
+			return;
+		}
+	}
+
+	if (nullptr != crc && false == crc->check (frame, len)) {
+		#ifdef SHAGA_THREADING
+		bad_crc.fetch_add (1, std::memory_order_relaxed);
+		#else
+		++bad_crc;
+		#endif // SHAGA_THREADING
+
+		if (FtdiCrcCheck::Action::FLAG == crc->get_action ()) {
+			entry.read_callback (FtdiStreamEntry::CallbackType::READ_FRAME_BAD_CRC, frame, static_cast<int> (len));
+		}
+		return;
+	}
+
+	entry.read_callback (FtdiStreamEntry::CallbackType::READ_FRAME, frame, static_cast<int> (len));
+}
+
+void FtdiFramingState::feed (FtdiStreamEntry &entry, char * const data, const size_t len, const bool may_modify)
+{
+	if (0 == len) {
+		return;
+	}
+
+	const bool buffered = (end > start);
+
+	if (true == buffered) {
+		append (data, len);
+	}
+
+	char * const ptr = (true == buffered) ? (buffer.data () + start) : data;
+	const size_t avail = (true == buffered) ? (end - start) : len;
+
+	size_t pos = 0;
+	size_t skip = scanned;
+
+	while (pos < avail) {
+		FtdiFramer::Frame frame;
+		const size_t used = framer->find (ptr + pos, avail - pos, skip, frame);
+		if (0 == used) {
+			break;
+		}
+		skip = 0;
+
+		if (false == frame.valid) {
+			count_error ();
+		}
+		else if (false == frame.skip) {
+			deliver (entry, ptr + pos + frame.offset, frame.len, buffered || may_modify);
+		}
+
+		pos += used;
+	}
+
+	/* Framer has seen all remaining bytes */
+	const size_t left = avail - pos;
+	scanned = left;
+
+	if (true == buffered) {
+		start += pos;
+	}
+	else if (left > 0) {
+		append (ptr + pos, left);
+	}
+
+	if (start == end) {
+		start = 0;
+		end = 0;
+	}
+	else if ((end - start) > max_frame) {
+		/* Frame end never came, start over with the next packet */
+		count_error ();
+		start = 0;
+		end = 0;
+		scanned = 0;
+	}
+}
+
+void FtdiFramingState::count_error (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	errors.fetch_add (1, std::memory_order_relaxed);
+	#else
+	++errors;
+	#endif // SHAGA_THREADING
+}
+
+uint_fast32_t FtdiFramingState::take_errors (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	return errors.exchange (0, std::memory_order_relaxed);
+	#else
+	return std::exchange (errors, 0);
+	#endif // SHAGA_THREADING
+}
+
+uint_fast32_t FtdiFramingState::take_bad_crc (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	return bad_crc.exchange (0, std::memory_order_relaxed);
+	#else
+	return std::exchange (bad_crc, 0);
+	#endif // SHAGA_THREADING
+}
+
+/* FtdiEncoder */
+
+FtdiEncoder::FtdiEncoder (const size_t max_frame) :
+	_max_frame (max_frame)
+{
+	if (0 == _max_frame || _max_frame > static_cast<size_t> (INT32_MAX)) {
+		cThrow ("Maximal frame size {} is not valid"sv, _max_frame);
+	}
+}
+
+size_t FtdiEncoder::get_max_frame (void) const noexcept
+{
+	return _max_frame;
+}
+
+/* FtdiSlipEncoder */
+
+FtdiSlipEncoder::FtdiSlipEncoder (const bool leading_end, const size_t max_frame) :
+	FtdiEncoder (max_frame),
+	_leading_end (leading_end)
+{ }
+
+size_t FtdiSlipEncoder::max_encoded (const size_t len) const noexcept
+{
+	return (len * 2) + 2;
+}
+
+size_t FtdiSlipEncoder::encode (const char * const src, const size_t len, char * const dst) const noexcept
+{
+	const char *ptr = src;
+	const char * const end = src + len;
+	char *out = dst;
+
+	if (true == _leading_end) {
+		*out++ = FtdiSlipFramer::end_byte;
+	}
+
+	while (ptr < end) {
+		const char * const special = ftdi_find_byte2 (ptr, static_cast<size_t> (end - ptr), FtdiSlipFramer::end_byte, FtdiSlipFramer::esc_byte);
+		const size_t run = static_cast<size_t> (((nullptr != special) ? special : end) - ptr);
+
+		::memcpy (out, ptr, run);
+		out += run;
+		ptr += run;
+
+		if (nullptr == special) {
+			break;
+		}
+
+		*out++ = FtdiSlipFramer::esc_byte;
+		*out++ = (FtdiSlipFramer::end_byte == *special) ? FtdiSlipFramer::esc_end_byte : FtdiSlipFramer::esc_esc_byte;
+		++ptr;
+	}
+
+	*out++ = FtdiSlipFramer::end_byte;
+	return static_cast<size_t> (out - dst);
+}
+
+/* FtdiCobsEncoder */
+
+FtdiCobsEncoder::FtdiCobsEncoder (const size_t max_frame) :
+	FtdiEncoder (max_frame)
+{ }
+
+size_t FtdiCobsEncoder::max_encoded (const size_t len) const noexcept
+{
+	return len + (len / 254) + 3;
+}
+
+size_t FtdiCobsEncoder::encode (const char * const src, const size_t len, char * const dst) const noexcept
+{
+	const char *ptr = src;
+	const char * const end = src + len;
+	char *out = dst;
+
+	while (true) {
+		const size_t block = std::min<size_t> (static_cast<size_t> (end - ptr), 254);
+		const char * const zero = ftdi_find_byte (ptr, block, 0);
+		const size_t run = (nullptr != zero) ? static_cast<size_t> (zero - ptr) : block;
+
+		*out++ = static_cast<char> (run + 1);
+		::memcpy (out, ptr, run);
+		out += run;
+		ptr += run;
+
+		if (nullptr != zero) {
+			/* Zero is implied by the code byte */
+			++ptr;
+			if (ptr == end) {
+				/* Trailing zero needs one more empty block */
+				*out++ = 1;
+				break;
+			}
+		}
+		else if (ptr == end) {
+			break;
+		}
+	}
+
+	*out++ = 0;
+	return static_cast<size_t> (out - dst);
+}
+
+/* FtdiEncodingState */
+
+FtdiEncodingState::FtdiEncodingState (std::shared_ptr<FtdiEncoder> _encoder) :
+	encoder (_encoder)
+{
+	frame.resize (encoder->get_max_frame ());
+	pending.resize (encoder->max_encoded (frame.size ()));
+}
+
+int FtdiEncodingState::fill (FtdiStreamEntry &entry, char * const buffer, const int len)
+{
+	const size_t room = static_cast<size_t> (len);
+	size_t used = 0;
+
+	while (used < room) {
+		if (pending_pos < pending_len) {
+			const size_t cnt = std::min (pending_len - pending_pos, room - used);
+			::memcpy (buffer + used, pending.data () + pending_pos, cnt);
+			used += cnt;
+			pending_pos += cnt;
+			continue;
+		}
+
+		const int ret = entry.write_callback (FtdiStreamEntry::CallbackType::WRITE_FILL_FRAME, frame.data (), static_cast<int> (frame.size ()));
+		if (ret < 0) {
+			return ret;
+		}
+		else if (0 == ret) {
+			break;
+		}
+		else if (static_cast<size_t> (ret) > frame.size ()) {
+			cThrow ("Callback WRITE_FILL_FRAME returned {} bytes, buffer has only {}"sv, ret, frame.size ());
+		}
+
+		const size_t frame_len = static_cast<size_t> (ret);
+		if (encoder->max_encoded (frame_len) <= (room - used)) {
+			/* Encode straight into the transfer */
+			used += encoder->encode (frame.data (), frame_len, buffer + used);
+		}
+		else {
+			pending_len = encoder->encode (frame.data (), frame_len, pending.data ());
+			pending_pos = 0;
+		}
+	}
+
+	return static_cast<int> (used);
+}
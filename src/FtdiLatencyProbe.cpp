@@ -0,0 +1,334 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+#include "scan.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+using namespace shaga;
+
+static const constexpr size_t marker_data {FtdiLatencyProbe::marker_size - 2};
+
+static uint16_t marker_check (const unsigned char * const marker) noexcept
+{
+	return static_cast<uint16_t> (FtdiCrcCheck::compute (FtdiCrcCheck::Algorithm::CRC16_CCITT, reinterpret_cast<const char *> (marker), marker_data));
+}
+
+/* FtdiLatencyProbeState */
+
+FtdiLatencyProbeState::FtdiLatencyProbeState (const uint_fast32_t interval_ms, const uint64_t bucket_ns, const size_t buckets)
+{
+	if (0 == interval_ms) {
+		cThrow ("Probe interval must be at least 1 ms"sv);
+	}
+
+	if (0 == bucket_ns || 0 == buckets) {
+		cThrow ("Latency histogram must have at least one bucket"sv);
+	}
+
+	results.bucket_ns = bucket_ns;
+	results.counts.resize (buckets, 0);
+
+	timer_fd = ::timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		cThrow ("Unable to init timer_fd: {}"sv, strerror (errno));
+	}
+
+	struct itimerspec timspec;
+	bzero (&timspec, sizeof (timspec));
+	timspec.it_interval.tv_sec = static_cast<time_t> (interval_ms / 1'000);
+	timspec.it_interval.tv_nsec = static_cast<long> ((interval_ms % 1'000) * 1'000'000);
+	timspec.it_value = timspec.it_interval;
+
+	if (::timerfd_settime (timer_fd, 0, &timspec, 0) != 0) {
+		::close (timer_fd);
+		cThrow ("Unable to start timer_fd: {}"sv, strerror (errno));
+	}
+
+	read_fd = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (read_fd < 0) {
+		::close (timer_fd);
+		cThrow ("Unable to create eventfd: {}"sv, strerror (errno));
+	}
+}
+
+FtdiLatencyProbeState::~FtdiLatencyProbeState ()
+{
+	::close (timer_fd);
+	::close (read_fd);
+}
+
+int FtdiLatencyProbeState::write_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len)
+{
+	switch (type) {
+		case FtdiStreamEntry::CallbackType::WRITE_GET_FD:
+			return timer_fd;
+
+		case FtdiStreamEntry::CallbackType::WRITE_FILL_BUFFER:
+		{
+			/* Reading the timer also stops it from waking the stream loop again */
+			uint64_t expirations;
+			if (::read (timer_fd, &expirations, sizeof (expirations)) != sizeof (expirations)) {
+				return 0;
+			}
+
+			if (static_cast<size_t> (len) < FtdiLatencyProbe::marker_size) {
+				return -1;
+			}
+
+			unsigned char * const ptr = reinterpret_cast<unsigned char *> (buffer);
+			const uint64_t now = get_monotime_nsec_ftdi ();
+
+			ptr[0] = static_cast<unsigned char> (FtdiLatencyProbe::marker_sync);
+			ptr[1] = static_cast<unsigned char> (tx_sequence & 0xff);
+			ptr[2] = static_cast<unsigned char> (tx_sequence >> 8);
+			for (size_t i = 0; i < 8; ++i) {
+				ptr[3 + i] = static_cast<unsigned char> ((now >> (i * 8)) & 0xff);
+			}
+			const uint16_t check = marker_check (ptr);
+			ptr[11] = static_cast<unsigned char> (check & 0xff);
+			ptr[12] = static_cast<unsigned char> (check >> 8);
+			++tx_sequence;
+
+			#ifdef SHAGA_THREADING
+			std::lock_guard<std::mutex> lock (mutex);
+			#endif // SHAGA_THREADING
+
+			++results.sent;
+			return static_cast<int> (FtdiLatencyProbe::marker_size);
+		}
+
+		default:
+			return 0;
+	}
+}
+
+int FtdiLatencyProbeState::read_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len)
+{
+	switch (type) {
+		case FtdiStreamEntry::CallbackType::READ_GET_FD:
+			return read_fd;
+
+		case FtdiStreamEntry::CallbackType::READ_TIMING:
+			if (static_cast<size_t> (len) == sizeof (timing)) {
+				::memcpy (&timing, buffer, sizeof (timing));
+				transfer_start = received_bytes;
+			}
+			return 0;
+
+		case FtdiStreamEntry::CallbackType::READ_BUFFER:
+		{
+			#ifdef SHAGA_THREADING
+			std::lock_guard<std::mutex> lock (mutex);
+			#endif // SHAGA_THREADING
+
+			if (len > 0) {
+				parse (buffer, static_cast<size_t> (len));
+				received_bytes += static_cast<uint64_t> (len);
+			}
+			return 0;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+void FtdiLatencyProbeState::parse (const char * const data, const size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		if (0 == marker_len) {
+			const char * const ptr = ftdi_find_byte (data + pos, len - pos, FtdiLatencyProbe::marker_sync);
+			if (nullptr == ptr) {
+				break;
+			}
+
+			pos = static_cast<size_t> (ptr - data);
+			marker_start = received_bytes + pos;
+			marker_arrival_ns = timing.estimate (static_cast<size_t> (marker_start - transfer_start));
+		}
+
+		const size_t cnt = std::min (FtdiLatencyProbe::marker_size - marker_len, len - pos);
+		::memcpy (marker + marker_len, data + pos, cnt);
+		marker_len += cnt;
+		pos += cnt;
+
+		if (FtdiLatencyProbe::marker_size == marker_len) {
+			complete ();
+		}
+	}
+}
+
+void FtdiLatencyProbeState::complete (void)
+{
+	if (marker_check (marker) != static_cast<uint16_t> (marker[11] | (marker[12] << 8))) {
+		++results.damaged;
+
+		/* Real marker may start inside this one */
+		const char * const ptr = ftdi_find_byte (reinterpret_cast<const char *> (marker) + 1, FtdiLatencyProbe::marker_size - 1, FtdiLatencyProbe::marker_sync);
+		if (nullptr == ptr) {
+			marker_len = 0;
+		}
+		else {
+			const size_t offset = static_cast<size_t> (reinterpret_cast<const unsigned char *> (ptr) - marker);
+			marker_len = FtdiLatencyProbe::marker_size - offset;
+			::memmove (marker, marker + offset, marker_len);
+
+			/* Arrival is known only if it came with the current read transfer */
+			marker_start += offset;
+			marker_arrival_ns = (marker_start >= transfer_start) ? timing.estimate (static_cast<size_t> (marker_start - transfer_start)) : 0;
+		}
+		return;
+	}
+
+	marker_len = 0;
+
+	const uint16_t sequence = static_cast<uint16_t> (marker[1] | (marker[2] << 8));
+	uint64_t sent_ns = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		sent_ns |= static_cast<uint64_t> (marker[3 + i]) << (i * 8);
+	}
+
+	if (true == rx_started) {
+		/* Older or repeated marker shows as huge gap, it's not counted */
+		const uint16_t gap = static_cast<uint16_t> (sequence - rx_sequence - 1);
+		if (gap < 0x8000) {
+			results.lost += gap;
+		}
+	}
+	rx_started = true;
+	rx_sequence = sequence;
+	++results.received;
+
+	if (marker_arrival_ns > sent_ns) {
+		const uint64_t latency = marker_arrival_ns - sent_ns;
+		const uint64_t bucket = latency / results.bucket_ns;
+
+		if (bucket < results.counts.size ()) {
+			++results.counts[bucket];
+		}
+		else {
+			++results.overflow;
+		}
+
+		if (0 == results.samples || latency < results.min_ns) {
+			results.min_ns = latency;
+		}
+		if (latency > results.max_ns) {
+			results.max_ns = latency;
+		}
+		results.sum_ns += latency;
+		++results.samples;
+	}
+}
+
+FtdiLatencyProbe::Results FtdiLatencyProbeState::get_results (void) const
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (mutex);
+	#endif // SHAGA_THREADING
+
+	return results;
+}
+
+void FtdiLatencyProbeState::reset_results (void)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (mutex);
+	#endif // SHAGA_THREADING
+
+	FtdiLatencyProbe::Results empty;
+	empty.bucket_ns = results.bucket_ns;
+	empty.counts.resize (results.counts.size (), 0);
+	results = std::move (empty);
+	rx_started = false;
+}
+
+/* FtdiLatencyProbe::Results */
+
+uint64_t FtdiLatencyProbe::Results::get_avg_ns (void) const noexcept
+{
+	return (samples > 0) ? (sum_ns / samples) : 0;
+}
+
+uint64_t FtdiLatencyProbe::Results::get_percentile_ns (const double fraction) const noexcept
+{
+	if (0 == samples) {
+		return 0;
+	}
+
+	const double target = std::clamp (fraction, 0.0, 1.0) * static_cast<double> (samples);
+	uint_fast64_t total = 0;
+
+	for (size_t i = 0; i < counts.size (); ++i) {
+		total += counts[i];
+		if (static_cast<double> (total) >= target && total > 0) {
+			return std::min<uint64_t> ((i + 1) * bucket_ns, max_ns);
+		}
+	}
+
+	return max_ns;
+}
+
+void FtdiLatencyProbe::Results::print (const std::string_view prefix) const
+{
+	P::print ("{}Markers sent {}, received {}, lost {}, damaged {}"sv, prefix, sent, received, lost, damaged);
+	P::print ("{}Latency min {:.1f} us, avg {:.1f} us, 99% {:.1f} us, max {:.1f} us from {} samples"sv, prefix,
+		static_cast<double> (min_ns) / 1000.0, static_cast<double> (get_avg_ns ()) / 1000.0,
+		static_cast<double> (get_percentile_ns (0.99)) / 1000.0, static_cast<double> (max_ns) / 1000.0, samples);
+
+	for (size_t i = 0; i < counts.size (); ++i) {
+		if (counts[i] > 0) {
+			P::print ("{}{:>10.1f} us {:>10}"sv, prefix, static_cast<double> (i * bucket_ns) / 1000.0, counts[i]);
+		}
+	}
+
+	if (overflow > 0) {
+		P::print ("{}{:>10.1f} us+ {:>9}"sv, prefix, static_cast<double> (counts.size () * bucket_ns) / 1000.0, overflow);
+	}
+}
+
+/* FtdiLatencyProbe */
+
+FtdiLatencyProbe::FtdiLatencyProbe (const uint_fast32_t interval_ms, const uint64_t bucket_ns, const size_t buckets) :
+	_state (std::make_shared<FtdiLatencyProbeState> (interval_ms, bucket_ns, buckets))
+{ }
+
+FtdiLatencyProbe::~FtdiLatencyProbe ()
+{ }
+
+void FtdiLatencyProbe::attach (FtdiStreamEntry &entry)
+{
+	std::shared_ptr<FtdiLatencyProbeState> state = _state;
+
+	entry.set_write_callback ([state](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+		return state->write_callback (type, buffer, len);
+	});
+
+	entry.set_read_callback ([state](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+		return state->read_callback (type, buffer, len);
+	});
+
+	entry.set_read_timing_events (true);
+}
+
+FtdiLatencyProbe::Results FtdiLatencyProbe::get_results (void) const
+{
+	return _state->get_results ();
+}
+
+void FtdiLatencyProbe::reset_results (void)
+{
+	_state->reset_results ();
+}
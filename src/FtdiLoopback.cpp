@@ -0,0 +1,448 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+#include <sys/eventfd.h>
+
+#if defined (__AVX2__) || defined (__SSE2__)
+	#include <immintrin.h>
+#endif // __AVX2__ || __SSE2__
+
+using namespace shaga;
+
+/* Fill 'len' bytes at 'ptr', at least 'lag_long' bytes before it must already be valid */
+/* Shorter lag is at least 32 bytes, so a vector never reads bytes it writes */
+static void prbs_extend (unsigned char * const ptr, const size_t len, const size_t lag_short, const size_t lag_long) noexcept
+{
+	size_t i = 0;
+
+	#ifdef __AVX2__
+	for (; (i + 32) <= len; i += 32) {
+		const __m256i a = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (ptr + i - lag_short));
+		const __m256i b = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (ptr + i - lag_long));
+		_mm256_storeu_si256 (reinterpret_cast<__m256i *> (ptr + i), _mm256_xor_si256 (a, b));
+	}
+	#endif // __AVX2__
+
+	#ifdef __SSE2__
+	for (; (i + 16) <= len; i += 16) {
+		const __m128i a = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + i - lag_short));
+		const __m128i b = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (ptr + i - lag_long));
+		_mm_storeu_si128 (reinterpret_cast<__m128i *> (ptr + i), _mm_xor_si128 (a, b));
+	}
+	#endif // __SSE2__
+
+	for (; i < len; ++i) {
+		ptr[i] = ptr[i - lag_short] ^ ptr[i - lag_long];
+	}
+}
+
+static uint_fast64_t count_bit_errors (const unsigned char * const a, const unsigned char * const b, const size_t len) noexcept
+{
+	uint_fast64_t bits = 0;
+	size_t i = 0;
+
+	for (; (i + 8) <= len; i += 8) {
+		uint64_t x, y;
+		::memcpy (&x, a + i, sizeof (x));
+		::memcpy (&y, b + i, sizeof (y));
+		bits += static_cast<uint_fast64_t> (__builtin_popcountll (x ^ y));
+	}
+
+	for (; i < len; ++i) {
+		bits += static_cast<uint_fast64_t> (__builtin_popcount (a[i] ^ b[i]));
+	}
+
+	return bits;
+}
+
+/* FtdiPrbsGenerator */
+
+FtdiPrbsGenerator::FtdiPrbsGenerator (const FtdiLoopbackTest::Pattern pattern)
+{
+	/* Taps of x^n + x^m + 1. Squaring the polynomial doubles both lags, the smallest power */
+	/* of two that gets byte lags to at least 32 is used, so bit recurrence becomes byte recurrence. */
+	size_t n = 0;
+	size_t m = 0;
+	size_t factor = 0;
+
+	switch (pattern) {
+		case FtdiLoopbackTest::Pattern::PRBS7: n = 7; m = 6; factor = 8; break;
+		case FtdiLoopbackTest::Pattern::PRBS15: n = 15; m = 14; factor = 4; break;
+		case FtdiLoopbackTest::Pattern::PRBS23: n = 23; m = 18; factor = 2; break;
+		case FtdiLoopbackTest::Pattern::PRBS31: n = 31; m = 28; factor = 2; break;
+	}
+
+	if (0 == n) {
+		cThrow ("Unknown PRBS pattern"sv);
+	}
+
+	lag_short = m * factor;
+	lag_long = n * factor;
+
+	buffer.resize (history + chunk);
+
+	/* Start of the sequence bit by bit, register starts with all ones */
+	std::vector<uint8_t> bits (history * 8);
+	for (size_t k = 0; k < bits.size (); ++k) {
+		bits[k] = (k < n) ? 1 : (bits[k - m] ^ bits[k - n]);
+	}
+
+	for (size_t i = 0; i < history; ++i) {
+		unsigned char byte = 0;
+		for (size_t j = 0; j < 8; ++j) {
+			byte |= static_cast<unsigned char> (bits[(i * 8) + j] << j);
+		}
+		buffer[i] = byte;
+	}
+
+	prbs_extend (buffer.data () + history, chunk, lag_short, lag_long);
+	pos = 0;
+}
+
+void FtdiPrbsGenerator::refill (void) noexcept
+{
+	::memmove (buffer.data (), buffer.data () + buffer.size () - history, history);
+	prbs_extend (buffer.data () + history, chunk, lag_short, lag_long);
+	pos = history;
+}
+
+void FtdiPrbsGenerator::seed (const unsigned char * const window) noexcept
+{
+	::memcpy (buffer.data (), window, history);
+	prbs_extend (buffer.data () + history, chunk, lag_short, lag_long);
+	pos = history;
+}
+
+const unsigned char * FtdiPrbsGenerator::take (size_t &len) noexcept
+{
+	if (pos == buffer.size ()) {
+		refill ();
+	}
+
+	len = std::min (len, buffer.size () - pos);
+
+	const unsigned char * const ptr = buffer.data () + pos;
+	pos += len;
+	return ptr;
+}
+
+/* FtdiLoopbackState */
+
+FtdiLoopbackState::FtdiLoopbackState (const FtdiLoopbackTest::Pattern pattern, const size_t _max_slip) :
+	tx (pattern),
+	rx (pattern),
+	max_slip (_max_slip)
+{
+	scratch.resize (max_slip + window);
+
+	write_fd = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (write_fd < 0) {
+		cThrow ("Unable to create eventfd: {}"sv, strerror (errno));
+	}
+
+	read_fd = ::eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (read_fd < 0) {
+		::close (write_fd);
+		cThrow ("Unable to create eventfd: {}"sv, strerror (errno));
+	}
+}
+
+FtdiLoopbackState::~FtdiLoopbackState ()
+{
+	::close (write_fd);
+	::close (read_fd);
+}
+
+int FtdiLoopbackState::write_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len)
+{
+	switch (type) {
+		case FtdiStreamEntry::CallbackType::WRITE_GET_FD:
+			return write_fd;
+
+		case FtdiStreamEntry::CallbackType::WRITE_FILL_BUFFER:
+		{
+			size_t done = 0;
+			while (done < static_cast<size_t> (len)) {
+				size_t cnt = static_cast<size_t> (len) - done;
+				const unsigned char * const ptr = tx.take (cnt);
+				::memcpy (buffer + done, ptr, cnt);
+				done += cnt;
+			}
+
+			#ifdef SHAGA_THREADING
+			std::lock_guard<std::mutex> lock (mutex);
+			#endif // SHAGA_THREADING
+
+			if (true == offset_known && markers.size () < max_markers) {
+				markers.push_back ({tx_offset, get_monotime_nsec_ftdi ()});
+			}
+			tx_offset += done;
+			return len;
+		}
+
+		case FtdiStreamEntry::CallbackType::WRITE_CONFIRM_TRANSFER:
+		{
+			#ifdef SHAGA_THREADING
+			std::lock_guard<std::mutex> lock (mutex);
+			#endif // SHAGA_THREADING
+
+			results.bytes_sent += static_cast<uint_fast64_t> (len);
+			return 0;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+int FtdiLoopbackState::read_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len)
+{
+	switch (type) {
+		case FtdiStreamEntry::CallbackType::READ_GET_FD:
+			return read_fd;
+
+		case FtdiStreamEntry::CallbackType::READ_TIMING:
+			if (static_cast<size_t> (len) == sizeof (timing)) {
+				::memcpy (&timing, buffer, sizeof (timing));
+				timing_index = 0;
+			}
+			return 0;
+
+		case FtdiStreamEntry::CallbackType::READ_BUFFER:
+		{
+			#ifdef SHAGA_THREADING
+			std::lock_guard<std::mutex> lock (mutex);
+			#endif // SHAGA_THREADING
+
+			if (len > 0) {
+				if (0 == results.bytes_received) {
+					results.first_ns = timing.estimate (timing_index);
+				}
+				results.last_ns = timing.estimate (timing_index + static_cast<size_t> (len) - 1);
+				results.bytes_received += static_cast<uint_fast64_t> (len);
+
+				check (reinterpret_cast<const unsigned char *> (buffer), static_cast<size_t> (len));
+			}
+			return 0;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+void FtdiLoopbackState::take_markers (const uint64_t offset, const size_t len, const size_t index)
+{
+	while (false == markers.empty ()) {
+		const Marker &marker = markers.front ();
+		if (marker.offset >= (offset + len)) {
+			break;
+		}
+
+		/* Markers of lost bytes are just dropped */
+		if (marker.offset >= offset) {
+			const uint64_t arrival = timing.estimate (index + static_cast<size_t> (marker.offset - offset));
+			if (arrival > marker.timestamp_ns) {
+				const uint64_t latency = arrival - marker.timestamp_ns;
+
+				if (0 == results.latency_samples || latency < results.latency_min_ns) {
+					results.latency_min_ns = latency;
+				}
+				if (latency > results.latency_max_ns) {
+					results.latency_max_ns = latency;
+				}
+				results.latency_sum_ns += latency;
+				++results.latency_samples;
+			}
+		}
+
+		markers.pop_front ();
+	}
+}
+
+void FtdiLoopbackState::resync (void)
+{
+	/* Look for received window in the following bytes of expected sequence */
+	FtdiPrbsGenerator ahead (rx);
+
+	size_t filled = 0;
+	while (filled < scratch.size ()) {
+		size_t cnt = scratch.size () - filled;
+		const unsigned char * const ptr = ahead.take (cnt);
+		::memcpy (scratch.data () + filled, ptr, cnt);
+		filled += cnt;
+	}
+
+	size_t skipped = SIZE_MAX;
+	for (size_t d = 0; d <= max_slip; ++d) {
+		if (scratch[d] == sync[0] && ::memcmp (scratch.data () + d, sync, window) == 0) {
+			skipped = d;
+			break;
+		}
+	}
+
+	if (true == was_in_sync) {
+		++results.resyncs;
+	}
+
+	if (SIZE_MAX != skipped) {
+		results.lost_bytes += skipped;
+		rx_offset += skipped + window;
+		probation = false;
+	}
+	else {
+		offset_known = false;
+		markers.clear ();
+		probation = true;
+	}
+
+	rx.seed (sync);
+	sync_len = 0;
+	window_bytes = 0;
+	window_bits = 0;
+
+	in_sync = true;
+	was_in_sync = true;
+	results.in_sync = true;
+}
+
+void FtdiLoopbackState::check (const unsigned char *data, size_t len)
+{
+	while (len > 0) {
+		if (false == in_sync) {
+			const size_t cnt = std::min (len, window - sync_len);
+			::memcpy (sync + sync_len, data, cnt);
+			sync_len += cnt;
+
+			data += cnt;
+			len -= cnt;
+			timing_index += cnt;
+
+			if (sync_len == window) {
+				resync ();
+			}
+			continue;
+		}
+
+		size_t cnt = std::min (len, window - window_bytes);
+		const unsigned char * const expected = rx.take (cnt);
+
+		window_bits += count_bit_errors (data, expected, cnt);
+		window_bytes += cnt;
+
+		if (true == offset_known) {
+			take_markers (rx_offset, cnt, timing_index);
+		}
+		rx_offset += cnt;
+
+		data += cnt;
+		len -= cnt;
+		timing_index += cnt;
+
+		if (window_bytes == window) {
+			/* Random data differs in half of the bits */
+			if (window_bits > ((window * 8) / 4) || (true == probation && window_bits > 0)) {
+				in_sync = false;
+				results.in_sync = false;
+				previous_valid = false;
+			}
+			else {
+				if (true == previous_valid) {
+					results.error_bits += previous_bits;
+					results.bytes_checked += window;
+				}
+				previous_bits = window_bits;
+				previous_valid = true;
+			}
+
+			probation = false;
+			window_bytes = 0;
+			window_bits = 0;
+		}
+	}
+}
+
+FtdiLoopbackTest::Results FtdiLoopbackState::get_results (void) const
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (mutex);
+	#endif // SHAGA_THREADING
+
+	return results;
+}
+
+void FtdiLoopbackState::reset_results (void)
+{
+	#ifdef SHAGA_THREADING
+	std::lock_guard<std::mutex> lock (mutex);
+	#endif // SHAGA_THREADING
+
+	results = FtdiLoopbackTest::Results ();
+	results.in_sync = in_sync;
+}
+
+/* FtdiLoopbackTest::Results */
+
+double FtdiLoopbackTest::Results::get_throughput (void) const noexcept
+{
+	if (last_ns <= first_ns) {
+		return 0.0;
+	}
+	return static_cast<double> (bytes_received) * 1'000'000'000.0 / static_cast<double> (last_ns - first_ns);
+}
+
+double FtdiLoopbackTest::Results::get_bit_error_rate (void) const noexcept
+{
+	if (0 == bytes_checked) {
+		return 0.0;
+	}
+	return static_cast<double> (error_bits) / static_cast<double> (bytes_checked * 8);
+}
+
+uint64_t FtdiLoopbackTest::Results::get_latency_avg_ns (void) const noexcept
+{
+	return (latency_samples > 0) ? (latency_sum_ns / latency_samples) : 0;
+}
+
+/* FtdiLoopbackTest */
+
+FtdiLoopbackTest::FtdiLoopbackTest (const Pattern pattern, const size_t max_slip) :
+	_state (std::make_shared<FtdiLoopbackState> (pattern, max_slip))
+{ }
+
+FtdiLoopbackTest::~FtdiLoopbackTest ()
+{ }
+
+void FtdiLoopbackTest::attach (FtdiStreamEntry &entry)
+{
+	std::shared_ptr<FtdiLoopbackState> state = _state;
+
+	entry.set_write_callback ([state](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+		return state->write_callback (type, buffer, len);
+	});
+
+	entry.set_read_callback ([state](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+		return state->read_callback (type, buffer, len);
+	});
+
+	entry.set_read_timing_events (true);
+}
+
+FtdiLoopbackTest::Results FtdiLoopbackTest::get_results (void) const
+{
+	return _state->get_results ();
+}
+
+void FtdiLoopbackTest::reset_results (void)
+{
+	_state->reset_results ();
+}
@@ -0,0 +1,269 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+#include <poll.h>
+
+using namespace shaga;
+
+FtdiReplay::FtdiReplay (FtdiStreams &streams) :
+	_state (std::make_unique<FtdiStreamState> (streams))
+{
+	for (FtdiStreamEntry &stream : _state->streams) {
+		/* Device doesn't have to be open, use full speed packet size in that case */
+		const uint32_t packetsize = (stream.ftdi->max_packet_size > 2) ? stream.ftdi->max_packet_size : 64;
+
+		if (_state->read_packetsize > packetsize) {
+			_state->read_packetsize = packetsize;
+		}
+	}
+
+	_naked_state = _state.get ();
+}
+
+FtdiReplay::~FtdiReplay ()
+{
+	cleanup ();
+	_naked_state = nullptr;
+}
+
+void FtdiReplay::set_speed (const Speed speed, const double factor)
+{
+	if (Speed::SCALED == speed && false == (factor > 0.0)) {
+		cThrow ("Replay speed factor {} is not valid"sv, factor);
+	}
+
+	_speed = speed;
+	_factor = (Speed::SCALED == speed) ? factor : 1.0;
+}
+
+void FtdiReplay::set_dispatch_threads (const uint_fast32_t num_threads)
+{
+	#ifdef SHAGA_THREADING
+	_naked_state->dispatch_threads = num_threads;
+	#else
+	(void) num_threads;
+	cThrow ("This version of the library is compiled without threading support"sv);
+	#endif // SHAGA_THREADING
+}
+
+void FtdiReplay::stop (void)
+{
+	#ifdef SHAGA_THREADING
+	_should_stop.store (true, std::memory_order::memory_order_release);
+	#else
+	_should_stop = true;
+	#endif // SHAGA_THREADING
+
+	_naked_state->issue_notice ();
+}
+
+void FtdiReplay::init (void)
+{
+	FtdiStreamState * const state = _naked_state;
+
+	if (nullptr != state->entrystates) {
+		cThrow ("Replay is already running"sv);
+	}
+
+	state->entrystates = std::make_unique<FtdiStreamEntryStates_t> ();
+
+	for (uint_fast32_t stream_id = 0; stream_id < state->num_streams; ++stream_id) {
+		FtdiStreamEntry &stream = state->streams[stream_id];
+		FtdiStreamEntryState &entrystate = state->entrystates->emplace_back (stream_id, stream, state);
+
+		if (nullptr != stream.read_callback || nullptr != stream.read_buffer_callback || false == stream.read_sinks.empty ()) {
+			/* Replay always delivers through the pool */
+			entrystate.init_delivery (true);
+		}
+	}
+
+	#ifdef SHAGA_THREADING
+	if (nullptr != state->dispatch) {
+		state->dispatch->start (state->dispatch_threads);
+	}
+	#endif // SHAGA_THREADING
+}
+
+void FtdiReplay::cleanup (void) noexcept
+{
+	#ifdef SHAGA_THREADING
+	_naked_state->dispatch.reset ();
+	#endif // SHAGA_THREADING
+
+	_naked_state->entrystates.reset ();
+}
+
+void FtdiReplay::wait_for_notice (void)
+{
+	struct pollfd pfd;
+	pfd.fd = _naked_state->notice_event_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (::poll (&pfd, 1, 100) > 0) {
+		uint64_t val;
+		if (::read (_naked_state->notice_event_fd, &val, sizeof (val)) < 0 && errno != EAGAIN && errno != EINTR) {
+			cThrow ("Error reading from event_fd: {}"sv, strerror (errno));
+		}
+	}
+
+	#ifdef SHAGA_THREADING
+	if (nullptr != _naked_state->dispatch) {
+		if (const std::string err = _naked_state->dispatch->take_error (); false == err.empty ()) {
+			cThrow ("{}"sv, err);
+		}
+	}
+	#endif // SHAGA_THREADING
+}
+
+void FtdiReplay::deliver (FtdiStreamEntryState &entrystate, const FtdiCaptureReader::Record &record)
+{
+	const uint32_t packetsize = _naked_state->read_packetsize;
+	const size_t chunk = packetsize - 2;
+	const size_t max_payload = std::max<uint_fast32_t> (entrystate.stream.read_packets_per_transfer, 1) * chunk;
+
+	const char *src = record.data;
+	size_t remaining = record.len;
+
+	do {
+		FtdiBufferBlock *block = entrystate.pool->take ();
+		while (nullptr == block) {
+			/* Consumers hold all blocks, wait until one returns */
+			wait_for_notice ();
+
+			#ifdef SHAGA_THREADING
+			if (true == _should_stop.load (std::memory_order::memory_order_acquire)) {
+			#else
+			if (true == _should_stop) {
+			#endif // SHAGA_THREADING
+				return;
+			}
+
+			block = entrystate.pool->take ();
+		}
+
+		/* Rebuild packets of the transfer, every one starts with modem status */
+		size_t len = std::min (remaining, max_payload);
+		unsigned char *ptr = block->buffer;
+
+		do {
+			const size_t packet_len = std::min (len, chunk);
+			ptr[0] = static_cast<unsigned char> (record.modem_status & 0xff);
+			ptr[1] = static_cast<unsigned char> (record.modem_status >> 8);
+			::memcpy (ptr + 2, src, packet_len);
+
+			ptr += packet_len + 2;
+			src += packet_len;
+			len -= packet_len;
+			remaining -= packet_len;
+		} while (len > 0);
+
+		block->length = static_cast<uint32_t> (ptr - block->buffer);
+		block->timing = entrystate.estimate_read_timing (record.timestamp_ns, block->length);
+		block->modem_status = record.modem_status;
+		block->ref ();
+
+		#ifdef SHAGA_THREADING
+		if (nullptr != entrystate.dispatch_queue) {
+			_naked_state->dispatch->push (*entrystate.dispatch_queue, block);
+			continue;
+		}
+		#endif // SHAGA_THREADING
+
+		try {
+			entrystate.deliver_read (block);
+		}
+		catch (...) {
+			block->unref ();
+			throw;
+		}
+		block->unref ();
+	} while (remaining > 0);
+}
+
+uint_fast64_t FtdiReplay::run (FtdiCaptureReader &reader)
+{
+	#ifdef SHAGA_THREADING
+	_should_stop.store (false, std::memory_order::memory_order_release);
+	#else
+	_should_stop = false;
+	#endif // SHAGA_THREADING
+
+	init ();
+
+	uint_fast64_t cnt = 0;
+
+	try {
+		FtdiStreamState * const state = _naked_state;
+		FtdiCaptureReader::Record record;
+
+		bool first = true;
+		uint64_t first_ts = 0;
+		uint64_t start_ts = 0;
+
+		while (true == reader.next (record)) {
+			#ifdef SHAGA_THREADING
+			if (true == _should_stop.load (std::memory_order::memory_order_acquire)) {
+			#else
+			if (true == _should_stop) {
+			#endif // SHAGA_THREADING
+				break;
+			}
+
+			if (record.stream_id >= state->num_streams) {
+				continue;
+			}
+
+			FtdiStreamEntryState &entrystate = state->entrystates->at (record.stream_id);
+			if (nullptr == entrystate.pool) {
+				continue;
+			}
+
+			if (Speed::ASAP != _speed) {
+				if (true == first) {
+					first = false;
+					first_ts = record.timestamp_ns;
+					start_ts = get_monotime_nsec_ftdi ();
+				}
+
+				/* Records of different streams may be slightly out of order, never wait for those */
+				if (record.timestamp_ns > first_ts) {
+					const uint64_t target = start_ts + static_cast<uint64_t> (static_cast<double> (record.timestamp_ns - first_ts) / _factor);
+
+					struct timespec ts;
+					ts.tv_sec = static_cast<time_t> (target / 1'000'000'000);
+					ts.tv_nsec = static_cast<long> (target % 1'000'000'000);
+					while (::clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+				}
+			}
+
+			deliver (entrystate, record);
+			++cnt;
+		}
+
+		#ifdef SHAGA_THREADING
+		if (nullptr != state->dispatch) {
+			state->dispatch->drain ();
+			if (const std::string err = state->dispatch->take_error (); false == err.empty ()) {
+				cThrow ("{}"sv, err);
+			}
+		}
+		#endif // SHAGA_THREADING
+	}
+	catch (...) {
+		cleanup ();
+		throw;
+	}
+
+	cleanup ();
+	return cnt;
+}
@@ -91,6 +91,16 @@ uint64_t FtdiStream::get_timeout (void) const
 	return _naked_state->timeout;
 }
 
+void FtdiStream::set_dispatch_threads (const uint_fast32_t num_threads)
+{
+	#ifdef SHAGA_THREADING
+	_naked_state->dispatch_threads = num_threads;
+	#else
+	(void) num_threads;
+	cThrow ("This version of the library is compiled without threading support"sv);
+	#endif // SHAGA_THREADING
+}
+
 size_t FtdiStream::get_errors (shaga::COMMON_LIST &append_to_lst)
 {
 	size_t cnt = 0;
@@ -262,6 +272,91 @@ void FtdiStream::reset_stream (const uint_fast32_t stream_id)
 	_naked_state->issue_notice ();
 }
 
+void FtdiStream::set_line (const uint_fast32_t stream_id, const LineParams &params, LineCallback callback)
+{
+	#ifdef SHAGA_THREADING
+	/* Lock both at the same time, avoid deadlock */
+	std::unique_lock<std::mutex> lck1 (_naked_state->list_mutex, std::defer_lock);
+	std::unique_lock<std::mutex> lck2 (_mutex, std::defer_lock);
+	std::lock (lck1, lck2);
+	#endif // SHAGA_THREADING
+
+	if (false == _naked_state->is_started_thr && false == _naked_state->is_started_poll) {
+		cThrow ("Stream is not started"sv);
+	}
+
+	#ifdef SHAGA_THREADING
+	if (_naked_state->should_cancel.load (std::memory_order::memory_order_acquire) == true) {
+		return;
+	}
+	#else
+	if (true == _naked_state->should_cancel) {
+		return;
+	}
+	#endif // SHAGA_THREADING
+
+	if (stream_id >= _naked_state->num_streams) {
+		cThrow ("Undefined stream id"sv);
+	}
+
+	struct ftdi_context * const ftdi = _naked_state->streams.at (stream_id).ftdi;
+	const uint16_t index = static_cast<uint16_t> (ftdi->index);
+
+	FtdiStreamControlSequence sequence;
+	int new_baudrate = 0;
+
+	if (params.baudrate != 0) {
+		unsigned short value, baud_index;
+		new_baudrate = ::ftdi_get_baudrate_request_ex (ftdi, params.baudrate, &value, &baud_index);
+		if (new_baudrate <= 0) {
+			cThrow ("Unsupported baudrate {}"sv, params.baudrate);
+		}
+		sequence.requests.push_back ({SIO_SET_BAUDRATE_REQUEST, value, baud_index});
+	}
+
+	if (params.dtr != LineParams::Pin::UNCHANGED || params.rts != LineParams::Pin::UNCHANGED) {
+		uint16_t value = 0;
+		if (params.dtr != LineParams::Pin::UNCHANGED) {
+			value |= (LineParams::Pin::HIGH == params.dtr) ? SIO_SET_DTR_HIGH : SIO_SET_DTR_LOW;
+		}
+		if (params.rts != LineParams::Pin::UNCHANGED) {
+			value |= (LineParams::Pin::HIGH == params.rts) ? SIO_SET_RTS_HIGH : SIO_SET_RTS_LOW;
+		}
+		sequence.requests.push_back ({SIO_SET_MODEM_CTRL_REQUEST, value, index});
+	}
+
+	if (params.latency_timer != 0) {
+		sequence.requests.push_back ({SIO_SET_LATENCY_TIMER_REQUEST, params.latency_timer, index});
+	}
+
+	if (true == params.change_flow) {
+		sequence.requests.push_back ({SIO_SET_FLOW_CTRL_REQUEST, 0, static_cast<uint16_t> (static_cast<int> (params.flow) | index)});
+	}
+
+	if (true == sequence.requests.empty ()) {
+		cThrow ("No line parameters to change for stream id {}"sv, stream_id);
+	}
+
+	sequence.done = [ftdi, stream_id, new_baudrate, callback](const bool success) -> void {
+		if (true == success && new_baudrate > 0) {
+			ftdi->baudrate = new_baudrate;
+		}
+
+		if (nullptr != callback) {
+			callback (stream_id, success);
+		}
+	};
+
+	_naked_state->list_control.emplace_back (stream_id, std::move (sequence));
+
+	#ifdef SHAGA_THREADING
+	lck1.unlock ();
+	lck2.unlock ();
+	#endif // SHAGA_THREADING
+
+	_naked_state->issue_notice ();
+}
+
 bool FtdiStream::is_started_thread (void) const
 {
 	#ifdef SHAGA_THREADING
@@ -0,0 +1,192 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "internal.h"
+
+using namespace shaga;
+
+#ifdef SHAGA_THREADING
+
+FtdiStreamDispatch::FtdiStreamDispatch (FtdiStreamState * const _state) :
+	state (_state)
+{ }
+
+FtdiStreamDispatch::~FtdiStreamDispatch ()
+{
+	stop ();
+
+	/* Undelivered blocks return to their pools */
+	for (Queue &queue : queues) {
+		for (FtdiBufferBlock * const block : queue.jobs) {
+			block->unref ();
+		}
+		queue.jobs.clear ();
+	}
+}
+
+FtdiStreamDispatch::Queue * FtdiStreamDispatch::add_queue (FtdiStreamEntryState * const entrystate, FtdiStreamSinkState * const sink)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return &queues.emplace_back (entrystate, sink);
+}
+
+void FtdiStreamDispatch::start (const uint_fast32_t num_threads)
+{
+	if (0 == num_threads) {
+		cThrow ("Read dispatch or read sink queue is used, but number of dispatch threads is zero"sv);
+	}
+
+	if (false == threads.empty ()) {
+		cThrow ("Dispatch threads are already started"sv);
+	}
+
+	stopping = false;
+	error_message.clear ();
+
+	try {
+		for (uint_fast32_t i = 0; i < num_threads; ++i) {
+			threads.emplace_back (&FtdiStreamDispatch::worker, this);
+		}
+	}
+	catch (...) {
+		stop ();
+		throw;
+	}
+}
+
+void FtdiStreamDispatch::stop (void) noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		stopping = true;
+	}
+	cond.notify_all ();
+	idle_cond.notify_all ();
+
+	for (std::thread &thr : threads) {
+		if (true == thr.joinable ()) {
+			thr.join ();
+		}
+	}
+	threads.clear ();
+}
+
+bool FtdiStreamDispatch::push (Queue &queue, FtdiBufferBlock * const block, const size_t limit)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+
+	if (limit > 0 && queue.jobs.size () >= limit) {
+		return false;
+	}
+
+	queue.jobs.push_back (block);
+
+	if (false == queue.scheduled) {
+		queue.scheduled = true;
+		ready.push_back (&queue);
+		cond.notify_one ();
+	}
+
+	return true;
+}
+
+void FtdiStreamDispatch::drain (void)
+{
+	std::unique_lock<std::mutex> lock (mutex);
+
+	idle_cond.wait (lock, [this]() -> bool {
+		if (true == stopping || true == threads.empty () || false == error_message.empty ()) {
+			return true;
+		}
+
+		for (const Queue &queue : queues) {
+			if (true == queue.scheduled) {
+				return false;
+			}
+		}
+		return true;
+	});
+}
+
+std::string FtdiStreamDispatch::take_error (void)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return std::exchange (error_message, std::string ());
+}
+
+void FtdiStreamDispatch::worker (void) noexcept
+{
+	std::deque<FtdiBufferBlock *> batch;
+	std::unique_lock<std::mutex> lock (mutex);
+
+	while (true) {
+		cond.wait (lock, [this]() -> bool { return true == stopping || false == ready.empty (); });
+
+		if (true == stopping) {
+			break;
+		}
+
+		/* Take all jobs of the queue, it stays scheduled so no other thread delivers them out of order */
+		Queue * const queue = ready.front ();
+		ready.pop_front ();
+		batch.swap (queue->jobs);
+
+		const bool failed = (false == error_message.empty ());
+		lock.unlock ();
+
+		std::string err;
+		if (false == failed) {
+			try {
+				if (nullptr != queue->sink) {
+					for (FtdiBufferBlock * const block : batch) {
+						queue->sink->callback (block->stream_id, FtdiBuffer (block));
+					}
+				}
+				else {
+					for (FtdiBufferBlock * const block : batch) {
+						queue->entrystate->deliver_read (block);
+					}
+				}
+			}
+			catch (const std::exception &e) {
+				err = fmt::format ("@{}: dispatch - {}"sv, queue->entrystate->stream_id, e.what ());
+			}
+			catch (...) {
+				err = fmt::format ("@{}: dispatch - unknown exception"sv, queue->entrystate->stream_id);
+			}
+		}
+
+		/* Blocks kept by the user return to the pool later */
+		for (FtdiBufferBlock * const block : batch) {
+			block->unref ();
+		}
+		batch.clear ();
+
+		lock.lock ();
+
+		if (true == queue->jobs.empty ()) {
+			queue->scheduled = false;
+			idle_cond.notify_all ();
+		}
+		else {
+			ready.push_back (queue);
+			cond.notify_one ();
+		}
+
+		if (false == err.empty () && true == error_message.empty ()) {
+			/* FtdiStream thread reports the error */
+			error_message = std::move (err);
+			state->issue_notice ();
+			idle_cond.notify_all ();
+		}
+	}
+}
+
+#endif // SHAGA_THREADING
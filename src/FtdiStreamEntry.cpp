@@ -21,9 +21,52 @@ void FtdiStreamEntry::set_read_start_enabled (const bool enabled)
 	read_start_enabled = enabled;
 }
 
+void FtdiStreamEntry::set_read_modem_status_events (const bool enabled)
+{
+	read_modem_status_events = enabled;
+}
+
 void FtdiStreamEntry::set_read_include_modem_status (const bool enabled)
 {
-	read_include_modem_status = enabled;
+	set_read_modem_status_events (enabled);
+}
+
+void FtdiStreamEntry::set_read_timing_events (const bool enabled)
+{
+	read_timing_events = enabled;
+}
+
+void FtdiStreamEntry::set_read_char_bits (const uint_fast32_t bits)
+{
+	if (0 == bits) {
+		cThrow ("Number of bits per character must not be zero"sv);
+	}
+	read_char_bits = bits;
+}
+
+void FtdiStreamEntry::set_read_idle_threshold (const uint_fast32_t completions)
+{
+	read_idle_threshold = completions;
+}
+
+void FtdiStreamEntry::set_read_watermarks (const uint_fast32_t high, const uint_fast32_t low)
+{
+	if (high > 0 && low >= high) {
+		cThrow ("Low watermark {} must be lower than high watermark {}"sv, low, high);
+	}
+
+	read_watermark_high = high;
+	read_watermark_low = low;
+}
+
+void FtdiStreamEntry::set_read_dispatch (const uint_fast32_t queue_depth)
+{
+	read_dispatch_depth = queue_depth;
+}
+
+void FtdiStreamEntry::set_read_spare_buffers (const uint_fast32_t buffers)
+{
+	read_spare_buffers = buffers;
 }
 
 void FtdiStreamEntry::set_read_transfers (const uint_fast32_t packets_per_transfer, const uint_fast32_t transfers)
@@ -54,6 +97,35 @@ void FtdiStreamEntry::set_write_callback (Callback callback)
 	write_callback = callback;
 }
 
+void FtdiStreamEntry::set_read_buffer_callback (BufferCallback callback)
+{
+	read_buffer_callback = callback;
+}
+
+void FtdiStreamEntry::add_read_sink (BufferCallback callback, const uint_fast32_t queue_depth, const SinkOverflow overflow)
+{
+	if (nullptr == callback) {
+		cThrow ("Read sink callback is not set"sv);
+	}
+
+	read_sinks.push_back ({callback, queue_depth, overflow});
+}
+
+void FtdiStreamEntry::set_read_framer (std::shared_ptr<FtdiFramer> framer)
+{
+	read_framer = framer;
+}
+
+void FtdiStreamEntry::set_read_crc (std::shared_ptr<FtdiCrcCheck> crc)
+{
+	read_crc = crc;
+}
+
+void FtdiStreamEntry::set_write_encoder (std::shared_ptr<FtdiEncoder> encoder)
+{
+	write_encoder = encoder;
+}
+
 void FtdiStreamEntry::set_counter_callback (CounterCallback callback)
 {
 	counter_callback = callback;
@@ -63,3 +135,17 @@ void FtdiStreamEntry::set_reset_callback (ResetCallback callback)
 {
 	reset_callback = callback;
 }
+
+void FtdiStreamEntry::set_statistics_callback (StatisticsCallback callback)
+{
+	statistics_callback = callback;
+}
+
+void FtdiStreamEntry::set_latency_timer_policy (const FtdiContext::Config::LatencyTimer &policy)
+{
+	if (policy.min < 1 || policy.min > policy.max) {
+		cThrow ("Latency timer range {} - {} is not valid"sv, policy.min, policy.max);
+	}
+
+	latency_timer = policy;
+}
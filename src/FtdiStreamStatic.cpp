@@ -16,6 +16,10 @@
 #include <sys/timerfd.h>
 #include <fcntl.h>
 
+#ifdef __AVX2__
+	#include <immintrin.h>
+#endif // __AVX2__
+
 using namespace shaga;
 
 static const char* libusb_transfer_status_name (const enum libusb_transfer_status status)
@@ -75,6 +79,233 @@ class FtdiStreamStatic
 			catch (...) { /* Intentionally ignored */ }
 		}
 
+		/* Bits that raise MODEM_STATUS_CHANGED: CTS, DSR, RI and RLSD in the first byte, OE, PE, FE, BI and FIFO error in the second one */
+		static const constexpr uint16_t modem_status_mask {0x9EF0};
+
+		/* Line error bits: OE, PE, FE, BI and FIFO error in the second byte */
+		static const constexpr uint16_t line_error_mask {0x9E00};
+
+		/* Scan modem status of all packets in one pass. 'diff' is OR of differences between masked status and 'previous', */
+		/* zero means no change in the whole transfer. 'seen' is OR of all status words. */
+		static void modem_status_scan (const unsigned char * const buffer, const uint32_t length, const uint32_t packetsize, const uint16_t previous, uint16_t &diff, uint16_t &seen) noexcept
+		{
+			const uint32_t packets = (length + packetsize - 1) / packetsize;
+			uint32_t acc_diff = 0;
+			uint32_t acc_seen = 0;
+			uint32_t i = 0;
+
+			#ifdef __AVX2__
+			/* Gather status words of 8 packets at once. Every packet slot of the transfer buffer is at least 4 bytes long. */
+			if (packets >= 8) {
+				const __m256i offsets = _mm256_mullo_epi32 (_mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32 (packetsize));
+				const __m256i prev = _mm256_set1_epi32 (previous);
+				__m256i vdiff = _mm256_setzero_si256 ();
+				__m256i vseen = _mm256_setzero_si256 ();
+
+				for (; (i + 8) <= packets; i += 8) {
+					const __m256i st = _mm256_i32gather_epi32 (reinterpret_cast<const int *> (buffer + (i * packetsize)), offsets, 1);
+					vdiff = _mm256_or_si256 (vdiff, _mm256_xor_si256 (st, prev));
+					vseen = _mm256_or_si256 (vseen, st);
+				}
+
+				auto reduce = [](const __m256i v) -> uint32_t {
+					__m128i r = _mm_or_si128 (_mm256_castsi256_si128 (v), _mm256_extracti128_si256 (v, 1));
+					r = _mm_or_si128 (r, _mm_shuffle_epi32 (r, _MM_SHUFFLE (1, 0, 3, 2)));
+					r = _mm_or_si128 (r, _mm_shuffle_epi32 (r, _MM_SHUFFLE (2, 3, 0, 1)));
+					return static_cast<uint32_t> (_mm_cvtsi128_si32 (r));
+				};
+
+				acc_diff = reduce (vdiff);
+				acc_seen = reduce (vseen);
+			}
+			#endif // __AVX2__
+
+			for (; i < packets; ++i) {
+				const unsigned char * const ptr = buffer + (i * packetsize);
+				const uint32_t st = static_cast<uint32_t> (ptr[0] | (ptr[1] << 8));
+				acc_diff |= st ^ previous;
+				acc_seen |= st;
+			}
+
+			diff = static_cast<uint16_t> (acc_diff & modem_status_mask);
+			seen = static_cast<uint16_t> (acc_seen);
+		}
+
+		/* Count line errors of every packet, without branches */
+		static void count_line_errors (const unsigned char * const buffer, const uint32_t length, const uint32_t packetsize, FtdiStreamEntry::Statistics &stats) noexcept
+		{
+			const uint32_t packets = (length + packetsize - 1) / packetsize;
+			uint_fast32_t overrun = 0, parity = 0, framing = 0, breaks = 0, fifo = 0;
+
+			for (uint32_t i = 0; i < packets; ++i) {
+				const uint_fast32_t b = buffer[(i * packetsize) + 1];
+				overrun += (b >> 1) & 1;
+				parity += (b >> 2) & 1;
+				framing += (b >> 3) & 1;
+				breaks += (b >> 4) & 1;
+				fifo += (b >> 7) & 1;
+			}
+
+			stats.overrun_errors += overrun;
+			stats.parity_errors += parity;
+			stats.framing_errors += framing;
+			stats.break_interrupts += breaks;
+			stats.fifo_errors += fifo;
+		}
+
+		/* Account one completed read transfer in FtdiStream thread. 'seen' is OR of all status words from modem_status_scan. */
+		static void account_read_data (FtdiStreamState * const state, FtdiStreamEntryState &entrystate, FtdiStreamStaticState &streamstate, const unsigned char * const buffer, const uint32_t length, const uint16_t seen) noexcept
+		{
+			const uint32_t packetsize = state->read_packetsize;
+
+			if ((seen & line_error_mask) != 0) {
+				count_line_errors (buffer, length, packetsize, entrystate.statistics);
+			}
+
+			/* Every packet starts with two bytes of modem status */
+			const uint32_t packets = (length + packetsize - 1) / packetsize;
+			streamstate.counter_bytes += length - std::min (length, packets * 2);
+		}
+
+		/* Call user callbacks for one completed read transfer. One transfer can contain more packets, each at most state->read_packetsize bytes. */
+		/* When 'check_status' is false, no packet of the transfer changes modem status. When 'with_payload' is false, only modem status is reported. */
+		/* READ_TIMING is raised with 'timing' before the payload, if it is enabled. */
+		static void deliver_read_data (FtdiStreamState * const state, FtdiStreamEntryState &entrystate, unsigned char * const buffer, const uint32_t length, const bool check_status, const bool with_payload, const FtdiReadTiming &timing)
+		{
+			FtdiStreamEntry &entry = entrystate.stream;
+			const uint32_t packetsize = state->read_packetsize;
+
+			if (true == with_payload && true == entry.read_timing_events && timing.length > 0) {
+				FtdiReadTiming copy = timing;
+				entry.read_callback (FtdiStreamEntry::CallbackType::READ_TIMING, reinterpret_cast<char *> (&copy), sizeof (copy));
+			}
+
+			unsigned char *ptr = buffer;
+			uint32_t remaining = length;
+
+			while (remaining > 0) {
+				const uint32_t packet_len = std::min (remaining, packetsize);
+
+				if (true == check_status && packet_len >= 2) {
+					const uint16_t status = static_cast<uint16_t> (ptr[0] | (ptr[1] << 8));
+					if (false == entrystate.modem_status_known || ((status ^ entrystate.modem_status) & modem_status_mask) != 0) {
+						entrystate.modem_status_known = true;
+						entrystate.modem_status = status;
+						entry.read_callback (FtdiStreamEntry::CallbackType::MODEM_STATUS_CHANGED, reinterpret_cast<char *> (ptr), 2);
+					}
+				}
+
+				if (true == with_payload && packet_len > 2) {
+					/* Skip first two bytes with modem status */
+					if (nullptr != entrystate.framing) {
+						/* Read sinks get the same buffer later */
+						entrystate.framing->feed (entry, reinterpret_cast<char *> (ptr + 2), packet_len - 2, entrystate.sinks.empty ());
+					}
+					else {
+						entry.read_callback (FtdiStreamEntry::CallbackType::READ_BUFFER, reinterpret_cast<char *> (ptr + 2), packet_len - 2);
+					}
+				}
+
+				ptr += packet_len;
+				remaining -= packet_len;
+			}
+		}
+
+		/* Deliver one completed read transfer from FtdiStream thread */
+		static void process_read_data (FtdiStreamState * const state, FtdiStreamEntryState &entrystate, FtdiStreamStaticState &streamstate, unsigned char * const buffer, const uint32_t length, const uint64_t timestamp_ns)
+		{
+			/* Most transfers neither change modem status nor carry line errors, check all packets at once before looking at each one */
+			uint16_t diff, seen;
+			modem_status_scan (buffer, length, state->read_packetsize, entrystate.modem_status, diff, seen);
+
+			account_read_data (state, entrystate, streamstate, buffer, length, seen);
+
+			bool check_status = false;
+			if (true == streamstate.is_modem_status) {
+				check_status = (false == entrystate.modem_status_known) || (diff != 0);
+			}
+
+			deliver_read_data (state, entrystate, buffer, length, check_status, true, entrystate.estimate_read_timing (timestamp_ns, length));
+		}
+
+		/* Remove modem status bytes in place, payload of all packets becomes contiguous from buffer + 2. Returns payload length. */
+		static uint32_t compact_read_data (unsigned char * const buffer, const uint32_t length, const uint32_t packetsize) noexcept
+		{
+			if (length <= 2) {
+				return 0;
+			}
+
+			/* Payload of the first packet stays where it is */
+			const uint32_t first_len = std::min (length, packetsize);
+			unsigned char *dst = buffer + first_len;
+
+			for (uint32_t pos = first_len; pos < length; pos += packetsize) {
+				const uint32_t packet_len = std::min (length - pos, packetsize);
+				if (packet_len > 2) {
+					::memmove (dst, buffer + pos + 2, packet_len - 2);
+					dst += packet_len - 2;
+				}
+			}
+
+			return static_cast<uint32_t> (dst - (buffer + 2));
+		}
+
+		/* Replace block of completed read transfer with a spare one from the pool and deliver the filled block, */
+		/* either right away or from dispatch threads. Returns false if the pool is empty, transfer is starved */
+		/* until a block returns to the pool. */
+		static bool lend_read_data (FtdiStreamState * const state, FtdiStreamEntryState &entrystate, FtdiStreamStaticState &streamstate, const uint64_t timestamp_ns)
+		{
+			struct libusb_transfer * const transfer = streamstate.transfer;
+
+			/* Modem status is tracked by deliver_read, only line errors are counted here */
+			uint16_t diff, seen;
+			modem_status_scan (transfer->buffer, transfer->actual_length, state->read_packetsize, 0, diff, seen);
+
+			account_read_data (state, entrystate, streamstate, transfer->buffer, transfer->actual_length, seen);
+
+			if (transfer->actual_length <= 2 && false == streamstate.is_modem_status) {
+				/* Nothing to deliver */
+				return true;
+			}
+
+			FtdiBufferBlock * const block = streamstate.block;
+			block->length = transfer->actual_length;
+			block->timing = entrystate.estimate_read_timing (timestamp_ns, block->length);
+
+			const unsigned char * const last_packet = block->buffer + (((block->length - 1) / state->read_packetsize) * state->read_packetsize);
+			block->modem_status = static_cast<uint16_t> (last_packet[0] | (last_packet[1] << 8));
+
+			block->ref ();
+
+			FtdiBufferBlock * const spare = entrystate.pool->take ();
+			streamstate.block = spare;
+			transfer->buffer = (nullptr == spare) ? nullptr : spare->buffer;
+
+			if (nullptr == spare) {
+				streamstate.enabled = false;
+				streamstate.starved = true;
+				++entrystate.starved_reads;
+			}
+
+			#ifdef SHAGA_THREADING
+			if (nullptr != entrystate.dispatch_queue) {
+				state->dispatch->push (*entrystate.dispatch_queue, block);
+				return (nullptr != spare);
+			}
+			#endif // SHAGA_THREADING
+
+			try {
+				entrystate.deliver_read (block);
+			}
+			catch (...) {
+				block->unref ();
+				throw;
+			}
+			block->unref ();
+
+			return (nullptr != spare);
+		}
+
 		static void LIBUSB_CALL read_callback (struct libusb_transfer * const transfer) noexcept
 		{
 			FtdiStreamStaticState * const streamstate = reinterpret_cast<FtdiStreamStaticState *> (transfer->user_data);
@@ -92,53 +323,83 @@ class FtdiStreamStatic
 
 			FtdiStreamState * const state = streamstate->state;
 
-			if (LIBUSB_TRANSFER_CANCELLED == transfer->status || false == state->should_run) {
+			if (false == state->should_run) {
 				streamstate->enabled = false;
 				cancel (state);
 				return;
 			}
 
+			if (LIBUSB_TRANSFER_CANCELLED == transfer->status) {
+				/* Cancelled by disable_reading, stream keeps running */
+				streamstate->enabled = false;
+				return;
+			}
+
 			try {
 				if (LIBUSB_TRANSFER_COMPLETED == transfer->status) {
-					/* First two bytes of every transfer contain modem status */
+					/* vDSO clock, no syscall */
+					const uint64_t timestamp_ns = get_monotime_nsec_ftdi ();
+
+					FtdiStreamEntryState * const entrystate = streamstate->entrystate;
+					FtdiStreamEntry &entry = entrystate->stream;
+
+					if (FtdiContext::Config::LatencyTimer::Mode::AUTO == entry.latency_timer.mode) {
+						if (transfer->actual_length > 2) {
+							++entrystate->latency_completions;
+							entrystate->latency_payload += transfer->actual_length;
+							if (transfer->actual_length >= streamstate->buffer_size) {
+								++entrystate->latency_full_completions;
+							}
+						}
+					}
+
+					/* First two bytes of every packet contain modem status */
 					if (transfer->actual_length > 2) {
 						state->ts_activity = state->ts_now;
 
-						char *ptr = reinterpret_cast<char *> (transfer->buffer);
-						uint32_t length = transfer->actual_length;
-
-//						if (0 == streamstate->stream_id && 0 == streamstate->transfer_id) {
-//							state->error_spsc.push_back (fmt::format ("len={}, read_packetsize={}"sv, length, state->read_packetsize));
-//						}
-
-						/* One transfer can contain more messages. Each message is at most state->read_packetsize bytes */
-						while (length > 0) {
-							const uint32_t packetLen = std::min (length, state->read_packetsize);
-							//P::print ("{} {}"sv, length, packetLen);
+						/* First payload byte restores full depth of read transfers */
+						entrystate->idle_completions = 0;
+						if (true == entrystate->idle) {
+							entrystate->leave_idle ();
+						}
+					}
+					else if (entry.read_idle_threshold > 0 && false == entrystate->idle) {
+						/* Status only completion, device has nothing to send */
+						if ((++entrystate->idle_completions) >= entry.read_idle_threshold) {
+							entrystate->idle = true;
+						}
+					}
 
-							FtdiStreamEntry &entry = state->streams[streamstate->stream_id];
-							if (true == streamstate->is_modem_status) {
-								if (packetLen >= 2) {
-									streamstate->counter_bytes += packetLen - 2;
-									entry.read_callback (FtdiStreamEntry::CallbackType::READ_BUFFER, ptr, packetLen);
-								}
-							}
-							else {
-								if (packetLen > 2) {
-									streamstate->counter_bytes += packetLen - 2;
-									/* User doesn't want modem status, skip first two bytes */
-									entry.read_callback (FtdiStreamEntry::CallbackType::READ_BUFFER, ptr + 2, packetLen - 2);
-								}
-							}
+					if (transfer->actual_length >= 2) {
+						if (nullptr == entrystate->pool) {
+							process_read_data (state, *entrystate, *streamstate, transfer->buffer, transfer->actual_length, timestamp_ns);
+						}
+						else if (false == lend_read_data (state, *entrystate, *streamstate, timestamp_ns)) {
+							return;
+						}
+					}
 
-							ptr += packetLen;
-							length -= packetLen;
+					/* Consumer is behind, stop resubmitting until it drops below low watermark */
+					if (entry.read_watermark_high > 0 && false == entrystate->throttled) {
+						const int pending = entry.read_callback (FtdiStreamEntry::CallbackType::READ_GET_PENDING, nullptr, 0);
+						if (pending < 0) {
+							cThrow ("Callback READ_GET_PENDING reported error {}"sv, pending);
+						}
+						else if (static_cast<uint_fast32_t> (pending) >= entry.read_watermark_high) {
+							entrystate->throttled = true;
+							++entrystate->statistics.throttled;
+							++state->throttled_streams;
 						}
 					}
-					else if (true == streamstate->is_modem_status && 2 == transfer->actual_length) {
-						char *ptr = reinterpret_cast<char *> (transfer->buffer);
-						FtdiStreamEntry &entry = state->streams[streamstate->stream_id];
-						entry.read_callback (FtdiStreamEntry::CallbackType::READ_BUFFER, ptr, 2);
+
+					if (true == entrystate->throttled) {
+						entrystate->park_read (streamstate, 0);
+						return;
+					}
+
+					/* While idle, keep only one read transfer in flight */
+					if (transfer->actual_length <= 2 && true == entrystate->idle && true == entrystate->park_read (streamstate, 1)) {
+						return;
 					}
 
 					if (::libusb_submit_transfer (transfer) != LIBUSB_SUCCESS) {
@@ -194,7 +455,7 @@ class FtdiStreamStatic
 					}
 				}
 
-				transfer->length = state->streams[streamstate->stream_id].write_callback (FtdiStreamEntry::CallbackType::WRITE_FILL_BUFFER, reinterpret_cast<char *> (transfer->buffer), streamstate->buffer_size);
+				transfer->length = streamstate->entrystate->fill_write (reinterpret_cast<char *> (transfer->buffer), streamstate->buffer_size);
 				if (transfer->length < 0) {
 					cThrow ("Callback WRITE_FILL_BUFFER reported error {}"sv, transfer->length);
 				}
@@ -217,6 +478,55 @@ class FtdiStreamStatic
 			}
 		}
 
+		static void LIBUSB_CALL control_callback (struct libusb_transfer * const transfer) noexcept
+		{
+			FtdiStreamEntryState * const entrystate = reinterpret_cast<FtdiStreamEntryState *> (transfer->user_data);
+
+			if (nullptr == entrystate) {
+				return;
+			}
+
+			FtdiStreamState * const state = entrystate->state;
+			entrystate->control_busy = false;
+
+			if (LIBUSB_TRANSFER_CANCELLED == transfer->status || false == state->should_run) {
+				entrystate->control_queue.clear ();
+				entrystate->control_pos = 0;
+				return;
+			}
+
+			try {
+				const bool success = (LIBUSB_TRANSFER_COMPLETED == transfer->status);
+
+				FtdiStreamControlSequence &sequence = entrystate->control_queue.front ();
+				if (true == success && (++entrystate->control_pos) < sequence.requests.size ()) {
+					/* Continue with the next request of the same sequence */
+					entrystate->submit_control ();
+					return;
+				}
+
+				/* Sequence is either finished or failed, remaining requests are skipped */
+				auto done = std::move (sequence.done);
+				entrystate->control_queue.pop_front ();
+				entrystate->control_pos = 0;
+
+				if (nullptr != done) {
+					done (success);
+				}
+				else if (false == success) {
+					cThrow ("Unexpected LIBUSB_TRANSFER state {}"sv, libusb_transfer_status_name (transfer->status));
+				}
+
+				entrystate->submit_control ();
+			}
+			catch (const std::exception &e) {
+				error (state, "@{}: control callback - {}"sv, entrystate->stream_id, e.what ());
+			}
+			catch (...) {
+				error (state, "@{}: control callback - unknown exception"sv, entrystate->stream_id);
+			}
+		}
+
 		static void LIBUSB_CALL add_to_epoll (int sock, const uint32_t ev, void * const user_data) noexcept
 		{
 			if (nullptr == user_data) {
@@ -302,6 +612,29 @@ class FtdiStreamStatic
 				streamstate.counter_bytes = 0;
 			}
 
+			for (FtdiStreamEntryState &entrystate : *state->entrystates) {
+				process_latency_timer (state, entrystate);
+
+				FtdiStreamEntry &entry = entrystate.stream;
+				if (entry.statistics_callback != nullptr) {
+					entrystate.statistics.idle = entrystate.idle;
+					entrystate.statistics.latency_timer = entrystate.latency_current;
+
+					#ifdef SHAGA_THREADING
+					for (FtdiStreamSinkState &sink : entrystate.sinks) {
+						entrystate.statistics.sink_drops += sink.drops.exchange (0, std::memory_order_relaxed);
+					}
+					#endif // SHAGA_THREADING
+
+					if (nullptr != entrystate.framing) {
+						entrystate.statistics.frame_errors += entrystate.framing->take_errors ();
+						entrystate.statistics.bad_crc += entrystate.framing->take_bad_crc ();
+					}
+					entry.statistics_callback (entrystate.stream_id, entrystate.statistics);
+				}
+				entrystate.statistics = FtdiStreamEntry::Statistics ();
+			}
+
 			if (0 == state->timeout) {
 				return;
 			}
@@ -313,6 +646,66 @@ class FtdiStreamStatic
 			}
 		}
 
+		/* Called once per second. Interactive traffic arrives in small transfers flushed by the latency timer, */
+		/* so lowering the timer lowers the latency. Bulk traffic fills whole transfers, so raising the timer */
+		/* only reduces the number of short transfers and wakeups. Value moves by halving or doubling. */
+		static void process_latency_timer (FtdiStreamState * const state, FtdiStreamEntryState &entrystate)
+		{
+			const FtdiContext::Config::LatencyTimer &policy = entrystate.stream.latency_timer;
+
+			const uint_fast32_t completions = std::exchange (entrystate.latency_completions, 0);
+			const uint_fast32_t full_completions = std::exchange (entrystate.latency_full_completions, 0);
+			const uint_fast64_t payload = std::exchange (entrystate.latency_payload, 0);
+
+			if (policy.mode != FtdiContext::Config::LatencyTimer::Mode::AUTO || 0 == completions || true == entrystate.latency_pending) {
+				return;
+			}
+
+			uint_fast32_t current = entrystate.latency_current;
+			if (0 == current) {
+				current = (policy.value > 0) ? policy.value : 16;
+			}
+
+			uint_fast32_t target = current;
+
+			if ((full_completions * 2) >= completions) {
+				/* Bulk link, at least half of the transfers are full */
+				target = std::min<uint_fast32_t> (current * 2, policy.max);
+			}
+			else if ((payload / completions) < (state->read_packetsize / 2)) {
+				/* Interactive link, transfers carry less than half of a packet */
+				target = std::max<uint_fast32_t> (current / 2, policy.min);
+			}
+
+			target = std::clamp<uint_fast32_t> (target, policy.min, policy.max);
+
+			if (target != entrystate.latency_current) {
+				entrystate.queue_latency_timer (static_cast<uint8_t> (target));
+			}
+		}
+
+		/* Resume throttled streams whose consumers dropped below low watermark */
+		static void process_throttled (FtdiStreamState * const state)
+		{
+			for (FtdiStreamEntryState &entrystate : *state->entrystates) {
+				if (false == entrystate.throttled) {
+					continue;
+				}
+
+				FtdiStreamEntry &entry = entrystate.stream;
+				const int pending = entry.read_callback (FtdiStreamEntry::CallbackType::READ_GET_PENDING, nullptr, 0);
+				if (pending < 0) {
+					cThrow ("@{}: Callback READ_GET_PENDING reported error {}"sv, entrystate.stream_id, pending);
+				}
+
+				if (static_cast<uint_fast32_t> (pending) <= entry.read_watermark_low) {
+					entrystate.throttled = false;
+					--state->throttled_streams;
+					entrystate.unpark_reads ();
+				}
+			}
+		}
+
 		static void event_notice (FtdiStreamState * const state)
 		{
 			uint64_t val;
@@ -351,6 +744,26 @@ class FtdiStreamStatic
 
 			process_reset_stream_entry (state, false);
 
+			#ifdef SHAGA_THREADING
+			if (nullptr != state->dispatch) {
+				if (const std::string err = state->dispatch->take_error (); false == err.empty ()) {
+					error (state, "{}"sv, err);
+					return;
+				}
+			}
+			#endif // SHAGA_THREADING
+
+			for (FtdiStreamEntryState &entrystate : *state->entrystates) {
+				if (entrystate.starved_reads > 0) {
+					entrystate.feed_starved ();
+				}
+			}
+
+			for (auto &[stream_id, sequence] : state->list_control) {
+				state->entrystates->at (stream_id).queue_control (std::move (sequence));
+			}
+			state->list_control.clear ();
+
 			for (const int lst : state->list_enable) {
 				auto [iter_begin, iter_end] = state->streamstates->equal_range (lst);
 				for (auto iter = iter_begin; iter != iter_end; ++iter) {
@@ -365,6 +778,16 @@ class FtdiStreamStatic
 			for (const int lst : state->list_disable) {
 				auto [iter_begin, iter_end] = state->streamstates->equal_range (lst);
 				for (auto iter = iter_begin; iter != iter_end; ++iter) {
+					if (std::exchange (iter->second.parked, false) == true) {
+						/* Parked by idle mode, it is not submitted, so forget it */
+						--iter->second.entrystate->parked_reads;
+					}
+
+					if (std::exchange (iter->second.starved, false) == true) {
+						/* Waiting for a spare buffer, it gets one when reading is enabled again */
+						--iter->second.entrystate->starved_reads;
+					}
+
 					if (true == iter->second.enabled) {
 						/* This entry is now enabled, so call cancel */
 						iter->second.cancel ();
@@ -395,16 +818,26 @@ class FtdiStreamStatic
 				state->epoll_fd = -1;
 			}
 
+			#ifdef SHAGA_THREADING
+			/* Dispatch threads use entry states, stop them first */
+			state->dispatch.reset ();
+			#endif // SHAGA_THREADING
+
 			state->streamstates.reset ();
+			state->entrystates.reset ();
 		}
 
+		/* When reset_all is true, all streams are reset synchronously. This is used only outside of the event loop. */
+		/* Otherwise streams from list_reset are reset by asynchronous control transfers, so other streams are not blocked. */
 		static void process_reset_stream_entry (FtdiStreamState * const state, const bool reset_all)
 		{
-			auto func = [](FtdiStreamEntry &stream) -> void {
-				if (nullptr != stream.reset_callback) {
-					stream.reset_callback (stream.ftdi);
-				}
-				else {
+			if (true == reset_all) {
+				for (FtdiStreamEntry &stream : state->streams) {
+					if (nullptr != stream.reset_callback) {
+						stream.reset_callback (stream.ftdi);
+						continue;
+					}
+
 					/* We don't know in what state we are, switch to reset*/
 					if (::ftdi_set_bitmode (stream.ftdi, 0xff, BITMODE_RESET) < 0) {
 						cThrow ("Can't reset mode"sv);
@@ -415,16 +848,16 @@ class FtdiStreamStatic
 						cThrow ("Can't Purge"sv);
 					}
 				}
-			};
-
-			if (true == reset_all) {
-				for (FtdiStreamEntry &stream : state->streams) {
-					func (stream);
-				}
 			}
 			else {
 				for (const uint_fast32_t stream_id : state->list_reset) {
-					func (state->streams.at (stream_id));
+					FtdiStreamEntry &stream = state->streams.at (stream_id);
+					if (nullptr != stream.reset_callback) {
+						stream.reset_callback (stream.ftdi);
+					}
+					else {
+						state->entrystates->at (stream_id).queue_reset ();
+					}
 				}
 				state->list_reset.clear ();
 			}
@@ -444,11 +877,14 @@ class FtdiStreamStatic
 				state->streamstates = std::make_unique<FtdiStreamStaticStates_t> ();
 				FtdiStreamStaticStates_t *streamstates = state->streamstates.get ();
 
+				state->entrystates = std::make_unique<FtdiStreamEntryStates_t> ();
+
 				state->epoll_fd = -1;
 				state->usb_epoll_fd = -1;
 				state->timer_fd = -1;
 
 				state->cancel_counter = 3;
+				state->throttled_streams = 0;
 
 				const uint64_t now = get_monotime_sec ();
 				state->ts_now = now;
@@ -457,6 +893,7 @@ class FtdiStreamStatic
 				state->list_enable.clear ();
 				state->list_disable.clear ();
 				state->list_reset.clear ();
+				state->list_control.clear ();
 
 				state->should_run = true;
 
@@ -519,6 +956,15 @@ class FtdiStreamStatic
 
 				process_reset_stream_entry (state, true);
 
+				for (uint_fast32_t stream_id = 0; stream_id < state->num_streams; ++stream_id) {
+					FtdiStreamEntry &stream = state->streams[stream_id];
+					FtdiStreamEntryState &entrystate = state->entrystates->emplace_back (stream_id, stream, state);
+
+					if (stream.read_transfers > 0) {
+						entrystate.init_delivery (false);
+					}
+				}
+
 				for (uint_fast32_t stream_id = 0; stream_id < state->num_streams; ++stream_id) {
 					FtdiStreamEntry &stream = state->streams[stream_id];
 					P::debug_print ("FtdiStream init streamd_id = {}, read transfers = {}, write transfers = {}"sv, stream_id, stream.read_transfers, stream.write_transfers);
@@ -532,11 +978,16 @@ class FtdiStreamStatic
 							stream_id,
 							transfer_id,
 							is_reading,
-							stream.read_include_modem_status,
+							stream.read_modem_status_events,
 							eventfd,
-							state
+							state,
+							&state->entrystates->at (stream_id)
 						));
 						ret->second.init (stream);
+
+						if (true == is_reading) {
+							state->entrystates->at (stream_id).read_states.push_back (&ret->second);
+						}
 					};
 
 					for (uint_fast32_t i = 0; i < stream.read_transfers; ++i) {
@@ -548,6 +999,12 @@ class FtdiStreamStatic
 					}
 				}
 
+				#ifdef SHAGA_THREADING
+				if (nullptr != state->dispatch) {
+					state->dispatch->start (state->dispatch_threads);
+				}
+				#endif // SHAGA_THREADING
+
 			}
 			catch (const std::exception &e) {
 				process_cleanup (state);
@@ -567,18 +1024,28 @@ class FtdiStreamStatic
 				return false;
 			}
 
-			const int ret = ::epoll_wait (state->epoll_fd, state->epoll_events, state->num_epoll_events, timeout);
+			int wait_timeout = timeout;
+			if (state->throttled_streams > 0 && (wait_timeout < 0 || wait_timeout > 1)) {
+				/* Throttled streams are checked on every step, don't sleep for too long */
+				wait_timeout = 1;
+			}
+
+			const int ret = ::epoll_wait (state->epoll_fd, state->epoll_events, state->num_epoll_events, wait_timeout);
 			if (ret < 0) {
 				cancel (state);
 				return false;
 			}
 
-			if (0 == ret) {
+			if (0 == ret && 0 == state->throttled_streams) {
 				/* Timeout reached */
 				return true;
 			}
 
 			try {
+				if (state->throttled_streams > 0) {
+					process_throttled (state);
+				}
+
 				for (int index = 0; index < ret; ++index) {
 					struct epoll_event &e = state->epoll_events[index];
 					const int sock = e.data.fd;
@@ -620,6 +1087,12 @@ class FtdiStreamStatic
 						}
 					}
 
+					for (FtdiStreamEntryState &entrystate : *(state->entrystates)) {
+						if (false == entrystate.cancel_control ()) {
+							are_all_disabled = false;
+						}
+					}
+
 					if ((--state->cancel_counter) < 0) {
 						are_all_disabled = true;
 					}
@@ -664,7 +1137,8 @@ FtdiStreamStaticState::FtdiStreamStaticState (
 	const bool _is_reading,
 	const bool _is_modem_status,
 	const int _eventfd,
-	FtdiStreamState * const _state
+	FtdiStreamState * const _state,
+	FtdiStreamEntryState * const _entrystate
 ) :
 	stream_id (_stream_id),
 	transfer_id (_transfer_id),
@@ -672,6 +1146,7 @@ FtdiStreamStaticState::FtdiStreamStaticState (
 	is_modem_status (_is_modem_status),
 	eventfd (_eventfd),
 	state (_state),
+	entrystate (_entrystate),
 	transfer (::libusb_alloc_transfer (0))
 {
 	P::debug_print ("FtdiStream init tranfer @{},{}: reading = {}, fd = {}"sv, stream_id, transfer_id, is_reading, eventfd);
@@ -684,7 +1159,13 @@ FtdiStreamStaticState::FtdiStreamStaticState (
 FtdiStreamStaticState::~FtdiStreamStaticState ()
 {
 	if (nullptr != transfer) {
-		if (nullptr != transfer->buffer) {
+		if (nullptr != block) {
+			/* Buffer belongs to the pool */
+			transfer->buffer = nullptr;
+			block->pool->release (block);
+			block = nullptr;
+		}
+		else if (nullptr != transfer->buffer) {
 			::free (transfer->buffer);
 			transfer->buffer = nullptr;
 		}
@@ -700,11 +1181,20 @@ void FtdiStreamStaticState::init (FtdiStreamEntry &stream)
 		enabled = stream.read_start_enabled;
 		buffer_size = state->read_packetsize * stream.read_packets_per_transfer;
 
+		unsigned char *buffer = nullptr;
+		if (nullptr != entrystate->pool) {
+			block = entrystate->pool->take ();
+			buffer = (nullptr == block) ? nullptr : block->buffer;
+		}
+		else {
+			buffer = reinterpret_cast<unsigned char *> (::malloc (buffer_size));
+		}
+
 		::libusb_fill_bulk_transfer (
 			transfer, // the transfer to populate
 			stream.ftdi->usb_dev, // handle of the device that will handle the transfer
 			stream.ftdi->out_ep, // address of the endpoint where this transfer will be sent
-			reinterpret_cast<unsigned char *> (::malloc (buffer_size)), // data buffer
+			buffer, // data buffer
 			buffer_size, // length of data buffer
 			FtdiStreamStatic::read_callback, // callback function to be invoked on transfer completion
 			this, // user data to pass to callback function
@@ -741,10 +1231,20 @@ void FtdiStreamStaticState::init (FtdiStreamEntry &stream)
 
 void FtdiStreamStaticState::submit (void)
 {
-	if (nullptr == transfer || nullptr == transfer->buffer) {
+	if (nullptr == transfer) {
 		cThrow ("@{},{}: Unable to submit null transfer"sv, stream_id, transfer_id);
 	}
 
+	if (nullptr == transfer->buffer) {
+		/* Buffer of starved read transfer is still with dispatch threads */
+		if (true == is_reading && true == enabled && false == entrystate->refill_read (this)) {
+			return;
+		}
+		else if (nullptr == transfer->buffer) {
+			cThrow ("@{},{}: Unable to submit transfer without buffer"sv, stream_id, transfer_id);
+		}
+	}
+
 	if (false == state->should_run) {
 		return;
 	}
@@ -753,7 +1253,7 @@ void FtdiStreamStaticState::submit (void)
 		if (true == is_reading) {
 			transfer->length = buffer_size;
 		} else {
-			transfer->length = state->streams[stream_id].write_callback (FtdiStreamEntry::CallbackType::WRITE_FILL_BUFFER, reinterpret_cast<char *> (transfer->buffer), buffer_size);
+			transfer->length = entrystate->fill_write (reinterpret_cast<char *> (transfer->buffer), buffer_size);
 		}
 
 		if (transfer->length < 0) {
@@ -780,6 +1280,369 @@ void FtdiStreamStaticState::cancel (void)
 	}
 }
 
+FtdiStreamEntryState::FtdiStreamEntryState (
+	const uint_fast32_t _stream_id,
+	FtdiStreamEntry &_stream,
+	FtdiStreamState * const _state
+) :
+	stream_id (_stream_id),
+	stream (_stream),
+	state (_state),
+	control_transfer (::libusb_alloc_transfer (0))
+{
+	if (nullptr == control_transfer) {
+		cThrow ("@{}: Unable to allocate control transfer"sv, stream_id);
+	}
+
+	if (nullptr != stream.read_crc && nullptr == stream.read_framer) {
+		::libusb_free_transfer (control_transfer);
+		cThrow ("@{}: Read CRC check requires read framer"sv, stream_id);
+	}
+
+	::bzero (control_buffer, sizeof (control_buffer));
+
+	if (nullptr != stream.read_framer) {
+		framing = std::make_unique<FtdiFramingState> (stream.read_framer, stream.read_crc);
+	}
+
+	if (nullptr != stream.write_encoder) {
+		encoding = std::make_unique<FtdiEncodingState> (stream.write_encoder);
+	}
+}
+
+FtdiStreamEntryState::~FtdiStreamEntryState ()
+{
+	if (nullptr != pool) {
+		/* Blocks held by the user keep the pool alive */
+		std::exchange (pool, nullptr)->close ();
+	}
+
+	if (nullptr != control_transfer) {
+		::libusb_free_transfer (control_transfer);
+		control_transfer = nullptr;
+	}
+}
+
+void FtdiStreamEntryState::queue_control (FtdiStreamControlSequence &&sequence)
+{
+	if (true == sequence.requests.empty ()) {
+		if (nullptr != sequence.done) {
+			sequence.done (true);
+		}
+		return;
+	}
+
+	control_queue.push_back (std::move (sequence));
+	submit_control ();
+}
+
+void FtdiStreamEntryState::queue_reset (void)
+{
+	struct ftdi_context * const ftdi = stream.ftdi;
+
+	const uint16_t index = static_cast<uint16_t> (ftdi->index);
+
+	FtdiStreamControlSequence sequence;
+
+	/* We don't know in what state we are, switch to reset */
+	sequence.requests.push_back ({SIO_SET_BITMODE_REQUEST, static_cast<uint16_t> (0xff | (BITMODE_RESET << 8)), index});
+
+	/* Purge anything remaining in the buffers */
+	sequence.requests.push_back ({SIO_RESET_REQUEST, SIO_TCOFLUSH, index});
+	sequence.requests.push_back ({SIO_RESET_REQUEST, SIO_TCIFLUSH, index});
+
+	sequence.done = [ftdi](const bool success) -> void {
+		if (false == success) {
+			cThrow ("Can't reset stream"sv);
+		}
+
+		ftdi->bitbang_mode = BITMODE_RESET;
+		ftdi->bitbang_enabled = 0;
+	};
+
+	queue_control (std::move (sequence));
+}
+
+void FtdiStreamEntryState::queue_latency_timer (const uint8_t latency)
+{
+	FtdiStreamControlSequence sequence;
+	sequence.requests.push_back ({SIO_SET_LATENCY_TIMER_REQUEST, latency, static_cast<uint16_t> (stream.ftdi->index)});
+
+	sequence.done = [this, latency](const bool success) -> void {
+		latency_pending = false;
+		if (true == success) {
+			latency_current = latency;
+		}
+	};
+
+	latency_pending = true;
+	queue_control (std::move (sequence));
+}
+
+bool FtdiStreamEntryState::park_read (FtdiStreamStaticState * const streamstate, const size_t keep_in_flight)
+{
+	if ((read_states.size () - parked_reads) <= keep_in_flight) {
+		return false;
+	}
+
+	streamstate->enabled = false;
+	streamstate->parked = true;
+	++parked_reads;
+
+	return true;
+}
+
+void FtdiStreamEntryState::leave_idle (void)
+{
+	idle = false;
+
+	if (false == throttled) {
+		unpark_reads ();
+	}
+}
+
+void FtdiStreamEntryState::unpark_reads (void)
+{
+	for (FtdiStreamStaticState * const streamstate : read_states) {
+		if (std::exchange (streamstate->parked, false) == true) {
+			--parked_reads;
+			if (std::exchange (streamstate->enabled, true) == false) {
+				streamstate->submit ();
+			}
+		}
+	}
+}
+
+bool FtdiStreamEntryState::refill_read (FtdiStreamStaticState * const streamstate)
+{
+	if (nullptr != pool) {
+		streamstate->block = pool->take ();
+		if (nullptr != streamstate->block) {
+			streamstate->transfer->buffer = streamstate->block->buffer;
+			return true;
+		}
+	}
+
+	streamstate->enabled = false;
+	if (std::exchange (streamstate->starved, true) == false) {
+		++starved_reads;
+	}
+	return false;
+}
+
+void FtdiStreamEntryState::feed_starved (void)
+{
+	for (FtdiStreamStaticState * const streamstate : read_states) {
+		if (0 == starved_reads) {
+			break;
+		}
+
+		if (false == streamstate->starved) {
+			continue;
+		}
+
+		streamstate->block = pool->take ();
+		if (nullptr == streamstate->block) {
+			/* Consumers still hold all blocks */
+			break;
+		}
+		streamstate->transfer->buffer = streamstate->block->buffer;
+
+		streamstate->starved = false;
+		--starved_reads;
+
+		if (true == throttled) {
+			streamstate->parked = true;
+			++parked_reads;
+		}
+		else if (std::exchange (streamstate->enabled, true) == false) {
+			streamstate->submit ();
+		}
+	}
+}
+
+void FtdiStreamEntryState::init_delivery (const bool force_pool)
+{
+	if (stream.read_dispatch_depth > 0) {
+		#ifdef SHAGA_THREADING
+		if (nullptr == state->dispatch) {
+			state->dispatch = std::make_unique<FtdiStreamDispatch> (state);
+		}
+		dispatch_queue = state->dispatch->add_queue (this);
+		#else
+		cThrow ("@{}: Read dispatch needs threading support"sv, stream_id);
+		#endif // SHAGA_THREADING
+	}
+
+	uint_fast32_t sink_buffers = 0;
+	for (const FtdiStreamEntry::ReadSink &sink : stream.read_sinks) {
+		FtdiStreamSinkState &sinkstate = sinks.emplace_back (sink.callback, sink.queue_depth, sink.overflow);
+		if (0 == sink.queue_depth) {
+			continue;
+		}
+
+		#ifdef SHAGA_THREADING
+		if (nullptr == state->dispatch) {
+			state->dispatch = std::make_unique<FtdiStreamDispatch> (state);
+		}
+		sinkstate.queue = state->dispatch->add_queue (this, &sinkstate);
+		sink_buffers += sink.queue_depth;
+		#else
+		(void) sinkstate;
+		cThrow ("@{}: Read sink with queue needs threading support"sv, stream_id);
+		#endif // SHAGA_THREADING
+	}
+
+	if (true == force_pool || stream.read_dispatch_depth > 0 || nullptr != stream.read_buffer_callback || false == sinks.empty ()) {
+		/* Every read transfer owns one block, the rest are spare */
+		pool = FtdiBufferPool::create (
+			state,
+			stream_id,
+			std::max<uint_fast32_t> (stream.read_transfers, 1) + stream.read_dispatch_depth + stream.read_spare_buffers + sink_buffers,
+			state->read_packetsize * std::max<uint_fast32_t> (stream.read_packets_per_transfer, 1));
+	}
+}
+
+int FtdiStreamEntryState::fill_write (char * const buffer, const int len)
+{
+	if (nullptr != encoding) {
+		return encoding->fill (stream, buffer, len);
+	}
+
+	return stream.write_callback (FtdiStreamEntry::CallbackType::WRITE_FILL_BUFFER, buffer, len);
+}
+
+FtdiReadTiming FtdiStreamEntryState::estimate_read_timing (const uint64_t timestamp_ns, const uint32_t length) noexcept
+{
+	const uint32_t packetsize = state->read_packetsize;
+	const uint32_t packets = (length + packetsize - 1) / packetsize;
+
+	FtdiReadTiming timing;
+	timing.timestamp_ns = timestamp_ns;
+	timing.previous_ns = read_last_byte_ns;
+	timing.length = length - std::min (length, packets * 2);
+
+	if (stream.ftdi->baudrate > 0) {
+		timing.byte_ns = (static_cast<uint64_t> (stream.read_char_bits) * 1'000'000'000) / static_cast<uint64_t> (stream.ftdi->baudrate);
+	}
+
+	if (0 == timing.length) {
+		timing.last_byte_ns = read_last_byte_ns;
+		return timing;
+	}
+
+	uint64_t last = timestamp_ns;
+	if ((length % packetsize) != 0) {
+		/* Short last packet was flushed by the latency timer */
+		uint64_t latency = latency_current;
+		if (0 == latency) {
+			latency = (stream.latency_timer.value > 0) ? stream.latency_timer.value : 16;
+		}
+		last -= std::min (last, latency * 500'000);
+	}
+
+	/* Bytes can't arrive faster than the line allows after the previous ones */
+	const uint64_t earliest = read_last_byte_ns + (timing.length * timing.byte_ns);
+	if (last < earliest) {
+		last = std::min (earliest, timestamp_ns);
+	}
+
+	timing.last_byte_ns = last;
+	read_last_byte_ns = last;
+	return timing;
+}
+
+void FtdiStreamEntryState::deliver_read (FtdiBufferBlock * const block)
+{
+	const uint32_t packetsize = state->read_packetsize;
+	bool check_status = false;
+
+	if (true == stream.read_modem_status_events) {
+		uint16_t diff, seen;
+		FtdiStreamStatic::modem_status_scan (block->buffer, block->length, packetsize, modem_status, diff, seen);
+		check_status = (false == modem_status_known) || (diff != 0);
+	}
+
+	if (nullptr == stream.read_buffer_callback) {
+		FtdiStreamStatic::deliver_read_data (state, *this, block->buffer, block->length, check_status, true, block->timing);
+		if (true == sinks.empty ()) {
+			return;
+		}
+	}
+	else if (true == check_status) {
+		FtdiStreamStatic::deliver_read_data (state, *this, block->buffer, block->length, true, false, block->timing);
+	}
+
+	block->payload_len = FtdiStreamStatic::compact_read_data (block->buffer, block->length, packetsize);
+	if (0 == block->payload_len) {
+		return;
+	}
+	block->payload = reinterpret_cast<const char *> (block->buffer + 2);
+
+	if (nullptr != stream.read_buffer_callback) {
+		stream.read_buffer_callback (stream_id, FtdiBuffer (block));
+	}
+
+	for (FtdiStreamSinkState &sink : sinks) {
+		#ifdef SHAGA_THREADING
+		if (nullptr != sink.queue) {
+			const size_t limit = (FtdiStreamEntry::SinkOverflow::DROP == sink.overflow) ? sink.queue_depth : 0;
+
+			/* Caller still holds its reference, so this unref never returns the block to the pool */
+			block->ref ();
+			if (false == state->dispatch->push (*sink.queue, block, limit)) {
+				block->unref ();
+				sink.drops.fetch_add (1, std::memory_order_relaxed);
+			}
+			continue;
+		}
+		#endif // SHAGA_THREADING
+
+		sink.callback (stream_id, FtdiBuffer (block));
+	}
+}
+
+void FtdiStreamEntryState::submit_control (void)
+{
+	if (true == control_busy || true == control_queue.empty ()) {
+		return;
+	}
+
+	if (false == state->should_run) {
+		return;
+	}
+
+	const FtdiStreamControlRequest &req = control_queue.front ().requests.at (control_pos);
+
+	::libusb_fill_control_setup (control_buffer, FTDI_DEVICE_OUT_REQTYPE, req.request, req.value, req.index, 0);
+	::libusb_fill_control_transfer (
+		control_transfer, // the transfer to populate
+		stream.ftdi->usb_dev, // handle of the device that will handle the transfer
+		control_buffer, // setup packet, no data stage follows
+		FtdiStreamStatic::control_callback, // callback function to be invoked on transfer completion
+		this, // user data to pass to callback function
+		stream.ftdi->usb_write_timeout // timeout for the transfer in milliseconds
+	);
+
+	if (::libusb_submit_transfer (control_transfer) != LIBUSB_SUCCESS) {
+		cThrow ("@{}: Submit control transfer error"sv, stream_id);
+	}
+
+	control_busy = true;
+}
+
+bool FtdiStreamEntryState::cancel_control (void)
+{
+	if (false == control_busy) {
+		control_queue.clear ();
+		control_pos = 0;
+		return true;
+	}
+
+	::libusb_cancel_transfer (control_transfer);
+	return false;
+}
+
 int FtdiStream::get_poll_fd (void)
 {
 	#ifdef SHAGA_THREADING
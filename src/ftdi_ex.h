@@ -11,6 +11,8 @@
 
 /* This file should be included from ftdi.c right before ftdi_init function. */
 
+static int ftdi_convert_baudrate (int baudrate, struct ftdi_context *ftdi, unsigned short *value, unsigned short *index);
+
 int ftdi_init_ex (struct ftdi_context *ftdi, struct libusb_context *usb_ctx)
 {
 	struct ftdi_eeprom* eeprom = (struct ftdi_eeprom *) malloc (sizeof (struct ftdi_eeprom));
@@ -148,3 +150,33 @@ int ftdi_usb_get_strings_ex (struct ftdi_context *ftdi, struct libusb_device *de
 
 	return 0;
 }
+
+/* Compute the same control request values as ftdi_set_baudrate, but don't send anything to the device. */
+/* Returns baudrate to be stored in ftdi->baudrate after the request succeeds or negative number on error. */
+int ftdi_get_baudrate_request_ex (struct ftdi_context *ftdi, int baudrate, unsigned short *value, unsigned short *index)
+{
+	int actual_baudrate;
+
+	if (ftdi == NULL || ftdi->usb_dev == NULL) {
+		ftdi_error_return (-3, "USB device unavailable");
+	}
+
+	if (ftdi->bitbang_enabled) {
+		baudrate = baudrate * 4;
+	}
+
+	actual_baudrate = ftdi_convert_baudrate (baudrate, ftdi, value, index);
+	if (actual_baudrate <= 0) {
+		ftdi_error_return (-1, "Silly baudrate <= 0.");
+	}
+
+	/* Check within tolerance (about 5%) */
+	if ((actual_baudrate * 2 < baudrate /* Catch overflows */ )
+			|| ((actual_baudrate < baudrate)
+				? (actual_baudrate * 21 < baudrate * 20)
+				: (baudrate * 21 < actual_baudrate * 20))) {
+		ftdi_error_return (-1, "Unsupported baudrate. Note: bitbang baudrates are automatically multiplied by 4");
+	}
+
+	return baudrate;
+}
@@ -17,9 +17,132 @@
 
 #include <sys/epoll.h>
 
+/* CLOCK_MONOTONIC in nanoseconds, same clock as get_monotime_sec */
+static inline uint64_t get_monotime_nsec_ftdi (void) noexcept
+{
+	struct timespec ts;
+	::clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (static_cast<uint64_t> (ts.tv_sec) * 1'000'000'000) + static_cast<uint64_t> (ts.tv_nsec);
+}
+
+/* Run-length and LZ codec of capture blocks */
+/* Tokens: 0x00-0x7f literals (n + 1 bytes follow), 0x80-0xbf run (n + 3 times the following byte), */
+/* 0xc0-0xff match (n + 4 bytes at distance given by following varint). When the low six bits */
+/* are all set, varint with the rest of the length follows the token byte. */
+class FtdiCaptureCodec
+{
+	private:
+		static const constexpr uint_fast32_t hash_bits {14};
+		std::unique_ptr<uint32_t[]> _table;
+
+	public:
+		FtdiCaptureCodec ();
+
+		/* Returns packed length, zero if it wouldn't be shorter than 'len' */
+		/* 'dst' must have room for 'len' bytes */
+		size_t compress (const unsigned char * const src, const size_t len, unsigned char * const dst) noexcept;
+
+		/* Returns false if 'src' is not valid or doesn't unpack to exactly 'raw_len' bytes */
+		static bool decompress (const unsigned char * const src, const size_t len, unsigned char * const dst, const size_t raw_len) noexcept;
+};
+
 /* Multimap from file descriptor to stream state */
 typedef std::multimap<int, FtdiStreamStaticState> FtdiStreamStaticStates_t;
 
+/* Vendor request sent to the device over control endpoint */
+struct FtdiStreamControlRequest
+{
+	uint8_t request {0};
+	uint16_t value {0};
+	uint16_t index {0};
+};
+
+/* Requests of one sequence are sent one after another, 'done' is called after the last one or after the first failure */
+/* If 'done' throws, stream is stopped with an error */
+struct FtdiStreamControlSequence
+{
+	std::vector<FtdiStreamControlRequest> requests;
+	std::function<void(const bool success)> done {nullptr};
+};
+
+class FtdiStreamEntryState;
+class FtdiStreamDispatch;
+class FtdiBufferPool;
+struct FtdiStreamSinkState;
+
+/* Per stream state, indexed by stream_id */
+typedef std::deque<FtdiStreamEntryState> FtdiStreamEntryStates_t;
+
+/* Transfer buffer of a read stream with buffer lending or read dispatch */
+struct FtdiBufferBlock
+{
+	/* References held by FtdiBuffer handles and queued deliveries, zero while owned by transfer or pool */
+	#ifdef SHAGA_THREADING
+	std::atomic<uint_fast32_t> refs {0};
+	#else
+	uint_fast32_t refs {0};
+	#endif // SHAGA_THREADING
+
+	FtdiBufferPool * const pool;
+	unsigned char * const buffer;
+	const uint_fast32_t stream_id;
+
+	/* Received length including modem status bytes */
+	uint32_t length {0};
+
+	/* Completion time and arrival estimate of the payload */
+	FtdiReadTiming timing;
+
+	/* Modem status of the last packet */
+	uint16_t modem_status {0};
+
+	/* Payload without modem status bytes, set by compaction */
+	const char *payload {nullptr};
+	uint32_t payload_len {0};
+
+	explicit FtdiBufferBlock (FtdiBufferPool * const _pool, unsigned char * const _buffer, const uint_fast32_t _stream_id) :
+		pool (_pool), buffer (_buffer), stream_id (_stream_id) {}
+
+	void ref (void) noexcept;
+	void unref (void) noexcept;
+};
+
+/* Fixed set of buffers of one read stream. Pool is owned by FtdiStreamEntryState until close, */
+/* then it deletes itself when the last block lent to the user returns. */
+class FtdiBufferPool
+{
+	private:
+		#ifdef SHAGA_THREADING
+		std::mutex mutex;
+		#endif // SHAGA_THREADING
+
+		/* Notified when block returns to starved pool, nullptr after close */
+		FtdiStreamState * state;
+
+		std::vector<std::unique_ptr<FtdiBufferBlock>> blocks;
+		std::vector<FtdiBufferBlock *> spare;
+		bool starved {false};
+
+		explicit FtdiBufferPool (FtdiStreamState * const _state);
+		~FtdiBufferPool ();
+
+	public:
+		static FtdiBufferPool * create (FtdiStreamState * const state, const uint_fast32_t stream_id, const uint_fast32_t num_blocks, const size_t buffer_size);
+
+		/* Non-copyable */
+		FtdiBufferPool (FtdiBufferPool const&) = delete;
+		FtdiBufferPool& operator= (FtdiBufferPool const&) = delete;
+
+		/* Called from FtdiStream thread. Returns nullptr if all blocks are in use, FtdiStream thread is notified when one returns. */
+		FtdiBufferBlock * take (void);
+
+		/* Called from any thread */
+		void release (FtdiBufferBlock * const block) noexcept;
+
+		/* Called once by the owner, pool is deleted now or when the last block returns */
+		void close (void) noexcept;
+};
+
 class FtdiStreamState
 {
 	private:
@@ -30,6 +153,7 @@ class FtdiStreamState
 		int notice_event_fd {-1};
 
 		std::unique_ptr<FtdiStreamStaticStates_t> streamstates;
+		std::unique_ptr<FtdiStreamEntryStates_t> entrystates;
 
 		int epoll_fd {-1};
 		int usb_epoll_fd {-1};
@@ -47,6 +171,16 @@ class FtdiStreamState
 		/* Number of cancel loops until forced exit */
 		int cancel_counter {3};
 
+		/* Number of streams stopped by read watermark */
+		uint_fast32_t throttled_streams {0};
+
+		/* Number of dispatch threads, used only if some stream has read dispatch */
+		uint_fast32_t dispatch_threads {0};
+
+		#ifdef SHAGA_THREADING
+		std::unique_ptr<FtdiStreamDispatch> dispatch;
+		#endif // SHAGA_THREADING
+
 		/* Is thread started */
 		volatile bool is_started_thr {false};
 
@@ -83,6 +217,9 @@ class FtdiStreamState
 		/* This list used stream_id */
 		std::unordered_set<uint_fast32_t> list_reset;
 
+		/* Control sequences waiting to be queued, first is stream_id */
+		std::vector<std::pair<uint_fast32_t, FtdiStreamControlSequence>> list_control;
+
 		shaga::StringSPSC error_spsc;
 
 	public:
@@ -98,6 +235,8 @@ class FtdiStreamState
 		friend class FtdiStream;
 		friend class FtdiStreamStatic;
 		friend class FtdiStreamStaticState;
+		friend class FtdiStreamEntryState;
+		friend class FtdiReplay;
 };
 
 class FtdiStreamStaticState
@@ -109,10 +248,16 @@ class FtdiStreamStaticState
 		const bool is_modem_status;
 		const int eventfd;
 		FtdiStreamState * const state;
+		FtdiStreamEntryState * const entrystate;
 		struct libusb_transfer * transfer {nullptr};
 
 		int buffer_size {0};
 		volatile bool enabled {false};
+		bool parked {false};
+		bool starved {false};
+
+		/* Block owning transfer buffer, nullptr if buffer isn't from pool or transfer is starved */
+		FtdiBufferBlock * block {nullptr};
 		volatile uint_fast32_t counter_callbacks {0};
 		volatile uint_fast32_t counter_bytes {0};
 
@@ -123,7 +268,8 @@ class FtdiStreamStaticState
 			const bool _is_reading,
 			const bool _is_modem_status,
 			const int _eventfd,
-			FtdiStreamState * const _state);
+			FtdiStreamState * const _state,
+			FtdiStreamEntryState * const _entrystate);
 
 		~FtdiStreamStaticState ();
 
@@ -132,6 +278,403 @@ class FtdiStreamStaticState
 		void cancel (void);
 
 		friend class FtdiStreamStatic;
+		friend class FtdiStreamEntryState;
+};
+
+#ifdef SHAGA_THREADING
+/* Delivers read transfers of streams with read dispatch from a pool of threads. FtdiStream thread hands over */
+/* the filled block and resubmits the transfer with a spare one. Transfers of one stream are delivered in order. */
+class FtdiStreamDispatch
+{
+	public:
+		/* All members are guarded by FtdiStreamDispatch::mutex */
+		struct Queue
+		{
+			FtdiStreamEntryState * const entrystate;
+
+			/* Read sink with its own queue, nullptr for queue of the whole stream */
+			FtdiStreamSinkState * const sink;
+
+			std::deque<FtdiBufferBlock *> jobs;
+
+			/* Queue is waiting in 'ready' or is being delivered, no other thread may take it */
+			bool scheduled {false};
+
+			explicit Queue (FtdiStreamEntryState * const _entrystate, FtdiStreamSinkState * const _sink) : entrystate (_entrystate), sink (_sink) {}
+		};
+
+	private:
+		FtdiStreamState * const state;
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::condition_variable idle_cond;
+		std::deque<Queue> queues;
+		std::deque<Queue *> ready;
+		std::vector<std::thread> threads;
+		std::string error_message;
+		bool stopping {false};
+
+		void worker (void) noexcept;
+
+	public:
+		explicit FtdiStreamDispatch (FtdiStreamState * const _state);
+		~FtdiStreamDispatch ();
+
+		/* Non-copyable */
+		FtdiStreamDispatch (FtdiStreamDispatch const&) = delete;
+		FtdiStreamDispatch& operator= (FtdiStreamDispatch const&) = delete;
+
+		Queue * add_queue (FtdiStreamEntryState * const entrystate, FtdiStreamSinkState * const sink = nullptr);
+
+		void start (const uint_fast32_t num_threads);
+		void stop (void) noexcept;
+
+		/* Queue takes over one reference of the block. If 'limit' is not zero and 'limit' blocks are */
+		/* already waiting, block isn't queued and false is returned. */
+		bool push (Queue &queue, FtdiBufferBlock * const block, const size_t limit = 0);
+
+		/* Wait until all queued blocks are delivered or an error is raised */
+		void drain (void);
+
+		/* Returns error raised in dispatch thread, if any */
+		std::string take_error (void);
+};
+#endif // SHAGA_THREADING
+
+/* Frame reassembly of one stream, see FtdiStreamEntry::set_read_framer */
+class FtdiFramingState
+{
+	private:
+		const std::shared_ptr<FtdiFramer> framer;
+		const std::shared_ptr<FtdiCrcCheck> crc;
+		const size_t max_frame;
+
+		/* Incomplete frame is kept in [start, end), buffer only grows */
+		std::vector<char> buffer;
+		size_t start {0};
+		size_t end {0};
+
+		/* Bytes of incomplete frame already seen by the framer */
+		size_t scanned {0};
+
+		/* Copy of frame for decoding, when it can't be decoded where it is */
+		std::vector<char> scratch;
+
+		void append (const char * const data, const size_t len);
+		void deliver (FtdiStreamEntry &entry, char * frame, size_t len, const bool may_modify);
+
+	public:
+		/* Counted in delivering thread, collected by FtdiStream thread */
+		#ifdef SHAGA_THREADING
+		std::atomic<uint_fast32_t> errors {0};
+		std::atomic<uint_fast32_t> bad_crc {0};
+		#else
+		uint_fast32_t errors {0};
+		uint_fast32_t bad_crc {0};
+		#endif // SHAGA_THREADING
+
+		FtdiFramingState (std::shared_ptr<FtdiFramer> _framer, std::shared_ptr<FtdiCrcCheck> _crc);
+
+		/* Payload of one packet, complete frames are delivered straight from 'data' when nothing is buffered */
+		/* Decoding framer decodes them in place if 'may_modify' is set, otherwise in a copy */
+		void feed (FtdiStreamEntry &entry, char * const data, const size_t len, const bool may_modify);
+
+		void count_error (void) noexcept;
+		uint_fast32_t take_errors (void) noexcept;
+		uint_fast32_t take_bad_crc (void) noexcept;
+};
+
+/* PRBS as bytes, see FtdiLoopbackTest. Byte i is byte (i - lag_short) xor byte (i - lag_long), */
+/* which follows from the bit recurrence, so whole vectors of bytes are generated at once. */
+class FtdiPrbsGenerator
+{
+	public:
+		static const constexpr size_t history {64};
+		static const constexpr size_t chunk {4096};
+
+	private:
+		size_t lag_short {0};
+		size_t lag_long {0};
+
+		/* Once 'pos' reaches 'history', bytes preceding it are always in the buffer */
+		std::vector<unsigned char> buffer;
+		size_t pos {0};
+
+		void refill (void) noexcept;
+
+	public:
+		explicit FtdiPrbsGenerator (const FtdiLoopbackTest::Pattern pattern);
+
+		/* Continue after 'history' bytes of the sequence */
+		void seed (const unsigned char * const window) noexcept;
+
+		/* Returns next bytes of the sequence, 'len' is shortened to the number of bytes available */
+		const unsigned char * take (size_t &len) noexcept;
+};
+
+/* State of FtdiLoopbackTest, callbacks hold it by shared pointer */
+class FtdiLoopbackState
+{
+	private:
+		struct Marker
+		{
+			uint64_t offset;
+			uint64_t timestamp_ns;
+		};
+
+		static const constexpr size_t window {FtdiPrbsGenerator::history};
+		static const constexpr size_t max_markers {256};
+
+		FtdiPrbsGenerator tx;
+		FtdiPrbsGenerator rx;
+		const size_t max_slip;
+
+		/* Never signalled, write transfers are always full */
+		int write_fd {-1};
+		int read_fd {-1};
+
+		/* Sequence offset of the next byte to send */
+		uint64_t tx_offset {0};
+
+		bool in_sync {false};
+		bool was_in_sync {false};
+
+		/* Seeded from bytes not found in the sequence, first window must be clean */
+		bool probation {false};
+
+		/* Offsets are lost after unrecoverable slip, latency is not measured then */
+		bool offset_known {true};
+
+		/* Sequence offset of the next expected byte */
+		uint64_t rx_offset {0};
+
+		unsigned char sync[window];
+		size_t sync_len {0};
+		size_t window_bytes {0};
+		uint_fast64_t window_bits {0};
+
+		/* Errors of the previous window, slip at its end shows only in the next one */
+		uint_fast64_t previous_bits {0};
+		bool previous_valid {false};
+
+		std::vector<unsigned char> scratch;
+
+		FtdiReadTiming timing;
+		size_t timing_index {0};
+
+		#ifdef SHAGA_THREADING
+		/* Write callbacks run in FtdiStream thread, read callbacks possibly in dispatch thread */
+		mutable std::mutex mutex;
+		#endif // SHAGA_THREADING
+
+		FtdiLoopbackTest::Results results;
+		std::deque<Marker> markers;
+
+		void resync (void);
+		void check (const unsigned char *data, size_t len);
+		void take_markers (const uint64_t offset, const size_t len, const size_t index);
+
+	public:
+		FtdiLoopbackState (const FtdiLoopbackTest::Pattern pattern, const size_t _max_slip);
+		~FtdiLoopbackState ();
+
+		int write_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len);
+		int read_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len);
+
+		FtdiLoopbackTest::Results get_results (void) const;
+		void reset_results (void);
+};
+
+/* State of FtdiLatencyProbe, callbacks hold it by shared pointer */
+class FtdiLatencyProbeState
+{
+	private:
+		/* Periodic timer returned as WRITE_GET_FD */
+		int timer_fd {-1};
+		int read_fd {-1};
+
+		uint16_t tx_sequence {0};
+
+		/* Marker being received, it may span more read callbacks */
+		unsigned char marker[FtdiLatencyProbe::marker_size];
+		size_t marker_len {0};
+		uint64_t marker_arrival_ns {0};
+
+		/* Received bytes before the marker and before the current read transfer */
+		uint64_t marker_start {0};
+		uint64_t transfer_start {0};
+		uint64_t received_bytes {0};
+
+		bool rx_started {false};
+		uint16_t rx_sequence {0};
+
+		FtdiReadTiming timing;
+
+		#ifdef SHAGA_THREADING
+		mutable std::mutex mutex;
+		#endif // SHAGA_THREADING
+
+		FtdiLatencyProbe::Results results;
+
+		void parse (const char * const data, const size_t len);
+		void complete (void);
+
+	public:
+		FtdiLatencyProbeState (const uint_fast32_t interval_ms, const uint64_t bucket_ns, const size_t buckets);
+		~FtdiLatencyProbeState ();
+
+		int write_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len);
+		int read_callback (const FtdiStreamEntry::CallbackType type, char * const buffer, const int len);
+
+		FtdiLatencyProbe::Results get_results (void) const;
+		void reset_results (void);
+};
+
+/* Frame encoding of one write stream, see FtdiStreamEntry::set_write_encoder */
+class FtdiEncodingState
+{
+	private:
+		const std::shared_ptr<FtdiEncoder> encoder;
+
+		/* Frame taken by WRITE_FILL_FRAME */
+		std::vector<char> frame;
+
+		/* Encoded bytes that didn't fit into the previous write transfer */
+		std::vector<char> pending;
+		size_t pending_pos {0};
+		size_t pending_len {0};
+
+	public:
+		explicit FtdiEncodingState (std::shared_ptr<FtdiEncoder> _encoder);
+
+		/* Returns length of encoded data in 'buffer', or negative error of WRITE_FILL_FRAME */
+		int fill (FtdiStreamEntry &entry, char * const buffer, const int len);
+};
+
+/* Read sink of one stream, see FtdiStreamEntry::add_read_sink */
+struct FtdiStreamSinkState
+{
+	FtdiStreamEntry::BufferCallback callback;
+	const uint_fast32_t queue_depth;
+	const FtdiStreamEntry::SinkOverflow overflow;
+
+	#ifdef SHAGA_THREADING
+	/* Own queue, nullptr if sink is called from the thread delivering the stream */
+	FtdiStreamDispatch::Queue * queue {nullptr};
+	std::atomic<uint_fast32_t> drops {0};
+	#endif // SHAGA_THREADING
+
+	explicit FtdiStreamSinkState (FtdiStreamEntry::BufferCallback _callback, const uint_fast32_t _queue_depth, const FtdiStreamEntry::SinkOverflow _overflow) :
+		callback (_callback), queue_depth (_queue_depth), overflow (_overflow) {}
+};
+
+class FtdiStreamEntryState
+{
+	private:
+		const uint_fast32_t stream_id;
+		FtdiStreamEntry &stream;
+		FtdiStreamState * const state;
+		struct libusb_transfer * control_transfer {nullptr};
+		unsigned char control_buffer[LIBUSB_CONTROL_SETUP_SIZE];
+
+		std::deque<FtdiStreamControlSequence> control_queue;
+		size_t control_pos {0};
+		bool control_busy {false};
+
+		/* Latency timer auto-tune, current value is zero until known */
+		uint8_t latency_current {0};
+		bool latency_pending {false};
+		uint_fast32_t latency_completions {0};
+		uint_fast32_t latency_full_completions {0};
+		uint_fast64_t latency_payload {0};
+
+		/* Read transfers of this stream, parked ones are not submitted while idle */
+		std::vector<FtdiStreamStaticState *> read_states;
+		size_t parked_reads {0};
+
+		/* Idle mode, entered after read_idle_threshold consecutive status-only completions */
+		bool idle {false};
+		uint_fast32_t idle_completions {0};
+
+		/* Consumer crossed high watermark, read transfers are parked */
+		bool throttled {false};
+
+		/* Buffers of read transfers, nullptr if transfers keep their own buffers (no lending, no dispatch) */
+		FtdiBufferPool * pool {nullptr};
+
+		#ifdef SHAGA_THREADING
+		/* Queue of dispatch threads, nullptr if reads are delivered from FtdiStream thread */
+		FtdiStreamDispatch::Queue * dispatch_queue {nullptr};
+		#endif // SHAGA_THREADING
+
+		/* Read transfers without buffer, waiting for a block to return to the pool */
+		size_t starved_reads {0};
+
+		std::deque<FtdiStreamSinkState> sinks;
+
+		/* Frame reassembly, nullptr without read framer */
+		std::unique_ptr<FtdiFramingState> framing;
+
+		/* Frame encoding, nullptr without write encoder */
+		std::unique_ptr<FtdiEncodingState> encoding;
+
+		/* Counted since the last statistics callback */
+		FtdiStreamEntry::Statistics statistics;
+
+		/* Modem status reported by the last MODEM_STATUS_CHANGED */
+		bool modem_status_known {false};
+		uint16_t modem_status {0};
+
+		/* Estimated arrival of the last payload byte so far */
+		uint64_t read_last_byte_ns {0};
+
+	public:
+		explicit FtdiStreamEntryState (
+			const uint_fast32_t _stream_id,
+			FtdiStreamEntry &_stream,
+			FtdiStreamState * const _state);
+
+		~FtdiStreamEntryState ();
+
+		/* Non-copyable */
+		FtdiStreamEntryState (FtdiStreamEntryState const&) = delete;
+		FtdiStreamEntryState& operator= (FtdiStreamEntryState const&) = delete;
+
+		void queue_control (FtdiStreamControlSequence &&sequence);
+		void queue_reset (void);
+		void queue_latency_timer (const uint8_t latency);
+		void submit_control (void);
+
+		/* Returns true if read transfer was parked instead of being resubmitted */
+		bool park_read (FtdiStreamStaticState * const streamstate, const size_t keep_in_flight);
+		void unpark_reads (void);
+		void leave_idle (void);
+
+		/* Give spare buffer to read transfer. Returns false and marks transfer as starved if there is none. */
+		bool refill_read (FtdiStreamStaticState * const streamstate);
+		void feed_starved (void);
+
+		/* Create buffer pool, dispatch queue and read sinks according to FtdiStreamEntry */
+		/* Pool is created only if it is needed or 'force_pool' is true */
+		void init_delivery (const bool force_pool);
+
+		/* Arrival estimate of transfer completed at 'timestamp_ns' with 'length' bytes including modem status */
+		FtdiReadTiming estimate_read_timing (const uint64_t timestamp_ns, const uint32_t length) noexcept;
+
+		/* WRITE_FILL_BUFFER, or encoded frames if write encoder is set */
+		int fill_write (char * const buffer, const int len);
+
+		/* Call user callbacks for one read transfer from pool, from FtdiStream or dispatch thread */
+		void deliver_read (FtdiBufferBlock * const block);
+
+		/* Returns true if there is no control transfer in flight */
+		bool cancel_control (void);
+
+		friend class FtdiStreamStatic;
+		friend class FtdiStreamStaticState;
+		friend class FtdiStreamDispatch;
+		friend class FtdiReplay;
 };
 
 #endif // _HEAD_SGFTDI_internal
@@ -0,0 +1,99 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#ifndef _HEAD_SGFTDI_scan
+#define _HEAD_SGFTDI_scan
+
+#ifndef SGFTDI
+	#error You must include sgftdi*.h
+#endif // SGFTDI
+
+#if defined (__AVX2__) || defined (__SSE2__)
+	#include <immintrin.h>
+#endif // __AVX2__ || __SSE2__
+
+/* Returns pointer to the first 'val' in 'data', nullptr if there is none */
+/* Packets are short, so there is no alignment prologue, unaligned loads are cheap enough */
+static inline const char * ftdi_find_byte (const char * const data, const size_t len, const char val) noexcept
+{
+	size_t i = 0;
+
+	#ifdef __AVX2__
+	const __m256i needle32 = _mm256_set1_epi8 (val);
+	for (; (i + 32) <= len; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (data + i));
+		const uint32_t mask = static_cast<uint32_t> (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (chunk, needle32)));
+		if (mask != 0) {
+			return data + i + __builtin_ctz (mask);
+		}
+	}
+	#endif // __AVX2__
+
+	#ifdef __SSE2__
+	const __m128i needle16 = _mm_set1_epi8 (val);
+	for (; (i + 16) <= len; i += 16) {
+		const __m128i chunk = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + i));
+		const uint32_t mask = static_cast<uint32_t> (_mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, needle16)));
+		if (mask != 0) {
+			return data + i + __builtin_ctz (mask);
+		}
+	}
+	#endif // __SSE2__
+
+	for (; i < len; ++i) {
+		if (data[i] == val) {
+			return data + i;
+		}
+	}
+
+	return nullptr;
+}
+
+/* Returns pointer to the first 'val1' or 'val2' in 'data', nullptr if there is none */
+static inline const char * ftdi_find_byte2 (const char * const data, const size_t len, const char val1, const char val2) noexcept
+{
+	size_t i = 0;
+
+	#ifdef __AVX2__
+	const __m256i needle1_32 = _mm256_set1_epi8 (val1);
+	const __m256i needle2_32 = _mm256_set1_epi8 (val2);
+	for (; (i + 32) <= len; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (data + i));
+		const __m256i eq = _mm256_or_si256 (_mm256_cmpeq_epi8 (chunk, needle1_32), _mm256_cmpeq_epi8 (chunk, needle2_32));
+		const uint32_t mask = static_cast<uint32_t> (_mm256_movemask_epi8 (eq));
+		if (mask != 0) {
+			return data + i + __builtin_ctz (mask);
+		}
+	}
+	#endif // __AVX2__
+
+	#ifdef __SSE2__
+	const __m128i needle1_16 = _mm_set1_epi8 (val1);
+	const __m128i needle2_16 = _mm_set1_epi8 (val2);
+	for (; (i + 16) <= len; i += 16) {
+		const __m128i chunk = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (data + i));
+		const __m128i eq = _mm_or_si128 (_mm_cmpeq_epi8 (chunk, needle1_16), _mm_cmpeq_epi8 (chunk, needle2_16));
+		const uint32_t mask = static_cast<uint32_t> (_mm_movemask_epi8 (eq));
+		if (mask != 0) {
+			return data + i + __builtin_ctz (mask);
+		}
+	}
+	#endif // __SSE2__
+
+	for (; i < len; ++i) {
+		if (data[i] == val1 || data[i] == val2) {
+			return data + i;
+		}
+	}
+
+	return nullptr;
+}
+
+#endif // _HEAD_SGFTDI_scan
@@ -0,0 +1,431 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "fakeusb.h"
+
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+using namespace shaga;
+using namespace std::literals;
+
+/* Every test writes its capture into a new temporary directory */
+class Capture : public FakeUsbTest
+{
+	protected:
+		std::string dir;
+		std::string prefix;
+
+		/* Smallest segment the recorder accepts */
+		static const constexpr size_t small_segment {sizeof (FtdiCaptureSegmentHeader) + 4096};
+
+		void SetUp (void) override
+		{
+			FakeUsbTest::SetUp ();
+
+			char tmpl[] = "/tmp/sgftdi_test.XXXXXX";
+			ASSERT_NE (::mkdtemp (tmpl), nullptr);
+			dir = tmpl;
+			prefix = dir + "/cap";
+		}
+
+		void TearDown (void) override
+		{
+			for (const std::string &name : list_files ()) {
+				::unlink ((dir + "/" + name).c_str ());
+			}
+			::rmdir (dir.c_str ());
+
+			FakeUsbTest::TearDown ();
+		}
+
+		std::vector<std::string> list_files (void) const
+		{
+			std::vector<std::string> out;
+			DIR * const d = ::opendir (dir.c_str ());
+			if (nullptr == d) {
+				return out;
+			}
+			while (const struct dirent * const ent = ::readdir (d)) {
+				if (ent->d_name[0] != '.') {
+					out.push_back (ent->d_name);
+				}
+			}
+			::closedir (d);
+			std::sort (out.begin (), out.end ());
+			return out;
+		}
+
+		static std::string read_file (const std::string &path)
+		{
+			std::ifstream file (path, std::ios::binary);
+			return std::string (std::istreambuf_iterator<char> (file), std::istreambuf_iterator<char> ());
+		}
+
+		/* Payload of record 'i' of generated captures */
+		static std::string payload_of (const size_t i)
+		{
+			return std::string (1 + (i % 90), static_cast<char> ('a' + (i % 26)));
+		}
+};
+
+TEST_F (Capture, SegmentLayout)
+{
+	const size_t count = 200;
+	{
+		FtdiCapture capture (prefix, small_segment);
+		for (size_t i = 0; i < count; ++i) {
+			const std::string payload = payload_of (i);
+			capture.record (i % 3, 1'000 + i, static_cast<uint16_t> (0x6000 + i), payload.data (), payload.size ());
+		}
+		EXPECT_EQ (capture.get_records (), count);
+		capture.close ();
+	}
+
+	/* Closed segments are complete, records follow each other in order */
+	size_t index = 0;
+	uint64_t segment = 0;
+	for (; index < count; ++segment) {
+		const std::string data = read_file (FtdiCapture::get_segment_path (prefix, segment));
+		ASSERT_GE (data.size (), sizeof (FtdiCaptureSegmentHeader));
+		ASSERT_LE (data.size (), small_segment);
+
+		FtdiCaptureSegmentHeader header;
+		::memcpy (&header, data.data (), sizeof (header));
+		EXPECT_EQ (::memcmp (header.magic, FtdiCaptureSegmentHeader::magic_value, sizeof (header.magic)), 0);
+		EXPECT_EQ (header.version, FtdiCaptureSegmentHeader::version_value);
+		EXPECT_EQ (header.segment_index, segment);
+		EXPECT_EQ (header.data_size + sizeof (header), data.size ());
+		ASSERT_GT (header.record_count, 0U);
+
+		size_t pos = sizeof (header);
+		for (uint64_t r = 0; r < header.record_count; ++r, ++index) {
+			FtdiCaptureRecordHeader rec;
+			ASSERT_LE (pos + sizeof (rec), data.size ());
+			::memcpy (&rec, data.data () + pos, sizeof (rec));
+
+			const std::string payload = payload_of (index);
+			EXPECT_EQ (rec.size % FtdiCapture::record_alignment, 0U);
+			EXPECT_EQ (rec.payload_len, payload.size ());
+			EXPECT_EQ (rec.timestamp_ns, 1'000 + index);
+			EXPECT_EQ (rec.stream_id, index % 3);
+			EXPECT_EQ (rec.modem_status, 0x6000 + index);
+			EXPECT_EQ (data.substr (pos + sizeof (rec), rec.payload_len), payload);
+			pos += rec.size;
+		}
+		EXPECT_EQ (pos, data.size ());
+	}
+
+	EXPECT_EQ (index, count);
+	EXPECT_GT (segment, 2U);
+	EXPECT_TRUE (read_file (FtdiCapture::get_segment_path (prefix, segment)).empty ());
+}
+
+TEST_F (Capture, InvalidParameters)
+{
+	EXPECT_THROW (FtdiCapture (""sv), std::exception);
+	EXPECT_THROW (FtdiCapture (prefix, small_segment - 8), std::exception);
+	EXPECT_THROW (FtdiCapture (prefix, small_segment + 1), std::exception);
+
+	FtdiCapture capture (prefix, small_segment);
+	const std::string big (small_segment, 'x');
+	EXPECT_THROW (capture.record (0, 1, 0, big.data (), big.size ()), std::exception);
+}
+
+TEST_F (Capture, RecordsStreamAsSink)
+{
+	Reader reader;
+	FtdiCapture capture (prefix, small_segment);
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().add_read_sink (capture.get_sink ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	FakeUsb::receive ("abc"sv, 0x6011);
+	FakeUsb::receive ("defg"sv, 0x6001);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "abcdefg"; }));
+	stream.stop_poll ();
+
+	EXPECT_EQ (capture.get_records (), 2U);
+	EXPECT_EQ (capture.get_bytes (), 7U);
+	capture.close ();
+
+	const std::string data = read_file (FtdiCapture::get_segment_path (prefix, 0));
+	FtdiCaptureRecordHeader rec;
+	ASSERT_GE (data.size (), sizeof (FtdiCaptureSegmentHeader) + sizeof (rec));
+	::memcpy (&rec, data.data () + sizeof (FtdiCaptureSegmentHeader), sizeof (rec));
+	EXPECT_EQ (rec.stream_id, 0U);
+	EXPECT_EQ (rec.modem_status, 0x6011);
+	EXPECT_GT (rec.timestamp_ns, 0U);
+	EXPECT_EQ (data.substr (sizeof (FtdiCaptureSegmentHeader) + sizeof (rec), rec.payload_len), "abc");
+}
+
+TEST_F (Capture, ReaderReturnsRecordsInOrder)
+{
+	const size_t count = 200;
+	{
+		FtdiCapture capture (prefix, small_segment);
+		for (size_t i = 0; i < count; ++i) {
+			const std::string payload = payload_of (i);
+			capture.record (i % 3, 1'000 + i, static_cast<uint16_t> (0x6000 + i), payload.data (), payload.size ());
+		}
+		capture.close ();
+	}
+
+	FtdiCaptureReader reader (prefix);
+	FtdiCaptureReader::Record record;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		size_t index = 0;
+		while (true == reader.next (record)) {
+			ASSERT_LT (index, count);
+			EXPECT_EQ (record.stream_id, index % 3);
+			EXPECT_EQ (record.timestamp_ns, 1'000 + index);
+			EXPECT_EQ (record.modem_status, 0x6000 + index);
+			EXPECT_EQ (std::string (record.data, record.len), payload_of (index));
+			++index;
+		}
+		EXPECT_EQ (index, count);
+		EXPECT_FALSE (reader.next (record));
+
+		reader.rewind ();
+	}
+}
+
+TEST_F (Capture, ReaderStopsAtEndOfUnfinishedSegment)
+{
+	FtdiCapture capture (prefix, small_segment);
+	capture.record (0, 10, 0, "abc", 3);
+	capture.record (1, 20, 0, "", 0);
+
+	/* Segment is still being written, end of data is the first empty record */
+	FtdiCaptureReader reader (prefix);
+	FtdiCaptureReader::Record record;
+
+	ASSERT_TRUE (reader.next (record));
+	EXPECT_EQ (std::string (record.data, record.len), "abc");
+	ASSERT_TRUE (reader.next (record));
+	EXPECT_EQ (record.stream_id, 1U);
+	EXPECT_EQ (record.len, 0U);
+	EXPECT_FALSE (reader.next (record));
+}
+
+TEST_F (Capture, ReplayDeliversThroughStreamEntry)
+{
+	const std::string long_payload (200, 'x');
+	{
+		FtdiCapture capture (prefix, small_segment);
+		capture.record (0, 1'000, 0x6001, "hello", 5);
+		capture.record (1, 1'100, 0x6001, "other", 5);
+		capture.record (0, 1'200, 0x6011, long_payload.data (), long_payload.size ());
+		capture.record (0, 1'300, 0x6031, "", 0);
+		capture.close ();
+	}
+
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_modem_status_events (true);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiReplay replay (streams);
+	replay.set_speed (FtdiReplay::Speed::ASAP);
+
+	/* Record of stream 1 is skipped, long record is split into transfers of one packet */
+	FtdiCaptureReader capture_reader (prefix);
+	EXPECT_EQ (replay.run (capture_reader), 3U);
+
+	EXPECT_EQ (reader.payload, "hello" + long_payload);
+	const std::vector<std::string> expected {"S6001", "Dhello", "S6011",
+		"D" + long_payload.substr (0, 62), "D" + long_payload.substr (62, 62), "D" + long_payload.substr (124, 62), "D" + long_payload.substr (186), "S6031"};
+	EXPECT_EQ (reader.events, expected);
+}
+
+TEST_F (Capture, ReplayRejectsInvalidSpeed)
+{
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+
+	FtdiReplay replay (streams);
+	EXPECT_THROW (replay.set_speed (FtdiReplay::Speed::SCALED, 0.0), std::exception);
+	EXPECT_NO_THROW (replay.set_speed (FtdiReplay::Speed::SCALED, 10.0));
+}
+
+/* Several index intervals in every segment */
+static const constexpr size_t small_interval {4096};
+
+/* Two captures of the same records, one with index files and one indexed by the reader */
+class CaptureIndex : public Capture, public ::testing::WithParamInterface<size_t>
+{
+	protected:
+		static const constexpr size_t count {2'000};
+		static const constexpr size_t segment_size {sizeof (FtdiCaptureSegmentHeader) + 64 * 1024};
+
+		/* 40 bytes of payload make every record 64 bytes long */
+		static uint64_t timestamp_of (const size_t i)
+		{
+			return 1'000'000 + i * 1'000;
+		}
+
+		void write (void)
+		{
+			FtdiCapture capture (prefix, segment_size, GetParam ());
+			for (size_t i = 0; i < count; ++i) {
+				const std::string payload (40, static_cast<char> ('a' + (i % 26)));
+				capture.record (i % 2, timestamp_of (i), 0, payload.data (), payload.size ());
+			}
+			capture.close ();
+		}
+};
+
+TEST_P (CaptureIndex, Seek)
+{
+	write ();
+	EXPECT_EQ (0 == GetParam (), read_file (FtdiCapture::get_index_path (prefix, 0)).empty ());
+
+	FtdiCaptureReader reader (prefix);
+	FtdiCaptureReader::Record record;
+
+	for (const size_t i : {1'234UL, 0UL, 1'999UL, 1'100UL, 64UL}) {
+		ASSERT_TRUE (reader.seek (timestamp_of (i) - 1));
+		ASSERT_TRUE (reader.next (record));
+		EXPECT_EQ (record.timestamp_ns, timestamp_of (i));
+		if (i + 1 < count) {
+			ASSERT_TRUE (reader.next (record));
+			EXPECT_EQ (record.timestamp_ns, timestamp_of (i + 1));
+		}
+	}
+
+	EXPECT_TRUE (reader.seek (0));
+	ASSERT_TRUE (reader.next (record));
+	EXPECT_EQ (record.timestamp_ns, timestamp_of (0));
+
+	EXPECT_FALSE (reader.seek (timestamp_of (count)));
+	EXPECT_FALSE (reader.next (record));
+}
+
+TEST_P (CaptureIndex, Find)
+{
+	write ();
+
+	FtdiCaptureReader reader (prefix);
+	std::vector<uint64_t> found;
+	const auto collect = [&](const FtdiCaptureReader::Record &record) -> void {
+		found.push_back (record.timestamp_ns);
+	};
+
+	EXPECT_EQ (reader.find (FtdiCaptureReader::all_streams, timestamp_of (100), timestamp_of (1'500), collect), 1'401U);
+	ASSERT_EQ (found.size (), 1'401U);
+	for (size_t i = 0; i < found.size (); ++i) {
+		EXPECT_EQ (found[i], timestamp_of (100 + i));
+	}
+
+	found.clear ();
+	EXPECT_EQ (reader.find (1, timestamp_of (100), timestamp_of (1'500) + 1, collect), 700U);
+	ASSERT_EQ (found.size (), 700U);
+	EXPECT_EQ (found.front (), timestamp_of (101));
+	EXPECT_EQ (found.back (), timestamp_of (1'499));
+
+	found.clear ();
+	EXPECT_EQ (reader.find (FtdiCaptureReader::all_streams, timestamp_of (count), UINT64_MAX, collect), 0U);
+	EXPECT_EQ (reader.find (5, 0, UINT64_MAX, collect), 0U);
+	EXPECT_TRUE (found.empty ());
+}
+
+INSTANTIATE_TEST_SUITE_P (Capture, CaptureIndex, ::testing::Values (0, small_interval));
+
+TEST_F (Capture, FindOutOfOrderStreams)
+{
+	/* Stream 1 is stamped late, its records are 5 ms older than their neighbours */
+	std::vector<uint64_t> stamps;
+	{
+		FtdiCapture capture (prefix, sizeof (FtdiCaptureSegmentHeader) + 16 * 1024, small_interval);
+		for (size_t i = 0; i < 1'000; ++i) {
+			const uint64_t ts = 10'000'000 + i * 1'000 - ((i % 2) ? 5'000 : 0);
+			stamps.push_back (ts);
+			capture.record (i % 2, ts, 0, "0123456789abcdef0123456789abcdef", 32);
+		}
+		capture.close ();
+	}
+
+	FtdiCaptureReader reader (prefix);
+	for (const auto &[from, to] : std::vector<std::pair<uint64_t, uint64_t>> {{10'100'000, 10'200'000}, {10'000'000, 10'000'000}, {10'494'000, 10'700'500}, {0, 9'999'999}}) {
+		std::vector<uint64_t> expected;
+		for (const uint64_t ts : stamps) {
+			if (ts >= from && ts <= to) {
+				expected.push_back (ts);
+			}
+		}
+
+		std::vector<uint64_t> found;
+		reader.find (FtdiCaptureReader::all_streams, from, to, [&](const FtdiCaptureReader::Record &record) -> void {
+			found.push_back (record.timestamp_ns);
+		});
+		EXPECT_EQ (found, expected) << from << " " << to;
+	}
+}
+
+TEST_F (Capture, CompressedRoundTrip)
+{
+	const size_t count = 20'000;
+	size_t raw = 0;
+	{
+		FtdiCapture capture (prefix, 1024 * 1024, small_interval);
+		capture.set_compression (true);
+		for (size_t i = 0; i < count; ++i) {
+			const std::string payload = payload_of (i);
+			raw += sizeof (FtdiCaptureRecordHeader) + payload.size ();
+			capture.record (i % 2, 1'000 + i, 0x6001, payload.data (), payload.size ());
+		}
+		EXPECT_THROW (capture.set_compression (false), std::exception);
+		capture.close ();
+	}
+
+	size_t stored = 0;
+	for (const std::string &name : list_files ()) {
+		if (name.find (".sgcap") != std::string::npos) {
+			stored += read_file (dir + "/" + name).size ();
+		}
+	}
+	EXPECT_LT (stored * 4, raw);
+
+	FtdiCaptureReader reader (prefix);
+	FtdiCaptureReader::Record record;
+	size_t index = 0;
+	while (true == reader.next (record)) {
+		ASSERT_LT (index, count);
+		EXPECT_EQ (record.timestamp_ns, 1'000 + index);
+		EXPECT_EQ (record.stream_id, index % 2);
+		EXPECT_EQ (std::string (record.data, record.len), payload_of (index));
+		++index;
+	}
+	EXPECT_EQ (index, count);
+
+	ASSERT_TRUE (reader.seek (1'000 + 12'345));
+	ASSERT_TRUE (reader.next (record));
+	EXPECT_EQ (record.timestamp_ns, 1'000 + 12'345U);
+
+	std::vector<uint64_t> found;
+	EXPECT_EQ (reader.find (1, 1'000 + 15'000, 1'000 + 15'099, [&](const FtdiCaptureReader::Record &rec) -> void {
+		EXPECT_EQ (std::string (rec.data, rec.len), payload_of (rec.timestamp_ns - 1'000));
+		found.push_back (rec.timestamp_ns);
+	}), 50U);
+	ASSERT_EQ (found.size (), 50U);
+	EXPECT_EQ (found.front (), 1'000 + 15'001U);
+}
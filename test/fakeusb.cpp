@@ -0,0 +1,420 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "fakeusb.h"
+
+#include <mutex>
+#include <deque>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct FakePacket
+{
+	uint16_t status {FakeUsb::default_status};
+	std::string payload;
+};
+
+/* Fake device, shared by the libusb functions below */
+static std::mutex _mutex;
+static int _usb_fd {-1};
+static char _usb_ctx;
+static char _usb_dev;
+static std::deque<struct libusb_transfer *> _reads;
+static std::deque<struct libusb_transfer *> _writes;
+static std::deque<struct libusb_transfer *> _controls;
+static std::vector<struct libusb_transfer *> _cancelled;
+static std::deque<std::deque<FakePacket>> _receive;
+
+bool FakeUsb::fail_controls {false};
+bool FakeUsb::hold_controls {false};
+std::vector<FakeUsb::Control> FakeUsb::controls;
+std::string FakeUsb::written;
+size_t FakeUsb::read_submits {0};
+
+static void fake_signal (void)
+{
+	const uint64_t val = 1;
+	if (::write (_usb_fd, &val, sizeof (val)) < 0) {
+		ADD_FAILURE () << "Unable to signal fake usb fd";
+	}
+}
+
+/* Must hold _mutex */
+static bool fake_has_work (void)
+{
+	return (false == _cancelled.empty ())
+		|| (false == _controls.empty () && false == FakeUsb::hold_controls)
+		|| (false == _writes.empty ())
+		|| (false == _reads.empty () && false == _receive.empty ());
+}
+
+static bool fake_take (std::deque<struct libusb_transfer *> &queue, struct libusb_transfer * const transfer)
+{
+	auto iter = std::find (queue.begin (), queue.end (), transfer);
+	if (queue.end () == iter) {
+		return false;
+	}
+	queue.erase (iter);
+	return true;
+}
+
+static void fake_fill_read (struct libusb_transfer * const transfer)
+{
+	std::deque<FakePacket> &packets = _receive.front ();
+	int pos = 0;
+
+	while (false == packets.empty () && pos + FakeUsb::packet_size <= transfer->length) {
+		const FakePacket &packet = packets.front ();
+		transfer->buffer[pos++] = static_cast<unsigned char> (packet.status & 0xff);
+		transfer->buffer[pos++] = static_cast<unsigned char> (packet.status >> 8);
+		::memcpy (transfer->buffer + pos, packet.payload.data (), packet.payload.size ());
+		pos += static_cast<int> (packet.payload.size ());
+		packets.pop_front ();
+
+		if (pos % FakeUsb::packet_size != 0) {
+			/* Short packet ends the transfer */
+			break;
+		}
+	}
+
+	if (packets.empty ()) {
+		_receive.pop_front ();
+	}
+
+	transfer->actual_length = pos;
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* Complete everything that can be completed now, callbacks are called without the lock */
+static void fake_process (void)
+{
+	std::vector<struct libusb_transfer *> done;
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+
+		uint64_t val;
+		if (::read (_usb_fd, &val, sizeof (val)) < 0) { /* Intentionally ignored */ }
+
+		for (struct libusb_transfer *transfer : _cancelled) {
+			transfer->status = LIBUSB_TRANSFER_CANCELLED;
+			transfer->actual_length = 0;
+			done.push_back (transfer);
+		}
+		_cancelled.clear ();
+
+		while (false == _controls.empty () && false == FakeUsb::hold_controls) {
+			struct libusb_transfer *transfer = _controls.front ();
+			_controls.pop_front ();
+
+			const struct libusb_control_setup *setup = libusb_control_transfer_get_setup (transfer);
+			FakeUsb::controls.push_back ({setup->bRequest, setup->wValue, setup->wIndex, true});
+
+			transfer->status = (true == FakeUsb::fail_controls) ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+			transfer->actual_length = 0;
+			done.push_back (transfer);
+		}
+
+		while (false == _writes.empty ()) {
+			struct libusb_transfer *transfer = _writes.front ();
+			_writes.pop_front ();
+
+			FakeUsb::written.append (reinterpret_cast<const char *> (transfer->buffer), transfer->length);
+			transfer->status = LIBUSB_TRANSFER_COMPLETED;
+			transfer->actual_length = transfer->length;
+			done.push_back (transfer);
+		}
+
+		while (false == _reads.empty () && false == _receive.empty ()) {
+			struct libusb_transfer *transfer = _reads.front ();
+			_reads.pop_front ();
+
+			fake_fill_read (transfer);
+			done.push_back (transfer);
+		}
+	}
+
+	for (struct libusb_transfer *transfer : done) {
+		transfer->callback (transfer);
+	}
+
+	std::lock_guard<std::mutex> lock (_mutex);
+	if (true == fake_has_work ()) {
+		fake_signal ();
+	}
+}
+
+void FakeUsb::reset (void)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	if (_usb_fd < 0) {
+		_usb_fd = ::eventfd (0, EFD_NONBLOCK);
+	}
+	else {
+		uint64_t val;
+		if (::read (_usb_fd, &val, sizeof (val)) < 0) { /* Intentionally ignored */ }
+	}
+
+	EXPECT_TRUE (_reads.empty ()) << "Read transfers left in flight by previous test";
+	EXPECT_TRUE (_writes.empty ()) << "Write transfers left in flight by previous test";
+	EXPECT_TRUE (_controls.empty ()) << "Control transfers left in flight by previous test";
+
+	_reads.clear ();
+	_writes.clear ();
+	_controls.clear ();
+	_cancelled.clear ();
+	_receive.clear ();
+
+	fail_controls = false;
+	hold_controls = false;
+	controls.clear ();
+	written.clear ();
+	read_submits = 0;
+}
+
+struct libusb_context * FakeUsb::get_usb_context (void)
+{
+	return reinterpret_cast<struct libusb_context *> (&_usb_ctx);
+}
+
+struct ftdi_context * FakeUsb::create_context (const int baudrate)
+{
+	struct ftdi_context *ftdi = ::ftdi_new_ex (get_usb_context ());
+	if (nullptr == ftdi) {
+		throw std::runtime_error ("Unable to create ftdi context");
+	}
+
+	ftdi->usb_dev = reinterpret_cast<struct libusb_device_handle *> (&_usb_dev);
+	ftdi->type = TYPE_R;
+	ftdi->max_packet_size = packet_size;
+	ftdi->baudrate = baudrate;
+	return ftdi;
+}
+
+void FakeUsb::free_context (struct ftdi_context * const ftdi)
+{
+	if (nullptr != ftdi) {
+		/* Device was never opened */
+		ftdi->usb_dev = nullptr;
+		::ftdi_free_ex (ftdi);
+	}
+}
+
+void FakeUsb::receive (const std::string_view payload, const uint16_t status)
+{
+	std::vector<std::pair<uint16_t, std::string>> packets;
+	for (size_t pos = 0; pos < payload.size (); pos += packet_payload) {
+		packets.emplace_back (status, std::string (payload.substr (pos, packet_payload)));
+	}
+	receive_packets (packets);
+}
+
+void FakeUsb::receive_packets (const std::vector<std::pair<uint16_t, std::string>> &packets)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	std::deque<FakePacket> &entry = _receive.emplace_back ();
+	for (const auto &[status, payload] : packets) {
+		entry.push_back ({status, payload.substr (0, packet_payload)});
+	}
+
+	if (entry.empty ()) {
+		_receive.pop_back ();
+	}
+	else {
+		fake_signal ();
+	}
+}
+
+void FakeUsb::receive_status (const size_t count, const uint16_t status)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	for (size_t i = 0; i < count; ++i) {
+		_receive.emplace_back ().push_back ({status, ""});
+	}
+	fake_signal ();
+}
+
+bool FakeUsb::has_receive (void)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return (false == _receive.empty ());
+}
+
+size_t FakeUsb::pending_reads (void)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _reads.size ();
+}
+
+size_t FakeUsb::pending_controls (void)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	return _controls.size ();
+}
+
+std::vector<FakeUsb::Control> FakeUsb::controls_of (const uint8_t request)
+{
+	std::vector<Control> out;
+	for (const Control &control : controls) {
+		if (control.request == request) {
+			out.push_back (control);
+		}
+	}
+	return out;
+}
+
+FakeFd::FakeFd () :
+	fd (::eventfd (0, EFD_NONBLOCK))
+{ }
+
+FakeFd::~FakeFd ()
+{
+	::close (fd);
+}
+
+void FakeFd::signal (void)
+{
+	const uint64_t val = 1;
+	if (::write (fd, &val, sizeof (val)) < 0) {
+		ADD_FAILURE () << "Unable to signal fd";
+	}
+}
+
+void FakeUsbTest::SetUp (void)
+{
+	FakeUsb::reset ();
+	ftdi = FakeUsb::create_context ();
+}
+
+void FakeUsbTest::TearDown (void)
+{
+	FakeUsb::free_context (ftdi);
+	ftdi = nullptr;
+}
+
+extern "C"
+{
+
+struct libusb_transfer * libusb_alloc_transfer (int iso_packets)
+{
+	const size_t len = sizeof (struct libusb_transfer) + (sizeof (struct libusb_iso_packet_descriptor) * static_cast<size_t> (iso_packets));
+	return static_cast<struct libusb_transfer *> (::calloc (1, len));
+}
+
+void libusb_free_transfer (struct libusb_transfer *transfer)
+{
+	if (nullptr != transfer && 0 != (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) {
+		::free (transfer->buffer);
+	}
+	::free (transfer);
+}
+
+int libusb_submit_transfer (struct libusb_transfer *transfer)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	if (LIBUSB_TRANSFER_TYPE_CONTROL == transfer->type) {
+		_controls.push_back (transfer);
+	}
+	else if (0 != (transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+		_reads.push_back (transfer);
+		++FakeUsb::read_submits;
+	}
+	else {
+		_writes.push_back (transfer);
+	}
+
+	fake_signal ();
+	return 0;
+}
+
+int libusb_cancel_transfer (struct libusb_transfer *transfer)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+
+	if (fake_take (_reads, transfer) || fake_take (_writes, transfer) || fake_take (_controls, transfer)) {
+		_cancelled.push_back (transfer);
+		fake_signal ();
+		return 0;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_control_transfer (libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	(void) dev_handle;
+	(void) timeout;
+
+	std::lock_guard<std::mutex> lock (_mutex);
+	FakeUsb::controls.push_back ({bRequest, wValue, wIndex, false});
+
+	if (0 != (request_type & LIBUSB_ENDPOINT_IN) && nullptr != data) {
+		::memset (data, 0, wLength);
+	}
+	return wLength;
+}
+
+int libusb_handle_events_timeout (libusb_context *ctx, struct timeval *tv)
+{
+	return libusb_handle_events_timeout_completed (ctx, tv, nullptr);
+}
+
+int libusb_handle_events_timeout_completed (libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	(void) ctx;
+
+	if (nullptr != completed && 0 != *completed) {
+		return 0;
+	}
+
+	struct pollfd pfd {_usb_fd, POLLIN, 0};
+	const int timeout = (nullptr == tv) ? -1 : static_cast<int> ((tv->tv_sec * 1'000) + (tv->tv_usec / 1'000));
+	if (::poll (&pfd, 1, timeout) > 0) {
+		fake_process ();
+	}
+	return 0;
+}
+
+const struct libusb_pollfd ** libusb_get_pollfds (libusb_context *ctx)
+{
+	(void) ctx;
+
+	static struct libusb_pollfd pollfd;
+	pollfd.fd = _usb_fd;
+	pollfd.events = POLLIN;
+
+	const struct libusb_pollfd **out = static_cast<const struct libusb_pollfd **> (::calloc (2, sizeof (struct libusb_pollfd *)));
+	out[0] = &pollfd;
+	return out;
+}
+
+void libusb_free_pollfds (const struct libusb_pollfd **pollfds)
+{
+	::free (pollfds);
+}
+
+void libusb_set_pollfd_notifiers (libusb_context *ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void *user_data)
+{
+	(void) ctx;
+	(void) added_cb;
+	(void) removed_cb;
+	(void) user_data;
+}
+
+int libusb_pollfds_handle_timeouts (libusb_context *ctx)
+{
+	(void) ctx;
+	return 1;
+}
+
+}
@@ -0,0 +1,208 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#ifndef _HEAD_SGFTDI_TEST_fakeusb
+#define _HEAD_SGFTDI_TEST_fakeusb
+
+#include <gtest/gtest.h>
+
+/* Engine tests run without a device. Test binary defines the libusb functions used for transfers, */
+/* so FtdiStream and FtdiMpsse talk to this fake instead. Transfers complete when libusb events are */
+/* handled, one eventfd stands for the file descriptors of libusb. */
+class FakeUsb
+{
+	public:
+		/* Every packet starts with two modem status bytes, first byte is the low one */
+		static const constexpr int packet_size {64};
+		static const constexpr int packet_payload {packet_size - 2};
+
+		/* CTS and DSR inactive, THRE and TEMT set */
+		static const constexpr uint16_t default_status {0x6001};
+
+		struct Control
+		{
+			uint8_t request {0};
+			uint16_t value {0};
+			uint16_t index {0};
+			bool async {false};
+		};
+
+		/* Asynchronous control transfers complete with LIBUSB_TRANSFER_STALL */
+		static bool fail_controls;
+
+		/* Asynchronous control transfers don't complete until cancelled */
+		static bool hold_controls;
+
+		/* Requests of synchronous and asynchronous control transfers, in order of completion */
+		static std::vector<Control> controls;
+
+		/* Payload of all completed write transfers */
+		static std::string written;
+
+		/* Number of read transfers submitted since reset */
+		static size_t read_submits;
+
+		/* Forget everything, call before every test */
+		static void reset (void);
+
+		static struct libusb_context * get_usb_context (void);
+
+		/* Context of an opened FT232R at 'baudrate', release it by free_context */
+		static struct ftdi_context * create_context (const int baudrate = 115'200);
+		static void free_context (struct ftdi_context * const ftdi);
+
+		/* Next read transfer returns 'payload' split into full packets with 'status'. */
+		/* Payload that doesn't fit into the transfer is returned by the following ones. */
+		static void receive (const std::string_view payload, const uint16_t status = default_status);
+
+		/* Same with 'status' of every packet given, payload of packet is up to packet_payload bytes */
+		static void receive_packets (const std::vector<std::pair<uint16_t, std::string>> &packets);
+
+		/* Next 'count' read transfers return only modem status */
+		static void receive_status (const size_t count = 1, const uint16_t status = default_status);
+
+		/* Data for read transfers not taken yet */
+		static bool has_receive (void);
+
+		/* Read transfers in flight */
+		static size_t pending_reads (void);
+
+		/* Asynchronous control transfers in flight */
+		static size_t pending_controls (void);
+
+		/* Control requests with given bRequest */
+		static std::vector<Control> controls_of (const uint8_t request);
+};
+
+/* Read and write callbacks need a file descriptor for every stream */
+class FakeFd
+{
+	public:
+		const int fd;
+
+		FakeFd ();
+		~FakeFd ();
+
+		FakeFd (FakeFd const&) = delete;
+		FakeFd& operator= (FakeFd const&) = delete;
+
+		/* Wake up the stream, used with WRITE_GET_FD */
+		void signal (void);
+};
+
+/* Read callback keeping everything the stream delivers */
+struct Reader
+{
+	FakeFd fd;
+	std::string payload;
+	size_t calls {0};
+
+	/* READ_BUFFER as "D<payload>", MODEM_STATUS_CHANGED as "S<status>" */
+	std::vector<std::string> events;
+
+	/* Returned by READ_GET_PENDING */
+	int pending {0};
+
+	std::vector<FtdiReadTiming> timings;
+
+	FtdiStreamEntry::Callback callback (void)
+	{
+		return [this](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+			switch (type) {
+				case FtdiStreamEntry::CallbackType::READ_GET_FD:
+					return fd.fd;
+
+				case FtdiStreamEntry::CallbackType::READ_BUFFER:
+					payload.append (buffer, len);
+					++calls;
+					events.push_back ("D"s + std::string (buffer, len));
+					break;
+
+				case FtdiStreamEntry::CallbackType::MODEM_STATUS_CHANGED:
+					{
+						char str[8];
+						::snprintf (str, sizeof (str), "S%02x%02x", static_cast<uint8_t> (buffer[1]), static_cast<uint8_t> (buffer[0]));
+						events.push_back (str);
+					}
+					break;
+
+				case FtdiStreamEntry::CallbackType::READ_GET_PENDING:
+					return pending;
+
+				case FtdiStreamEntry::CallbackType::READ_TIMING:
+					timings.push_back (*reinterpret_cast<const FtdiReadTiming *> (buffer));
+					events.push_back ("T");
+					break;
+
+				case FtdiStreamEntry::CallbackType::READ_FRAME:
+					events.push_back ("F"s + std::string (buffer, len));
+					break;
+
+				case FtdiStreamEntry::CallbackType::READ_FRAME_BAD_CRC:
+					events.push_back ("B"s + std::string (buffer, len));
+					break;
+
+				default:
+					break;
+			}
+			return 0;
+		};
+	}
+};
+
+/* Statistics reported once per second, called from the stream thread */
+struct Reports
+{
+	std::vector<FtdiStreamEntry::Statistics> list;
+
+	FtdiStreamEntry::StatisticsCallback callback (void)
+	{
+		return [this](const uint_fast32_t stream_id, const FtdiStreamEntry::Statistics &stats) -> void {
+			EXPECT_EQ (stream_id, 0U);
+			list.push_back (stats);
+		};
+	}
+
+	template<typename T>
+	uint_fast32_t sum (T FtdiStreamEntry::Statistics::*member) const
+	{
+		uint_fast32_t out = 0;
+		for (const FtdiStreamEntry::Statistics &stats : list) {
+			out += stats.*member;
+		}
+		return out;
+	}
+};
+
+/* Every test gets a fresh fake and a context opened on it */
+class FakeUsbTest : public ::testing::Test
+{
+	protected:
+		struct ftdi_context *ftdi {nullptr};
+
+		void SetUp (void) override;
+		void TearDown (void) override;
+
+		/* Poll the stream until 'done' returns true, at most 'timeout_ms' */
+		template<typename T>
+		static bool poll_until (FtdiStream &stream, T done, const int timeout_ms = 3'000)
+		{
+			const auto deadline = std::chrono::steady_clock::now () + std::chrono::milliseconds (timeout_ms);
+			while (false == done ()) {
+				if (std::chrono::steady_clock::now () > deadline) {
+					return false;
+				}
+				stream.poll (10);
+			}
+			return true;
+		}
+};
+
+#endif // _HEAD_SGFTDI_TEST_fakeusb
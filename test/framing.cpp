@@ -0,0 +1,257 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "fakeusb.h"
+
+using namespace shaga;
+using namespace std::literals;
+
+class ReadFraming : public FakeUsbTest {};
+
+TEST_F (ReadFraming, DelimiterFramesAcrossTransfers)
+{
+	Reader reader;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiDelimiterFramer> ('\n'));
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Empty frame is skipped, long frame spans two packets */
+	FakeUsb::receive ("ab\ncd"sv);
+	FakeUsb::receive ("ef\n\ngh"sv);
+	FakeUsb::receive ("\n"sv);
+	FakeUsb::receive (std::string (100, 'x') + "\n");
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 4; }));
+	stream.stop_poll ();
+
+	const std::vector<std::string> expected {"Fab", "Fcdef", "Fgh", "F" + std::string (100, 'x')};
+	EXPECT_EQ (reader.events, expected);
+	EXPECT_EQ (reader.calls, 0U);
+}
+
+TEST_F (ReadFraming, LengthFramesAcrossTransfers)
+{
+	Reader reader;
+	Reports reports;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_statistics_callback (reports.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiLengthFramer> (2, true, 0, 0, true, 16));
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Length longer than the maximal frame is skipped byte by byte */
+	FakeUsb::receive ("\x00\x03" "ab"s);
+	FakeUsb::receive ("c\x00\x01z\x00"s);
+	FakeUsb::receive ("\x02hi\x7f"s);
+	FakeUsb::receive ("\x00\x02ok"s);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 4; }));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reports.sum (&FtdiStreamEntry::Statistics::frame_errors) > 0; }));
+	stream.stop_poll ();
+
+	const std::vector<std::string> expected {"Fabc", "Fz", "Fhi", "Fok"};
+	EXPECT_EQ (reader.events, expected);
+}
+
+TEST (Framing, LengthFind)
+{
+	/* Little endian length after one byte of header, counting the header too */
+	const FtdiLengthFramer framer (2, false, 1, -3, false);
+	FtdiFramer::Frame frame;
+
+	const std::string data = "\xaa\x06\x00xyz"s;
+	EXPECT_EQ (framer.find (data.data (), 2, 0, frame), 0U);
+	EXPECT_EQ (framer.find (data.data (), 5, 0, frame), 0U);
+	EXPECT_EQ (framer.find (data.data (), data.size (), 0, frame), 6U);
+	EXPECT_TRUE (frame.valid);
+	EXPECT_EQ (frame.offset, 0U);
+	EXPECT_EQ (frame.len, 6U);
+
+	/* Negative length is not a frame start */
+	frame = FtdiFramer::Frame ();
+	EXPECT_EQ (framer.find ("\xaa\x01\x00"s.data (), 3, 0, frame), 1U);
+	EXPECT_FALSE (frame.valid);
+}
+
+/* Write callback handing out queued frames by WRITE_FILL_FRAME */
+struct FrameWriter
+{
+	FakeFd fd;
+	std::deque<std::string> frames;
+
+	FtdiStreamEntry::Callback callback (void)
+	{
+		return [this](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+			switch (type) {
+				case FtdiStreamEntry::CallbackType::WRITE_GET_FD:
+					return fd.fd;
+
+				case FtdiStreamEntry::CallbackType::WRITE_FILL_FRAME:
+					if (true == frames.empty ()) {
+						return 0;
+					}
+					else {
+						const std::string frame = frames.front ();
+						EXPECT_LE (frame.size (), static_cast<size_t> (len));
+						frames.pop_front ();
+						::memcpy (buffer, frame.data (), frame.size ());
+						return static_cast<int> (frame.size ());
+					}
+
+				default:
+					return 0;
+			}
+		};
+	}
+};
+
+TEST_F (ReadFraming, SlipRoundTrip)
+{
+	Reader reader;
+	FrameWriter writer;
+	writer.frames = {"\x01\xc0\x02"s, "plain"s};
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_write_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_write_callback (writer.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiSlipFramer> ());
+	streams.back ().set_write_encoder (std::make_shared<FtdiSlipEncoder> (true));
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	const std::string encoded = "\xc0\x01\xdb\xdc\x02\xc0"s "\xc0plain\xc0"s;
+	ASSERT_TRUE (poll_until (stream, [&]() { return FakeUsb::written.size () == encoded.size (); }));
+	EXPECT_EQ (FakeUsb::written, encoded);
+
+	/* Loop the encoded frames back, split in the middle of the escape */
+	FakeUsb::receive (encoded.substr (0, 3));
+	FakeUsb::receive (encoded.substr (3));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 2; }));
+	stream.stop_poll ();
+
+	const std::vector<std::string> expected {"F\x01\xc0\x02"s, "Fplain"s};
+	EXPECT_EQ (reader.events, expected);
+}
+
+TEST_F (ReadFraming, CobsRoundTrip)
+{
+	Reader reader;
+	FrameWriter writer;
+	writer.frames = {"\x11\x00\x22"s, std::string (300, 'c')};
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_write_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_write_callback (writer.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiCobsFramer> ());
+	streams.back ().set_write_encoder (std::make_shared<FtdiCobsEncoder> ());
+
+	const FtdiCobsEncoder encoder;
+	std::string encoded;
+	for (const std::string &frame : writer.frames) {
+		std::string out (encoder.max_encoded (frame.size ()), '\0');
+		out.resize (encoder.encode (frame.data (), frame.size (), out.data ()));
+		encoded.append (out);
+	}
+	EXPECT_EQ (encoded.substr (0, 5), "\x02\x11\x02\x22\x00"s);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Long frame continues over write transfers of one packet */
+	ASSERT_TRUE (poll_until (stream, [&]() { return FakeUsb::written.size () == encoded.size (); }));
+	EXPECT_EQ (FakeUsb::written, encoded);
+
+	FakeUsb::receive (FakeUsb::written);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 2; }));
+	stream.stop_poll ();
+
+	const std::vector<std::string> expected {"F\x11\x00\x22"s, "F" + std::string (300, 'c')};
+	EXPECT_EQ (reader.events, expected);
+}
+
+/* Frames of one byte length followed by payload and CRC-16 */
+static std::string crc_frame (const std::string &payload, const bool corrupt)
+{
+	const FtdiCrcCheck crc (FtdiCrcCheck::Algorithm::CRC16_CCITT, true);
+	std::string frame = static_cast<char> (payload.size () + crc.get_size ()) + payload + "xx";
+	crc.append (frame.data () + 1, payload.size ());
+	if (true == corrupt) {
+		frame[1] ^= 0x01;
+	}
+	return frame;
+}
+
+TEST_F (ReadFraming, BadCrcIsFlagged)
+{
+	Reader reader;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiLengthFramer> (1));
+	streams.back ().set_read_crc (std::make_shared<FtdiCrcCheck> (FtdiCrcCheck::Algorithm::CRC16_CCITT, true, true, FtdiCrcCheck::Action::FLAG));
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	FakeUsb::receive (crc_frame ("abc", false) + crc_frame ("def", true) + crc_frame ("ghi", false));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 3; }));
+	stream.stop_poll ();
+
+	/* CRC is stripped from bad frames too */
+	const std::vector<std::string> expected {"Fabc", "Beef", "Fghi"};
+	EXPECT_EQ (reader.events, expected);
+}
+
+TEST_F (ReadFraming, BadCrcIsDropped)
+{
+	Reader reader;
+	Reports reports;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_statistics_callback (reports.callback ());
+	streams.back ().set_read_framer (std::make_shared<FtdiLengthFramer> (1));
+	streams.back ().set_read_crc (std::make_shared<FtdiCrcCheck> (FtdiCrcCheck::Algorithm::CRC16_CCITT, true));
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	FakeUsb::receive (crc_frame ("abc", true) + crc_frame ("def", false));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.events.size () == 1; }));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reports.sum (&FtdiStreamEntry::Statistics::bad_crc) == 1; }));
+	stream.stop_poll ();
+
+	const std::vector<std::string> expected {"Fdef"};
+	EXPECT_EQ (reader.events, expected);
+
+	/* CRC check needs a framer */
+	streams.back ().set_read_framer (nullptr);
+	EXPECT_THROW ({ FtdiStream other (streams); other.start_poll (); }, std::exception);
+}
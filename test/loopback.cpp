@@ -0,0 +1,173 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "fakeusb.h"
+
+#include <thread>
+
+using namespace shaga;
+using namespace std::literals;
+
+/* TX is wired to RX: bytes written to the fake come back as received, through 'wire' if set */
+class Loopback : public FakeUsbTest
+{
+	protected:
+		size_t looped {0};
+		std::function<void(std::string &data)> wire;
+
+		template<typename T>
+		bool loop_until (FtdiStream &stream, T done, const int timeout_ms = 3'000)
+		{
+			const auto deadline = std::chrono::steady_clock::now () + std::chrono::milliseconds (timeout_ms);
+			while (false == done ()) {
+				if (std::chrono::steady_clock::now () > deadline) {
+					return false;
+				}
+				if (FakeUsb::written.size () > looped && false == FakeUsb::has_receive ()) {
+					std::string data = FakeUsb::written.substr (looped);
+					looped = FakeUsb::written.size ();
+					if (nullptr != wire) {
+						wire (data);
+					}
+					FakeUsb::receive (data);
+				}
+				stream.poll (10);
+			}
+			return true;
+		}
+};
+
+TEST_F (Loopback, CleanLine)
+{
+	FtdiLoopbackTest test (FtdiLoopbackTest::Pattern::PRBS15);
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_write_transfers (1, 1);
+	test.attach (streams.back ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	ASSERT_TRUE (loop_until (stream, [&]() { return test.get_results ().bytes_checked >= 4'000; }));
+	stream.stop_poll ();
+
+	const FtdiLoopbackTest::Results results = test.get_results ();
+	EXPECT_TRUE (results.in_sync);
+	EXPECT_EQ (results.error_bits, 0U);
+	EXPECT_EQ (results.lost_bytes, 0U);
+	EXPECT_EQ (results.resyncs, 0U);
+	EXPECT_GE (results.bytes_sent, results.bytes_received);
+	EXPECT_EQ (results.get_bit_error_rate (), 0.0);
+	EXPECT_GT (results.latency_samples, 0U);
+	EXPECT_GE (results.last_ns, results.first_ns);
+
+	test.reset_results ();
+	EXPECT_EQ (test.get_results ().bytes_received, 0U);
+}
+
+TEST_F (Loopback, ErrorsAndLostBytes)
+{
+	FtdiLoopbackTest test (FtdiLoopbackTest::Pattern::PRBS7);
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_write_transfers (1, 1);
+	test.attach (streams.back ());
+
+	/* One flipped bit early, then ten bytes lost in the middle of the line */
+	size_t total = 0;
+	bool flipped = false;
+	bool dropped = false;
+	wire = [&](std::string &data) -> void {
+		if (false == flipped && total + data.size () > 1'000) {
+			data[1'000 - total] ^= 0x08;
+			flipped = true;
+		}
+		else if (false == dropped && true == flipped && total + data.size () > 3'000 + 20) {
+			data.erase (3'000 - std::min<size_t> (total, 3'000), 10);
+			dropped = true;
+		}
+		total += data.size ();
+	};
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	ASSERT_TRUE (loop_until (stream, [&]() { return true == dropped && test.get_results ().bytes_checked >= 6'000; }));
+	stream.stop_poll ();
+
+	const FtdiLoopbackTest::Results results = test.get_results ();
+	EXPECT_TRUE (results.in_sync);
+	EXPECT_EQ (results.error_bits, 1U);
+	EXPECT_EQ (results.lost_bytes, 10U);
+	EXPECT_EQ (results.resyncs, 1U);
+}
+
+TEST (LatencyProbe, Percentile)
+{
+	FtdiLatencyProbe::Results results;
+	results.bucket_ns = 10;
+	results.counts = {1, 2, 0, 7};
+	results.samples = 11;
+	results.overflow = 1;
+	results.min_ns = 5;
+	results.max_ns = 55;
+	results.sum_ns = 330;
+
+	EXPECT_EQ (results.get_avg_ns (), 30U);
+	EXPECT_EQ (results.get_percentile_ns (0.0), 10U);
+	EXPECT_EQ (results.get_percentile_ns (0.25), 20U);
+	EXPECT_EQ (results.get_percentile_ns (0.5), 40U);
+	EXPECT_EQ (results.get_percentile_ns (1.0), 55U);
+
+	EXPECT_EQ (FtdiLatencyProbe::Results ().get_percentile_ns (0.99), 0U);
+}
+
+TEST_F (Loopback, LatencyProbeMarkers)
+{
+	FtdiLatencyProbe probe (1);
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_write_transfers (1, 1);
+	probe.attach (streams.back ());
+
+	/* Short packets are flushed by 1 ms latency timer, the line takes longer than that */
+	FtdiContext::Config::LatencyTimer policy;
+	policy.value = 1;
+	streams.back ().set_latency_timer_policy (policy);
+
+	/* Every fifth marker arrives with a broken check byte */
+	size_t markers = 0;
+	wire = [&](std::string &data) -> void {
+		std::this_thread::sleep_for (std::chrono::milliseconds (3));
+		for (size_t pos = 0; pos < data.size (); pos += FtdiLatencyProbe::marker_size) {
+			EXPECT_EQ (data[pos], FtdiLatencyProbe::marker_sync);
+			if (0 == (++markers % 5)) {
+				data[pos + FtdiLatencyProbe::marker_size - 1] ^= 0x40;
+			}
+		}
+	};
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	ASSERT_TRUE (loop_until (stream, [&]() { return probe.get_results ().received >= 12; }));
+	stream.stop_poll ();
+
+	const FtdiLatencyProbe::Results results = probe.get_results ();
+	EXPECT_GE (results.sent, results.received + results.damaged);
+	EXPECT_EQ (results.damaged, (results.received + results.damaged) / 5);
+	EXPECT_EQ (results.lost, results.damaged);
+	EXPECT_EQ (results.samples, results.received);
+	EXPECT_GT (results.min_ns, 0U);
+	EXPECT_LE (results.min_ns, results.max_ns);
+}
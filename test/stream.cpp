@@ -0,0 +1,935 @@
+/*
+*    ShaGa FTDI library - extension to libftdi1 using libshaga
+*    Copyright (c) 2016-2023, SAGE team s.r.o., Samuel Kupka
+*
+*    This library is distributed under the
+*    GNU Library General Public License version 2.
+*
+*    A copy of the GNU Library General Public License (LGPL) is included
+*    in this distribution, in the file COPYING.LIB.
+*/
+#include "fakeusb.h"
+
+#ifdef SHAGA_THREADING
+#include <condition_variable>
+#endif // SHAGA_THREADING
+
+using namespace shaga;
+using namespace std::literals;
+
+class Stream : public FakeUsbTest {};
+
+TEST_F (Stream, ResetByControlTransfers)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 2);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Synchronous reset when the stream starts */
+	ASSERT_EQ (FakeUsb::controls.size (), 3U);
+	EXPECT_EQ (FakeUsb::controls[0].request, SIO_SET_BITMODE_REQUEST);
+	EXPECT_FALSE (FakeUsb::controls[0].async);
+	EXPECT_EQ (FakeUsb::controls_of (SIO_RESET_REQUEST).size (), 2U);
+	FakeUsb::controls.clear ();
+
+	FakeUsb::receive ("before"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == 6; }));
+
+	ftdi->bitbang_mode = BITMODE_MPSSE;
+	stream.reset_stream (0);
+	ASSERT_TRUE (poll_until (stream, [&]() { return FakeUsb::controls.size () == 3; }));
+
+	const uint16_t index = static_cast<uint16_t> (ftdi->index);
+	EXPECT_TRUE (FakeUsb::controls[0].async);
+	EXPECT_EQ (FakeUsb::controls[0].request, SIO_SET_BITMODE_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[0].value, 0xff | (BITMODE_RESET << 8));
+	EXPECT_EQ (FakeUsb::controls[0].index, index);
+	EXPECT_EQ (FakeUsb::controls[1].request, SIO_RESET_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[1].value, SIO_TCOFLUSH);
+	EXPECT_EQ (FakeUsb::controls[2].request, SIO_RESET_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[2].value, SIO_TCIFLUSH);
+	EXPECT_EQ (ftdi->bitbang_mode, BITMODE_RESET);
+
+	/* Read transfers stay in flight during the reset */
+	EXPECT_EQ (FakeUsb::pending_reads (), 2U);
+	FakeUsb::receive ("after"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == 11; }));
+	EXPECT_EQ (reader.payload, "beforeafter");
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, FailedResetStopsStream)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	FakeUsb::controls.clear ();
+
+	FakeUsb::fail_controls = true;
+	stream.reset_stream (0);
+	ASSERT_TRUE (poll_until (stream, [&]() { return stream.is_ending (); }));
+	stream.stop_poll ();
+
+	/* Rest of the sequence is skipped after the first failed request */
+	size_t async = 0;
+	for (const FakeUsb::Control &control : FakeUsb::controls) {
+		async += (true == control.async) ? 1 : 0;
+	}
+	EXPECT_EQ (async, 1U);
+
+	const COMMON_LIST errors = stream.get_errors ();
+	ASSERT_FALSE (errors.empty ());
+	EXPECT_NE (errors.front ().find ("Can't reset stream"), std::string::npos);
+}
+
+TEST_F (Stream, ResetCallbackReplacesControls)
+{
+	Reader reader;
+	size_t resets = 0;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_reset_callback ([&](struct ftdi_context * const ctx) -> void {
+		EXPECT_EQ (ctx, ftdi);
+		++resets;
+	});
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	EXPECT_EQ (resets, 1U);
+
+	stream.reset_stream (0);
+	ASSERT_TRUE (poll_until (stream, [&]() { return resets == 2; }));
+
+	stream.stop_poll ();
+	EXPECT_TRUE (FakeUsb::controls.empty ());
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, SetLineSendsRequestsInOrder)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	FakeUsb::controls.clear ();
+
+	FtdiStream::LineParams params;
+	params.baudrate = 9'600;
+	params.dtr = FtdiStream::LineParams::Pin::HIGH;
+	params.rts = FtdiStream::LineParams::Pin::LOW;
+	params.latency_timer = 4;
+	params.change_flow = true;
+	params.flow = FtdiContext::Config::FlowControl::RTS_CTS;
+
+	std::vector<bool> results;
+	stream.set_line (0, params, [&](const uint_fast32_t stream_id, const bool success) -> void {
+		EXPECT_EQ (stream_id, 0U);
+		results.push_back (success);
+	});
+	ASSERT_TRUE (poll_until (stream, [&]() { return false == results.empty (); }));
+	EXPECT_EQ (results, std::vector<bool> {true});
+
+	const uint16_t index = static_cast<uint16_t> (ftdi->index);
+	ASSERT_EQ (FakeUsb::controls.size (), 4U);
+	EXPECT_EQ (FakeUsb::controls[0].request, SIO_SET_BAUDRATE_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[0].value, 0x4138);
+	EXPECT_EQ (FakeUsb::controls[0].index, 0);
+	EXPECT_EQ (FakeUsb::controls[1].request, SIO_SET_MODEM_CTRL_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[1].value, SIO_SET_DTR_HIGH | SIO_SET_RTS_LOW);
+	EXPECT_EQ (FakeUsb::controls[1].index, index);
+	EXPECT_EQ (FakeUsb::controls[2].request, SIO_SET_LATENCY_TIMER_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[2].value, 4);
+	EXPECT_EQ (FakeUsb::controls[3].request, SIO_SET_FLOW_CTRL_REQUEST);
+	EXPECT_EQ (FakeUsb::controls[3].value, 0);
+	EXPECT_EQ (FakeUsb::controls[3].index, SIO_RTS_CTS_HS | index);
+	EXPECT_EQ (ftdi->baudrate, 9'600);
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, SetLineFailureKeepsStreamRunning)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	FakeUsb::controls.clear ();
+	FakeUsb::fail_controls = true;
+
+	FtdiStream::LineParams params;
+	params.baudrate = 9'600;
+	params.latency_timer = 4;
+
+	std::vector<bool> results;
+	stream.set_line (0, params, [&](const uint_fast32_t, const bool success) -> void {
+		results.push_back (success);
+	});
+	ASSERT_TRUE (poll_until (stream, [&]() { return false == results.empty (); }));
+	EXPECT_EQ (results, std::vector<bool> {false});
+	EXPECT_EQ (FakeUsb::controls.size (), 1U);
+	EXPECT_EQ (ftdi->baudrate, 115'200);
+
+	/* Reading goes on */
+	FakeUsb::receive ("data"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "data"; }));
+	EXPECT_FALSE (stream.is_ending ());
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, SetLineRejectsInvalidRequests)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+
+	FtdiStream::LineParams params;
+	params.latency_timer = 4;
+	EXPECT_THROW (stream.set_line (0, params), std::exception);
+
+	stream.start_poll ();
+	EXPECT_THROW (stream.set_line (1, params), std::exception);
+	EXPECT_THROW (stream.set_line (0, FtdiStream::LineParams ()), std::exception);
+
+	params.baudrate = 10;
+	EXPECT_THROW (stream.set_line (0, params), std::exception);
+
+	stream.stop_poll ();
+	EXPECT_TRUE (FakeUsb::controls_of (SIO_SET_LATENCY_TIMER_REQUEST).empty ());
+}
+
+TEST_F (Stream, BaudrateRequestKnownAnswers)
+{
+	/* FT232R divisors from FTDI AN232B-05 */
+	unsigned short value = 0, index = 0;
+	EXPECT_EQ (::ftdi_get_baudrate_request_ex (ftdi, 9'600, &value, &index), 9'600);
+	EXPECT_EQ (value, 0x4138);
+	EXPECT_EQ (index, 0);
+
+	EXPECT_EQ (::ftdi_get_baudrate_request_ex (ftdi, 115'200, &value, &index), 115'200);
+	EXPECT_EQ (value, 0x001a);
+
+	EXPECT_EQ (::ftdi_get_baudrate_request_ex (ftdi, 300, &value, &index), 300);
+	EXPECT_EQ (value, 0x2710);
+
+	EXPECT_LT (::ftdi_get_baudrate_request_ex (ftdi, 0, &value, &index), 0);
+	EXPECT_LT (::ftdi_get_baudrate_request_ex (ftdi, 10, &value, &index), 0);
+
+	/* Bitbang rate is four times the baudrate */
+	ftdi->bitbang_enabled = 1;
+	EXPECT_EQ (::ftdi_get_baudrate_request_ex (ftdi, 9'600, &value, &index), 38'400);
+	ftdi->bitbang_enabled = 0;
+
+	/* Nothing is sent to the device */
+	EXPECT_TRUE (FakeUsb::controls.empty ());
+	EXPECT_EQ (ftdi->baudrate, 115'200);
+
+	struct libusb_device_handle * const dev = ftdi->usb_dev;
+	ftdi->usb_dev = nullptr;
+	EXPECT_EQ (::ftdi_get_baudrate_request_ex (ftdi, 9'600, &value, &index), -3);
+	ftdi->usb_dev = dev;
+}
+
+TEST_F (Stream, LatencyTimerAutoTune)
+{
+	Reader reader;
+	Reports reports;
+
+	FtdiContext::Config::LatencyTimer policy;
+	policy.mode = FtdiContext::Config::LatencyTimer::Mode::AUTO;
+	policy.value = 16;
+	policy.min = 4;
+	policy.max = 16;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_statistics_callback (reports.callback ());
+	streams.back ().set_latency_timer_policy (policy);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	FakeUsb::controls.clear ();
+
+	/* Interactive traffic, timer is halved every second down to min */
+	auto latency_requests = [&]() -> std::vector<uint16_t> {
+		std::vector<uint16_t> out;
+		for (const FakeUsb::Control &control : FakeUsb::controls_of (SIO_SET_LATENCY_TIMER_REQUEST)) {
+			EXPECT_TRUE (control.async);
+			out.push_back (control.value);
+		}
+		return out;
+	};
+
+	ASSERT_TRUE (poll_until (stream, [&]() {
+		if (false == FakeUsb::has_receive ()) {
+			FakeUsb::receive ("x"sv);
+		}
+		return latency_requests ().size () == 2;
+	}, 5'000));
+	EXPECT_EQ (latency_requests (), (std::vector<uint16_t> {8, 4}));
+
+	/* Bulk traffic fills whole transfers, timer goes back up to max */
+	const std::string full (FakeUsb::packet_payload, 'y');
+	ASSERT_TRUE (poll_until (stream, [&]() {
+		if (false == FakeUsb::has_receive ()) {
+			FakeUsb::receive (full);
+		}
+		return latency_requests ().size () == 4;
+	}, 5'000));
+	EXPECT_EQ (latency_requests (), (std::vector<uint16_t> {8, 4, 8, 16}));
+
+	reports.list.clear ();
+	ASSERT_TRUE (poll_until (stream, [&]() { return false == reports.list.empty (); }));
+	EXPECT_EQ (reports.list.back ().latency_timer, 16);
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, LatencyTimerFixedPolicyIsKept)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	ASSERT_FALSE (poll_until (stream, [&]() {
+		if (false == FakeUsb::has_receive ()) {
+			FakeUsb::receive ("x"sv);
+		}
+		return false;
+	}, 1'500));
+
+	stream.stop_poll ();
+	EXPECT_TRUE (FakeUsb::controls_of (SIO_SET_LATENCY_TIMER_REQUEST).empty ());
+}
+
+TEST (Context, LatencyTimerConfig)
+{
+	FtdiContext context (false);
+	const FtdiContext::Config::LatencyTimer &latency = context.get_config ().latency_timer;
+	EXPECT_EQ (latency.mode, FtdiContext::Config::LatencyTimer::Mode::FIXED);
+	EXPECT_EQ (latency.value, 0);
+
+	INI ini;
+	ini.set_string ("ftdi"sv, "latency_timer"sv, "8"sv);
+	ini.set_string ("ftdi"sv, "latency_timer_min"sv, "2"sv);
+	ini.set_string ("ftdi"sv, "latency_timer_max"sv, "32"sv);
+	ini.set_string ("ftdi"sv, "latency_mode"sv, "Auto"sv);
+	context.populate_config (ini, "ftdi"sv);
+
+	EXPECT_EQ (latency.mode, FtdiContext::Config::LatencyTimer::Mode::AUTO);
+	EXPECT_EQ (latency.value, 8);
+	EXPECT_EQ (latency.min, 2);
+	EXPECT_EQ (latency.max, 32);
+
+	ini.set_string ("ftdi"sv, "latency_mode"sv, "fixed"sv);
+	context.populate_config (ini, "ftdi"sv);
+	EXPECT_EQ (latency.mode, FtdiContext::Config::LatencyTimer::Mode::FIXED);
+}
+
+TEST (Context, LatencyTimerConfigRejectsInvalid)
+{
+	{
+		FtdiContext context (false);
+		INI ini;
+		ini.set_string ("ftdi"sv, "latency_mode"sv, "fast"sv);
+		EXPECT_THROW (context.populate_config (ini, "ftdi"sv), std::exception);
+	}
+	{
+		FtdiContext context (false);
+		INI ini;
+		ini.set_string ("ftdi"sv, "latency_timer_min"sv, "8"sv);
+		ini.set_string ("ftdi"sv, "latency_timer_max"sv, "4"sv);
+		EXPECT_THROW (context.populate_config (ini, "ftdi"sv), std::exception);
+	}
+}
+
+TEST_F (Stream, IdleModeCollapsesReads)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 4);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_idle_threshold (3);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+	EXPECT_EQ (FakeUsb::pending_reads (), 4U);
+
+	/* Two status-only completions are not enough */
+	FakeUsb::receive_status (2);
+	ASSERT_TRUE (poll_until (stream, [&]() { return false == FakeUsb::has_receive (); }));
+	ASSERT_TRUE (poll_until (stream, [&]() { return FakeUsb::pending_reads () == 4; }));
+
+	FakeUsb::receive_status (6);
+	ASSERT_TRUE (poll_until (stream, [&]() { return false == FakeUsb::has_receive () && FakeUsb::pending_reads () == 1; }));
+
+	/* First payload byte restores full depth */
+	FakeUsb::receive ("wake"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "wake" && FakeUsb::pending_reads () == 4; }));
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, ModemStatusChangedBeforePayload)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_modem_status_events (true);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* First status is always reported, then only changes of CTS, DSR, RI, RLSD and line errors. */
+	/* THRE and TEMT (0x6000) don't raise the event. */
+	FakeUsb::receive_packets ({
+		{0x6001, "a"}, {0x6001, "b"}, {0x6011, "c"}, {0x0011, "d"}, {0x0211, "e"}, {0x0211, ""}, {0x0011, "f"}
+	});
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == 6; }));
+
+	EXPECT_EQ (reader.events, (std::vector<std::string> {
+		"S6001", "Da", "Db", "S6011", "Dc", "Dd", "S0211", "De", "S0011", "Df"
+	}));
+
+	stream.stop_poll ();
+}
+
+TEST_F (Stream, ModemStatusOfEveryPacket)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (4, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_modem_status_events (true);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Status changes in the middle of one transfer */
+	const std::string full (FakeUsb::packet_payload, 'x');
+	FakeUsb::receive_packets ({{0x6001, full}, {0x6021, full}, {0x6021, "y"}});
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == full.size () * 2 + 1; }));
+
+	EXPECT_EQ (reader.events, (std::vector<std::string> {"S6001", "D" + full, "S6021", "D" + full, "Dy"}));
+
+	stream.stop_poll ();
+}
+
+TEST_F (Stream, LineErrorsAreCounted)
+{
+	Reader reader;
+	Reports reports;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (4, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_statistics_callback (reports.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Errors are counted per packet, also in packets without payload */
+	const std::string full (FakeUsb::packet_payload, 'x');
+	FakeUsb::receive_packets ({{0x0201, full}, {0x0201, full}, {0x0601, "a"}});
+	FakeUsb::receive_packets ({{0x0801, ""}});
+	FakeUsb::receive_packets ({{0x1001, full}, {0x8001, "b"}});
+	FakeUsb::receive_packets ({{0x6001, "c"}});
+
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == (full.size () * 3) + 3; }));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reports.list.size () >= 2; }));
+
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::overrun_errors), 3U);
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::parity_errors), 1U);
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::framing_errors), 1U);
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::break_interrupts), 1U);
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::fifo_errors), 1U);
+
+	stream.stop_poll ();
+}
+
+TEST_F (Stream, WatermarksThrottleReading)
+{
+	Reader reader;
+	Reports reports;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 2);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_watermarks (100, 10);
+	streams.back ().set_statistics_callback (reports.callback ());
+
+	EXPECT_THROW (streams.back ().set_read_watermarks (10, 10), std::exception);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Consumer is behind, both read transfers stop */
+	reader.pending = 100;
+	FakeUsb::receive ("a"sv);
+	FakeUsb::receive ("b"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "ab" && FakeUsb::pending_reads () == 0; }));
+
+	FakeUsb::receive ("c"sv);
+	ASSERT_FALSE (poll_until (stream, [&]() { return reader.payload.size () > 2; }, 300));
+
+	/* Low watermark is reached */
+	reader.pending = 10;
+	stream.enable_reading (0);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "abc" && FakeUsb::pending_reads () == 2; }));
+
+	ASSERT_TRUE (poll_until (stream, [&]() { return reports.sum (&FtdiStreamEntry::Statistics::throttled) > 0; }));
+	EXPECT_EQ (reports.sum (&FtdiStreamEntry::Statistics::throttled), 1U);
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+#ifdef SHAGA_THREADING
+/* Consumer running on dispatch threads, may hold the delivery until released */
+struct SlowReader
+{
+	FakeFd fd;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool blocked {false};
+	std::string payload;
+	std::vector<std::thread::id> threads;
+
+	FtdiStreamEntry::Callback callback (void)
+	{
+		return [this](const FtdiStreamEntry::CallbackType type, char * const buffer, const int len) -> int {
+			switch (type) {
+				case FtdiStreamEntry::CallbackType::READ_GET_FD:
+					return fd.fd;
+
+				case FtdiStreamEntry::CallbackType::READ_BUFFER:
+					{
+						std::unique_lock<std::mutex> lock (mutex);
+						cond.wait (lock, [this]() { return false == blocked; });
+						payload.append (buffer, len);
+						threads.push_back (std::this_thread::get_id ());
+					}
+					cond.notify_all ();
+					break;
+
+				default:
+					break;
+			}
+			return 0;
+		};
+	}
+
+	void block (const bool enabled)
+	{
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			blocked = enabled;
+		}
+		cond.notify_all ();
+	}
+
+	std::string get_payload (void)
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		return payload;
+	}
+};
+
+TEST_F (Stream, DispatchDeliversInOrder)
+{
+	SlowReader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 2);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_dispatch (4);
+
+	FtdiStream stream (streams);
+	stream.set_dispatch_threads (2);
+	stream.start_poll ();
+
+	std::string expected;
+	for (char c = 'a'; c <= 'z'; ++c) {
+		FakeUsb::receive (std::string (1, c));
+		expected.push_back (c);
+	}
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.get_payload ().size () == expected.size (); }));
+	EXPECT_EQ (reader.get_payload (), expected);
+
+	for (const std::thread::id &id : reader.threads) {
+		EXPECT_NE (id, std::this_thread::get_id ());
+	}
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, DispatchQueueDepthStopsReading)
+{
+	SlowReader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_dispatch (2);
+
+	FtdiStream stream (streams);
+	stream.set_dispatch_threads (1);
+	stream.start_poll ();
+
+	/* One transfer is being delivered, two wait in the queue, then reading stops */
+	reader.block (true);
+	for (int i = 0; i < 6; ++i) {
+		FakeUsb::receive (std::to_string (i));
+	}
+	ASSERT_TRUE (poll_until (stream, [&]() { return FakeUsb::pending_reads () == 0; }));
+	ASSERT_FALSE (poll_until (stream, [&]() { return FakeUsb::pending_reads () > 0; }, 200));
+	EXPECT_TRUE (FakeUsb::has_receive ());
+
+	reader.block (false);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.get_payload () == "012345"; }));
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+#else
+TEST_F (Stream, DispatchNeedsThreading)
+{
+	Reader reader;
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_dispatch (2);
+
+	FtdiStream stream (streams);
+	EXPECT_THROW (stream.set_dispatch_threads (1), std::exception);
+	EXPECT_THROW (stream.start_poll (), std::exception);
+}
+#endif // SHAGA_THREADING
+
+TEST_F (Stream, BufferHandlesShareData)
+{
+	Reader reader;
+	std::vector<FtdiBuffer> buffers;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (2, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_spare_buffers (2);
+	streams.back ().set_read_buffer_callback ([&](const uint_fast32_t stream_id, const FtdiBuffer &buffer) -> void {
+		EXPECT_EQ (stream_id, 0U);
+		buffers.push_back (buffer);
+	});
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Modem status bytes are removed from the whole transfer */
+	const std::string full (FakeUsb::packet_payload, 'x');
+	FakeUsb::receive_packets ({{0x6001, full}, {0x6011, "tail"}});
+	ASSERT_TRUE (poll_until (stream, [&]() { return buffers.size () == 1; }));
+
+	const FtdiBuffer &buffer = buffers.front ();
+	EXPECT_EQ (std::string (buffer.data (), buffer.size ()), full + "tail");
+	EXPECT_EQ (buffer.get_stream_id (), 0U);
+	EXPECT_EQ (buffer.get_modem_status (), 0x6011);
+	EXPECT_GT (buffer.get_timestamp (), 0U);
+
+	/* READ_BUFFER is not called */
+	EXPECT_EQ (reader.calls, 0U);
+
+	/* Copies share the same data */
+	FtdiBuffer copy = buffer;
+	EXPECT_EQ (copy.data (), buffer.data ());
+	FtdiBuffer moved = std::move (copy);
+	EXPECT_TRUE (copy.empty ());
+	EXPECT_EQ (moved.data (), buffer.data ());
+	moved.reset ();
+	EXPECT_TRUE (moved.empty ());
+	EXPECT_EQ (std::string (buffer.data (), buffer.size ()), full + "tail");
+
+	stream.stop_poll ();
+
+	/* Handle outlives the stream */
+	EXPECT_EQ (std::string (buffer.data (), buffer.size ()), full + "tail");
+	buffers.clear ();
+}
+
+TEST_F (Stream, HeldBuffersStarveReading)
+{
+	Reader reader;
+	std::vector<FtdiBuffer> buffers;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_spare_buffers (1);
+	streams.back ().set_read_buffer_callback ([&](const uint_fast32_t, const FtdiBuffer &buffer) -> void {
+		buffers.push_back (buffer);
+	});
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Transfer block and one spare, both are held after two transfers */
+	FakeUsb::receive ("a"sv);
+	FakeUsb::receive ("b"sv);
+	FakeUsb::receive ("c"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return buffers.size () == 2 && FakeUsb::pending_reads () == 0; }));
+	ASSERT_FALSE (poll_until (stream, [&]() { return buffers.size () > 2; }, 200));
+
+	/* Released block resumes reading */
+	buffers.erase (buffers.begin ());
+	ASSERT_TRUE (poll_until (stream, [&]() { return buffers.size () == 2; }));
+	EXPECT_EQ (std::string (buffers[0].data (), buffers[0].size ()), "b");
+	EXPECT_EQ (std::string (buffers[1].data (), buffers[1].size ()), "c");
+
+	buffers.clear ();
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+
+TEST_F (Stream, SinksShareBuffers)
+{
+	Reader reader;
+	std::vector<FtdiBuffer> lent;
+	std::vector<FtdiBuffer> sunk;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().add_read_sink ([&](const uint_fast32_t stream_id, const FtdiBuffer &buffer) -> void {
+		EXPECT_EQ (stream_id, 0U);
+		sunk.push_back (buffer);
+	});
+
+	EXPECT_THROW (streams.back ().add_read_sink (nullptr), std::exception);
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* READ_BUFFER still gets the payload, sink gets the same bytes */
+	FakeUsb::receive ("first"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return sunk.size () == 1; }));
+	EXPECT_EQ (reader.payload, "first");
+	EXPECT_EQ (std::string (sunk[0].data (), sunk[0].size ()), "first");
+
+	sunk.clear ();
+	stream.stop_poll ();
+}
+
+TEST_F (Stream, SinksShareLentBuffers)
+{
+	Reader reader;
+	std::vector<FtdiBuffer> lent;
+	std::vector<FtdiBuffer> sunk;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_spare_buffers (2);
+	streams.back ().set_read_buffer_callback ([&](const uint_fast32_t, const FtdiBuffer &buffer) -> void {
+		lent.push_back (buffer);
+	});
+	streams.back ().add_read_sink ([&](const uint_fast32_t, const FtdiBuffer &buffer) -> void {
+		sunk.push_back (buffer);
+	});
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	FakeUsb::receive ("second"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return sunk.size () == 1; }));
+	ASSERT_EQ (lent.size (), 1U);
+	EXPECT_EQ (lent[0].data (), sunk[0].data ());
+	EXPECT_EQ (std::string (sunk[0].data (), sunk[0].size ()), "second");
+	EXPECT_TRUE (reader.payload.empty ());
+
+	lent.clear ();
+	sunk.clear ();
+	stream.stop_poll ();
+}
+
+#ifdef SHAGA_THREADING
+TEST_F (Stream, DroppingSinkDoesNotBlockReading)
+{
+	Reader reader;
+	Reports reports;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool blocked = true;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_statistics_callback (reports.callback ());
+	streams.back ().set_read_spare_buffers (2);
+	streams.back ().add_read_sink ([&](const uint_fast32_t, const FtdiBuffer &) -> void {
+		std::unique_lock<std::mutex> lock (mutex);
+		cond.wait (lock, [&]() { return false == blocked; });
+	}, 1, FtdiStreamEntry::SinkOverflow::DROP);
+
+	FtdiStream stream (streams);
+	stream.set_dispatch_threads (1);
+	stream.start_poll ();
+
+	for (int i = 0; i < 5; ++i) {
+		FakeUsb::receive (std::to_string (i));
+	}
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload == "01234"; }));
+	ASSERT_TRUE (poll_until (stream, [&]() { return reports.sum (&FtdiStreamEntry::Statistics::sink_drops) > 0; }));
+
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		blocked = false;
+	}
+	cond.notify_all ();
+
+	stream.stop_poll ();
+	EXPECT_TRUE (stream.get_errors ().empty ());
+}
+#endif // SHAGA_THREADING
+
+TEST (Timing, Estimate)
+{
+	FtdiReadTiming timing;
+	timing.last_byte_ns = 1'000'000;
+	timing.previous_ns = 900'000;
+	timing.byte_ns = 1'000;
+	timing.length = 10;
+
+	EXPECT_EQ (timing.estimate (9), 1'000'000U);
+	EXPECT_EQ (timing.estimate (0), 991'000U);
+	EXPECT_EQ (timing.estimate (100), 1'000'000U);
+
+	/* Bytes never arrive before the previous transfer */
+	timing.previous_ns = 995'000;
+	EXPECT_EQ (timing.estimate (0), 995'000U);
+	EXPECT_EQ (timing.estimate (6), 997'000U);
+
+	timing.byte_ns = 0;
+	EXPECT_EQ (timing.estimate (0), 1'000'000U);
+}
+
+TEST_F (Stream, ReadTimingPrecedesPayload)
+{
+	Reader reader;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (2, 1);
+	streams.back ().set_read_timing_events (true);
+	streams.back ().set_read_callback (reader.callback ());
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	/* Short packet waited for the default latency timer of 16 ms */
+	const std::string first (100, 'a');
+	FakeUsb::receive (first);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == 100; }));
+
+	/* Full transfer is returned as soon as the last byte arrives */
+	const std::string second (2 * FakeUsb::packet_payload, 'b');
+	FakeUsb::receive (second);
+	ASSERT_TRUE (poll_until (stream, [&]() { return reader.payload.size () == 100 + second.size (); }));
+	stream.stop_poll ();
+
+	/* Timing comes once per transfer, payload once per packet */
+	const std::vector<std::string> expected {"T", "D" + first.substr (0, FakeUsb::packet_payload), "D" + first.substr (FakeUsb::packet_payload), "T", "D" + second.substr (0, FakeUsb::packet_payload), "D" + second.substr (FakeUsb::packet_payload)};
+	EXPECT_EQ (reader.events, expected);
+	ASSERT_EQ (reader.timings.size (), 2U);
+
+	const uint64_t byte_ns = 10 * 1'000'000'000ULL / 115'200;
+	const FtdiReadTiming &a = reader.timings[0];
+	EXPECT_EQ (a.length, 100U);
+	EXPECT_EQ (a.byte_ns, byte_ns);
+	EXPECT_EQ (a.previous_ns, 0U);
+	EXPECT_EQ (a.timestamp_ns - a.last_byte_ns, 8'000'000U);
+
+	const FtdiReadTiming &b = reader.timings[1];
+	EXPECT_EQ (b.length, second.size ());
+	EXPECT_EQ (b.previous_ns, a.last_byte_ns);
+	EXPECT_EQ (b.last_byte_ns, b.timestamp_ns);
+	EXPECT_EQ (b.estimate (second.size () - 2), b.last_byte_ns - byte_ns);
+
+	/* Transfer came faster than the line allows, first bytes are clamped to the previous one */
+	EXPECT_EQ (b.estimate (0), b.previous_ns);
+}
+
+TEST_F (Stream, BufferCarriesTiming)
+{
+	Reader reader;
+	std::vector<FtdiBuffer> buffers;
+
+	FtdiStreams streams;
+	streams.emplace_back (ftdi);
+	streams.back ().set_read_transfers (1, 1);
+	streams.back ().set_read_callback (reader.callback ());
+	streams.back ().set_read_buffer_callback ([&](const uint_fast32_t, const FtdiBuffer &buffer) -> void {
+		buffers.push_back (buffer);
+	});
+
+	FtdiStream stream (streams);
+	stream.start_poll ();
+
+	FakeUsb::receive ("abc"sv);
+	ASSERT_TRUE (poll_until (stream, [&]() { return buffers.size () == 1; }));
+	stream.stop_poll ();
+
+	/* Timing travels with the buffer, no READ_TIMING without set_read_timing_events */
+	const FtdiReadTiming timing = buffers[0].get_timing ();
+	EXPECT_EQ (timing.length, 3U);
+	EXPECT_EQ (timing.timestamp_ns, buffers[0].get_timestamp ());
+	EXPECT_EQ (timing.timestamp_ns - timing.last_byte_ns, 8'000'000U);
+	EXPECT_TRUE (reader.timings.empty ());
+	buffers.clear ();
+}